@@ -31,7 +31,7 @@ public void conv_test () throws Error
     var network = new Gann.Network (context, 0.5f, 0.99f, 1.0f);
     var input = network.create_input (64, 64, 3);
     network.create_conv (3, 1, 1, "softplus");
-    var output = network.create_output ();
+    var output = network.create_output (Gann.Loss.SQUARE_ERROR);
 
     input.set_data_bytes (pixbuf.get_pixels_with_length ());
 
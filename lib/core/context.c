@@ -22,8 +22,63 @@
 #include "context.h"
 #include "network.h"
 #include "util.h"
+#include "plan.h"
 #include "cl_code.h"
 
+struct program_entry
+{
+    char *key;
+    cl_program program;
+    int refs;
+
+    /* Deferred build data, released once the program is built */
+    GPtrArray *sources;
+    char *options;
+    GSList *handles;
+};
+
+struct kernel_request
+{
+    cl_program *program;
+    char *name;
+    cl_kernel *handle;
+};
+
+struct build
+{
+    struct context *ctx;
+
+    /* nested begin calls joining the session while it's collecting */
+    int depth;
+
+    GThreadPool *pool;
+    GHashTable *pendingtable;
+    GPtrArray *pendingkernels;
+
+    /* Number of programs still being built by the pool */
+    int pending;
+    GMutex mutex;
+    GCond cond;
+};
+
+static void
+program_entry_free (struct program_entry *entry)
+{
+    g_clear_pointer (&entry->program, clReleaseProgram);
+    g_clear_pointer (&entry->sources, g_ptr_array_unref);
+    g_clear_pointer (&entry->handles, g_slist_free);
+    g_free (entry->options);
+    g_free (entry->key);
+    g_free (entry);
+}
+
+static void
+kernel_request_free (struct kernel_request *req)
+{
+    g_free (req->name);
+    g_free (req);
+}
+
 static void
 add_activation_from_source (struct context *ctx,
                             const char *name,
@@ -36,12 +91,278 @@ add_activation_from_source (struct context *ctx,
     context_add_activation (ctx, name, code);
 }
 
+static int
+device_rank (cl_device_id device)
+{
+    cl_device_type type;
+    cl_int err;
+
+    err = clGetDeviceInfo (device, CL_DEVICE_TYPE,
+                           sizeof (type), &type, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    if (type & CL_DEVICE_TYPE_GPU) {
+        return 3;
+    }
+
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+        return 2;
+    }
+
+    if (type & CL_DEVICE_TYPE_CPU) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static gboolean
+select_device (struct context *ctx,
+               int platform,
+               int device,
+               cl_device_type type)
+{
+    cl_platform_id *plat_v;
+    cl_device_id *dev_v;
+    cl_uint plat_count, dev_count, p, d;
+    cl_int err;
+    int rank, best_rank;
+
+    err = clGetPlatformIDs (0, NULL, &plat_count);
+
+    if (err != CL_SUCCESS || plat_count == 0) {
+        return FALSE;
+    }
+
+    plat_v = g_new (cl_platform_id, plat_count);
+    err = clGetPlatformIDs (plat_count, plat_v, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    best_rank = -1;
+
+    for (p = 0; p < plat_count; p++) {
+        if (platform >= 0 && (cl_uint) platform != p) {
+            continue;
+        }
+
+        err = clGetDeviceIDs (plat_v[p], type, 0, NULL, &dev_count);
+
+        if (err != CL_SUCCESS || dev_count == 0) {
+            continue;
+        }
+
+        dev_v = g_new (cl_device_id, dev_count);
+        err = clGetDeviceIDs (plat_v[p], type, dev_count, dev_v, NULL);
+        g_assert (err == CL_SUCCESS);
+
+        for (d = 0; d < dev_count; d++) {
+            if (device >= 0 && (cl_uint) device != d) {
+                continue;
+            }
+
+            /*
+             * Prefer GPU, then accelerator, then CPU devices,
+             * the first one found wins within the same rank
+             */
+            rank = device_rank (dev_v[d]);
+
+            if (rank > best_rank) {
+                best_rank = rank;
+                ctx->platform = plat_v[p];
+                ctx->device = dev_v[d];
+            }
+        }
+
+        g_free (dev_v);
+    }
+
+    g_free (plat_v);
+
+    return best_rank >= 0;
+}
+
+static char *
+device_string (cl_device_id device,
+               cl_device_info info)
+{
+    size_t size;
+    char *str;
+
+    clGetDeviceInfo (device, info, 0, NULL, &size);
+    str = g_new0 (char, size + 1);
+    clGetDeviceInfo (device, info, size, str, NULL);
+
+    return str;
+}
+
+static void
+query_device (struct context *ctx)
+{
+    g_autofree char *vendor;
+    g_autofree char *version;
+    g_autofree char *driver;
+    cl_uint width;
+    cl_int err;
+    int size;
+
+    err = clGetDeviceInfo (ctx->device, CL_DEVICE_TYPE,
+                           sizeof (ctx->device_type),
+                           &ctx->device_type, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    err = clGetDeviceInfo (ctx->device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                           sizeof (ctx->max_group_size),
+                           &ctx->max_group_size, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    err = clGetDeviceInfo (ctx->device, CL_DEVICE_LOCAL_MEM_SIZE,
+                           sizeof (ctx->local_mem_size),
+                           &ctx->local_mem_size, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    err = clGetDeviceInfo (ctx->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                           sizeof (ctx->mem_align),
+                           &ctx->mem_align, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    /* reported in bits */
+    ctx->mem_align /= 8;
+
+    err = clGetDeviceInfo (ctx->device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+                           sizeof (width), &width, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    /*
+     * Scalar GPUs report width 1, but they still gain from
+     * wider loads, so never go below float4
+     */
+    ctx->vector_width = width >= 8 ? 8 : 4;
+
+    ctx->device_name = device_string (ctx->device, CL_DEVICE_NAME);
+    vendor = device_string (ctx->device, CL_DEVICE_VENDOR);
+    version = device_string (ctx->device, CL_DEVICE_VERSION);
+    driver = device_string (ctx->device, CL_DRIVER_VERSION);
+
+    ctx->cache_ident = g_strdup_printf ("%s/%s/%s/%s",
+                                        vendor, ctx->device_name,
+                                        version, driver);
+
+    /*
+     * CPU runtimes run a whole work-group on a single core, so
+     * smaller groups spread small layers over more cores
+     */
+    if (ctx->device_type & CL_DEVICE_TYPE_CPU) {
+        size = 64;
+    } else {
+        size = 256;
+    }
+
+    ctx->group_size = util_lower_power_2 (MIN (size,
+                                               (int) ctx->max_group_size));
+
+    /*
+     * Largest power of 2 which squared fits in the group size
+     */
+    ctx->gemm_tile = 1;
+
+    while (ctx->gemm_tile * ctx->gemm_tile * 4 <= ctx->group_size) {
+        ctx->gemm_tile *= 2;
+    }
+}
+
+static gboolean
+parse_device_spec (const char *spec,
+                   int *platform,
+                   int *device,
+                   cl_device_type *type)
+{
+    g_auto (GStrv) tokens = NULL;
+    char *end;
+    int i;
+
+    *platform = -1;
+    *device = -1;
+    *type = CL_DEVICE_TYPE_ALL;
+
+    if (spec == NULL || spec[0] == 0) {
+        return TRUE;
+    }
+
+    if (g_ascii_isdigit (spec[0])) {
+        *platform = g_ascii_strtoll (spec, &end, 10);
+
+        if (end[0] == ':' && g_ascii_isdigit (end[1])) {
+            *device = g_ascii_strtoll (end + 1, &end, 10);
+        }
+
+        /*
+         * Malformed specs mustn't pin the device partially
+         */
+        if (end[0] != 0) {
+            *platform = -1;
+            *device = -1;
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    tokens = g_strsplit (spec, "|", -1);
+    *type = 0;
+
+    for (i = 0; tokens[i] != NULL; i++) {
+        if (g_ascii_strcasecmp (tokens[i], "gpu") == 0) {
+            *type |= CL_DEVICE_TYPE_GPU;
+        } else if (g_ascii_strcasecmp (tokens[i], "cpu") == 0) {
+            *type |= CL_DEVICE_TYPE_CPU;
+        } else if (g_ascii_strcasecmp (tokens[i], "accelerator") == 0) {
+            *type |= CL_DEVICE_TYPE_ACCELERATOR;
+        } else if (g_ascii_strcasecmp (tokens[i], "all") == 0) {
+            *type |= CL_DEVICE_TYPE_ALL;
+        } else {
+            *type = CL_DEVICE_TYPE_ALL;
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 struct context *
 context_create ()
+{
+    struct context *ctx;
+
+    ctx = context_create_for_spec (g_getenv ("GANN_DEVICE"));
+
+    if (g_strcmp0 (g_getenv ("GANN_QUEUE"), "out-of-order") == 0) {
+        context_set_out_of_order (ctx, TRUE);
+    }
+
+    return ctx;
+}
+
+struct context *
+context_create_for_spec (const char *spec)
+{
+    cl_device_type type;
+    int platform, device;
+
+    if (!parse_device_spec (spec, &platform, &device, &type)) {
+        g_warning ("invalid device specification '%s', "
+                   "using the best available device", spec);
+    }
+
+    return context_create_for_device (platform, device, type);
+}
+
+struct context *
+context_create_for_device (int platform,
+                           int device,
+                           cl_device_type type)
 {
     struct context *ctx;
     cl_int err;
-    cl_platform_id plat_id;
 
     ctx = g_new0 (struct context, 1);
     ctx->netlist = NULL;
@@ -54,20 +375,38 @@ context_create ()
                                              g_str_equal);
     ctx->resource = cl_code_get_resource ();
     ctx->rand = g_rand_new_with_seed (0);
+    ctx->programtable = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              NULL,
+                                              (GDestroyNotify)
+                                              program_entry_free);
+    ctx->programrefs = g_hash_table_new (g_direct_hash,
+                                         g_direct_equal);
 
-    err = clGetPlatformIDs (1, &plat_id, NULL);
-    g_assert (err == 0);
+    if (!select_device (ctx, platform, device, type)) {
+        g_warning ("no OpenCL device matches platform %d, device %d, "
+                   "type 0x%x, falling back to the best available one",
+                   platform, device, (unsigned) type);
 
-    err = clGetDeviceIDs (plat_id, CL_DEVICE_TYPE_GPU, 1, &ctx->device, NULL);
-    g_assert (err == 0);
+        if (!select_device (ctx, -1, -1, CL_DEVICE_TYPE_ALL)) {
+            g_error ("no OpenCL device available");
+        }
+    }
+
+    query_device (ctx);
+
+    ctx->cache_dir = g_build_filename (g_get_user_cache_dir (),
+                                       "gann", NULL);
 
     ctx->context = clCreateContext (0, 1, &ctx->device, NULL, NULL, &err);
     g_assert (err == 0);
 
-    ctx->queue = clCreateCommandQueue (ctx->context, ctx->device, 0, &err);
+    ctx->ordered_queue = clCreateCommandQueue (ctx->context,
+                                               ctx->device,
+                                               0, &err);
     g_assert (err == 0);
 
-    ctx->group_size = 256;
+    ctx->queue = ctx->ordered_queue;
 
     add_activation_from_source (ctx, "sigmoid", "sigmoid.cl");
     add_activation_from_source (ctx, "softplus", "softplus.cl");
@@ -94,14 +433,22 @@ context_free (struct context *ctx)
     g_slist_foreach (nets, release_network, NULL);
     g_slist_free (nets);
     g_assert_null (ctx->netlist);
+    g_assert (ctx->build == NULL);
     g_hash_table_unref (ctx->codetable);
     g_hash_table_unref (ctx->activationtable);
+    g_hash_table_unref (ctx->programrefs);
+    g_hash_table_unref (ctx->programtable);
     g_rand_free (ctx->rand);
 
-    clReleaseCommandQueue (ctx->queue);
+    g_clear_pointer (&ctx->transfer_queue, clReleaseCommandQueue);
+    g_clear_pointer (&ctx->unordered_queue, clReleaseCommandQueue);
+    clReleaseCommandQueue (ctx->ordered_queue);
     clReleaseContext (ctx->context);
 
     /* TODO do we need to release ctx->device? */
+    g_free (ctx->device_name);
+    g_free (ctx->cache_ident);
+    g_free (ctx->cache_dir);
 
     if (ctx->options != NULL) {
         g_string_free (ctx->options, TRUE);
@@ -110,7 +457,7 @@ context_free (struct context *ctx)
     g_clear_pointer (&ctx->sources, g_ptr_array_unref);
     context_program_clear (ctx);
 
-    /* No need to release ctx->built_program, it's weak handle */
+    /* No need to release ctx->built_program, it's a weak pointer */
 
     g_free (ctx);
 }
@@ -212,26 +559,13 @@ context_program_code (struct context *ctx,
     g_ptr_array_insert (ctx->sources, -1, g_strdup (code));
 }
 
-void
-context_program_build (struct context *ctx,
-                       cl_program *handle)
+static void
+check_build (struct context *ctx,
+             cl_program prog,
+             cl_int err)
 {
     size_t logsize;
     char *log;
-    cl_program prog;
-    cl_int err;
-
-    prog = clCreateProgramWithSource (ctx->context,
-                                      ctx->sources->len,
-                                      (const char **)
-                                      ctx->sources->pdata,
-                                      NULL, &err);
-
-    g_assert (err == CL_SUCCESS);
-
-    err = clBuildProgram (prog, 0, NULL,
-                          ctx->options != NULL ? ctx->options->str : NULL,
-                          NULL, NULL);
 
     if (err != CL_SUCCESS) {
         clGetProgramBuildInfo (prog, ctx->device,
@@ -241,14 +575,483 @@ context_program_build (struct context *ctx,
         clGetProgramBuildInfo (prog, ctx->device,
                                CL_PROGRAM_BUILD_LOG,
                                logsize, log, NULL);
-        g_error (log);
+        g_error ("%s", log);
         g_free (log);
     }
+}
+
+static char *
+program_key (struct context *ctx,
+             int count,
+             const char **sources,
+             const char *options)
+{
+    g_autoptr (GChecksum) sum;
+    int i;
+
+    /*
+     * Key is made of every byte that might change the binary,
+     * strings are separated with zero bytes
+     */
+    sum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (sum, (const guint8 *) ctx->cache_ident, -1);
+    g_checksum_update (sum, (const guint8 *) "", 1);
+
+    if (options != NULL) {
+        g_checksum_update (sum, (const guint8 *) options, -1);
+    }
+
+    for (i = 0; i < count; i++) {
+        g_checksum_update (sum, (const guint8 *) "", 1);
+        g_checksum_update (sum, (const guint8 *) sources[i], -1);
+    }
+
+    return g_strdup (g_checksum_get_string (sum));
+}
+
+static char *
+cache_path (struct context *ctx,
+            const char *key)
+{
+    g_autofree char *name;
+
+    name = g_strdup_printf ("%s.bin", key);
+
+    return g_build_filename (ctx->cache_dir, name, NULL);
+}
+
+static cl_program
+cache_load (struct context *ctx,
+            const char *path,
+            const char *options)
+{
+    g_autofree char *data;
+    cl_program prog;
+    cl_int err, status;
+    size_t size;
+
+    if (!g_file_get_contents (path, &data, &size, NULL)) {
+        return NULL;
+    }
+
+    prog = clCreateProgramWithBinary (ctx->context, 1, &ctx->device,
+                                      &size,
+                                      (const unsigned char **) &data,
+                                      &status, &err);
+
+    if (err != CL_SUCCESS) {
+        return NULL;
+    }
+
+    if (status != CL_SUCCESS) {
+        clReleaseProgram (prog);
+        return NULL;
+    }
+
+    /*
+     * Binaries have to be built too, if the driver rejects
+     * the binary, then it's just rebuilt from the source
+     */
+    err = clBuildProgram (prog, 1, &ctx->device, options, NULL, NULL);
+
+    if (err != CL_SUCCESS) {
+        clReleaseProgram (prog);
+        return NULL;
+    }
+
+    return prog;
+}
+
+static void
+cache_store (struct context *ctx,
+             const char *path,
+             cl_program prog)
+{
+    g_autofree unsigned char *data;
+    g_autoptr (GError) error;
+    size_t size;
+    cl_int err;
+
+    data = NULL;
+    error = NULL;
+
+    err = clGetProgramInfo (prog, CL_PROGRAM_BINARY_SIZES,
+                            sizeof (size), &size, NULL);
+
+    if (err != CL_SUCCESS || size == 0) {
+        return;
+    }
+
+    data = g_new (unsigned char, size);
+
+    err = clGetProgramInfo (prog, CL_PROGRAM_BINARIES,
+                            sizeof (data), &data, NULL);
+
+    if (err != CL_SUCCESS) {
+        return;
+    }
+
+    g_mkdir_with_parents (ctx->cache_dir, 0700);
+
+    if (!g_file_set_contents (path, (const char *) data, size, &error)) {
+        g_debug ("cannot store program binary: %s", error->message);
+    }
+}
+
+static cl_program
+build_program (struct context *ctx,
+               const char *key,
+               int count,
+               const char **sources,
+               const char *options)
+{
+    g_autofree char *path;
+    cl_program prog;
+    cl_int err;
+
+    path = NULL;
+
+    if (ctx->cache_dir != NULL) {
+        path = cache_path (ctx, key);
+        prog = cache_load (ctx, path, options);
+
+        if (prog != NULL) {
+            g_atomic_int_inc (&ctx->cache_hits);
+            return prog;
+        }
+
+        g_atomic_int_inc (&ctx->cache_misses);
+    }
+
+    prog = clCreateProgramWithSource (ctx->context,
+                                      count, sources,
+                                      NULL, &err);
+    g_assert (err == CL_SUCCESS);
+
+    err = clBuildProgram (prog, 1, &ctx->device, options, NULL, NULL);
+    check_build (ctx, prog, err);
+
+    if (path != NULL) {
+        cache_store (ctx, path, prog);
+    }
+
+    return prog;
+}
+
+static struct program_entry *
+share_program (struct context *ctx,
+               GHashTable *table,
+               const char *key)
+{
+    struct program_entry *entry;
+
+    entry = g_hash_table_lookup (table, key);
+
+    if (entry != NULL) {
+        entry->refs++;
+        ctx->programs_shared++;
+    }
+
+    return entry;
+}
+
+cl_program
+context_build_program (struct context *ctx,
+                       int count,
+                       const char **sources,
+                       const char *options)
+{
+    struct program_entry *entry;
+    char *key;
+
+    key = program_key (ctx, count, sources, options);
+    entry = share_program (ctx, ctx->programtable, key);
+
+    if (entry != NULL) {
+        g_free (key);
+        return entry->program;
+    }
+
+    entry = g_new0 (struct program_entry, 1);
+    entry->key = key;
+    entry->program = build_program (ctx, key, count, sources, options);
+    entry->refs = 1;
+
+    g_hash_table_insert (ctx->programtable, entry->key, entry);
+    g_hash_table_insert (ctx->programrefs, entry->program, entry);
+
+    return entry->program;
+}
+
+static void
+build_entry (gpointer data,
+             gpointer user_data)
+{
+    struct program_entry *entry = data;
+    struct build *build = user_data;
+
+    entry->program = build_program (build->ctx, entry->key,
+                                    entry->sources->len,
+                                    (const char **) entry->sources->pdata,
+                                    entry->options);
+
+    g_mutex_lock (&build->mutex);
+
+    if (--build->pending == 0) {
+        g_cond_broadcast (&build->cond);
+    }
+
+    g_mutex_unlock (&build->mutex);
+}
+
+static void
+register_entry (struct context *ctx,
+                struct program_entry *entry)
+{
+    struct program_entry *other;
+    GSList *iter;
+
+    g_clear_pointer (&entry->sources, g_ptr_array_unref);
+    g_clear_pointer (&entry->options, g_free);
+
+    /*
+     * The same program might have been built meanwhile without
+     * deferring, keep the older one then
+     */
+    other = g_hash_table_lookup (ctx->programtable, entry->key);
+
+    if (other != NULL) {
+        other->refs += entry->refs;
+        ctx->programs_shared++;
+    } else {
+        other = entry;
+        g_hash_table_insert (ctx->programtable, entry->key, entry);
+        g_hash_table_insert (ctx->programrefs, entry->program, entry);
+    }
+
+    for (iter = entry->handles; iter != NULL; iter = iter->next) {
+        *(cl_program *) iter->data = other->program;
+    }
+
+    g_clear_pointer (&entry->handles, g_slist_free);
+
+    if (other != entry) {
+        program_entry_free (entry);
+    }
+}
+
+struct build *
+context_build_begin (struct context *ctx)
+{
+    struct build *build;
+
+    if (ctx->build != NULL) {
+        ctx->build->depth++;
+        return ctx->build;
+    }
+
+    build = g_new0 (struct build, 1);
+    build->ctx = ctx;
+    build->depth = 1;
+    build->pool = g_thread_pool_new (build_entry, build,
+                                     g_get_num_processors (),
+                                     FALSE, NULL);
+    build->pendingtable = g_hash_table_new (g_str_hash, g_str_equal);
+    build->pendingkernels = g_ptr_array_new_with_free_func
+        ((GDestroyNotify) kernel_request_free);
+    g_mutex_init (&build->mutex);
+    g_cond_init (&build->cond);
+
+    ctx->build = build;
+
+    return build;
+}
+
+void
+context_build_detach (struct context *ctx,
+                      struct build *build)
+{
+    if (ctx->build == build) {
+        ctx->build = NULL;
+    }
+}
+
+void
+context_build_wait (struct build *build)
+{
+    g_mutex_lock (&build->mutex);
+
+    while (build->pending > 0) {
+        g_cond_wait (&build->cond, &build->mutex);
+    }
+
+    g_mutex_unlock (&build->mutex);
+}
+
+void
+context_build_end (struct context *ctx,
+                   struct build *build)
+{
+    struct kernel_request *req;
+    GHashTableIter iter;
+    gpointer entry;
+    cl_int err;
+    guint i;
+
+    g_assert (build->ctx == ctx && build->depth > 0);
+
+    if (--build->depth > 0) {
+        return;
+    }
+
+    context_build_detach (ctx, build);
+    context_build_wait (build);
+    g_thread_pool_free (build->pool, FALSE, TRUE);
+
+    /*
+     * Fill program handles first, kernels refer to them
+     */
+    g_hash_table_iter_init (&iter, build->pendingtable);
+
+    while (g_hash_table_iter_next (&iter, NULL, &entry)) {
+        register_entry (ctx, entry);
+    }
+
+    for (i = 0; i < build->pendingkernels->len; i++) {
+        req = g_ptr_array_index (build->pendingkernels, i);
+        *req->handle = clCreateKernel (*req->program, req->name, &err);
+        g_assert (err == CL_SUCCESS);
+    }
+
+    g_hash_table_unref (build->pendingtable);
+    g_ptr_array_unref (build->pendingkernels);
+    g_mutex_clear (&build->mutex);
+    g_cond_clear (&build->cond);
+    g_free (build);
+}
+
+void
+context_queue_program (struct context *ctx,
+                       int count,
+                       const char **sources,
+                       const char *options,
+                       cl_program *handle)
+{
+    struct program_entry *entry;
+    struct build *build;
+    char *key;
+    int i;
+
+    build = ctx->build;
+
+    if (build == NULL) {
+        *handle = context_build_program (ctx, count, sources, options);
+        return;
+    }
+
+    key = program_key (ctx, count, sources, options);
+    entry = share_program (ctx, ctx->programtable, key);
+
+    if (entry != NULL) {
+        g_free (key);
+        *handle = entry->program;
+        return;
+    }
+
+    *handle = NULL;
+    entry = share_program (ctx, build->pendingtable, key);
+
+    if (entry != NULL) {
+        g_free (key);
+        entry->handles = g_slist_prepend (entry->handles, handle);
+        return;
+    }
+
+    /*
+     * Sources are copied as the caller might not keep them
+     * until the build is finished
+     */
+    entry = g_new0 (struct program_entry, 1);
+    entry->key = key;
+    entry->refs = 1;
+    entry->handles = g_slist_prepend (NULL, handle);
+    entry->sources = g_ptr_array_new_with_free_func (g_free);
+    entry->options = g_strdup (options);
+
+    for (i = 0; i < count; i++) {
+        g_ptr_array_add (entry->sources, g_strdup (sources[i]));
+    }
+
+    g_hash_table_insert (build->pendingtable, entry->key, entry);
+
+    g_mutex_lock (&build->mutex);
+    build->pending++;
+    g_mutex_unlock (&build->mutex);
+
+    g_thread_pool_push (build->pool, entry, NULL);
+}
+
+void
+context_queue_kernel (struct context *ctx,
+                      cl_program *program,
+                      const char *name,
+                      cl_kernel *handle)
+{
+    struct kernel_request *req;
+    cl_int err;
+
+    if (ctx->build == NULL) {
+        *handle = clCreateKernel (*program, name, &err);
+        g_assert (err == CL_SUCCESS);
+        return;
+    }
+
+    req = g_new (struct kernel_request, 1);
+    req->program = program;
+    req->name = g_strdup (name);
+    req->handle = handle;
+
+    *handle = NULL;
+    g_ptr_array_add (ctx->build->pendingkernels, req);
+}
+
+void
+context_program_release (struct context *ctx,
+                         cl_program prog)
+{
+    struct program_entry *entry;
+
+    entry = g_hash_table_lookup (ctx->programrefs, prog);
+    g_assert (entry != NULL);
+
+    if (--entry->refs == 0) {
+        g_hash_table_remove (ctx->programrefs, prog);
+        g_hash_table_remove (ctx->programtable, entry->key);
+    }
+}
+
+void
+context_set_cache_dir (struct context *ctx,
+                       const char *dir)
+{
+    g_free (ctx->cache_dir);
+    ctx->cache_dir = g_strdup (dir);
+}
+
+void
+context_program_build (struct context *ctx,
+                       cl_program *handle)
+{
+    context_queue_program (ctx,
+                           ctx->sources->len,
+                           (const char **) ctx->sources->pdata,
+                           ctx->options != NULL ?
+                           ctx->options->str : NULL,
+                           handle);
 
     context_program_clear (ctx);
 
-    ctx->built_program = prog;
-    *handle = prog;
+    ctx->built_program = handle;
 }
 
 void
@@ -256,13 +1059,7 @@ context_program_kernel (struct context *ctx,
                         const char *name,
                         cl_kernel *handle)
 {
-    cl_kernel kern;
-    cl_int err;
-
-    kern = clCreateKernel (ctx->built_program, name, &err);
-    g_assert (err == CL_SUCCESS);
-
-    *handle = kern;
+    context_queue_kernel (ctx, ctx->built_program, name, handle);
 }
 
 void
@@ -271,21 +1068,78 @@ context_clear_buffer (struct context *ctx,
                       cl_int size,
                       cl_event *ev)
 {
-    g_autofree float *value_v;
-    int i;
+    cl_float zero;
+    cl_int err;
+
+    zero = 0;
 
-    value_v = g_new (float, size);
+    err = clEnqueueFillBuffer (ctx->queue,
+                               mem,
+                               &zero, sizeof (zero),
+                               0, size * sizeof (cl_float),
+                               0, NULL, ev);
+    g_assert (err == CL_SUCCESS);
+}
 
-    for (i = 0; i < size; i++) {
-        value_v[i] = 0;
+gboolean
+context_set_out_of_order (struct context *ctx,
+                          gboolean enable)
+{
+    cl_command_queue_properties props;
+    cl_command_queue queue;
+    cl_int err;
+
+    if (enable && ctx->unordered_queue == NULL) {
+        err = clGetDeviceInfo (ctx->device, CL_DEVICE_QUEUE_PROPERTIES,
+                               sizeof (props), &props, NULL);
+
+        if (err != CL_SUCCESS
+            || !(props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+            g_warning ("device %s doesn't support out-of-order "
+                       "execution", ctx->device_name);
+            return FALSE;
+        }
+
+        ctx->unordered_queue =
+            clCreateCommandQueue (ctx->context, ctx->device,
+                                  CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+                                  &err);
+        g_assert (err == CL_SUCCESS);
+    }
+
+    queue = enable ? ctx->unordered_queue : ctx->ordered_queue;
+
+    /*
+     * Events order tasks across queues, but nothing orders them
+     * with the ones enqueued without events before the switch
+     */
+    if (queue != ctx->queue) {
+        clFinish (ctx->queue);
+        ctx->queue = queue;
     }
 
-    clEnqueueWriteBuffer (ctx->queue,
-                          mem,
-                          CL_TRUE,
-                          0, size * sizeof (cl_float),
-                          value_v,
-                          0, NULL, ev);
+    return enable;
+}
+
+gboolean
+context_out_of_order (struct context *ctx)
+{
+    return ctx->queue != ctx->ordered_queue;
+}
+
+cl_command_queue
+context_transfer_queue (struct context *ctx)
+{
+    cl_int err;
+
+    if (ctx->transfer_queue == NULL) {
+        ctx->transfer_queue = clCreateCommandQueue (ctx->context,
+                                                    ctx->device,
+                                                    0, &err);
+        g_assert (err == 0);
+    }
+
+    return ctx->transfer_queue;
 }
 
 void
@@ -297,14 +1151,73 @@ context_run_sparse (struct context *ctx,
                     cl_event *ev)
 {
     size_t globsize, locsize;
-    cl_int err;
 
     locsize = MIN (ctx->group_size, units);
     globsize = util_upper_multiply (units, locsize);
 
+    context_run_kernel (ctx, kern, 1,
+                        &globsize, &locsize,
+                        evcnt, evlist, ev);
+}
+
+void
+context_run_gemm (struct context *ctx,
+                  cl_kernel kern,
+                  int rows,
+                  int cols,
+                  cl_int evcnt,
+                  const cl_event *evlist,
+                  cl_event *ev)
+{
+    size_t globsize[2], locsize[2];
+
+    locsize[0] = ctx->gemm_tile;
+    locsize[1] = ctx->gemm_tile;
+    globsize[0] = util_upper_multiply (cols, ctx->gemm_tile);
+    globsize[1] = util_upper_multiply (rows, ctx->gemm_tile);
+
+    context_run_kernel (ctx, kern, 2,
+                        globsize, locsize,
+                        evcnt, evlist, ev);
+}
+
+void
+context_run_kernel (struct context *ctx,
+                    cl_kernel kern,
+                    cl_uint dims,
+                    const size_t *globsiz,
+                    const size_t *locsiz,
+                    cl_int evcnt,
+                    const cl_event *evlist,
+                    cl_event *ev)
+{
+    cl_int err;
+
     err = clEnqueueNDRangeKernel (ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsize, &locsize,
+                                  kern, dims, NULL,
+                                  globsiz, locsiz,
                                   evcnt, evlist, ev);
     g_assert (err == CL_SUCCESS);
+
+    if (ctx->recording != NULL) {
+        plan_record (ctx->recording, kern, dims, globsiz, locsiz,
+                     evcnt, evlist, ev);
+    }
+}
+
+void
+context_mark (struct context *ctx,
+              cl_int evcnt,
+              const cl_event *evlist,
+              cl_event *ev)
+{
+    cl_int err;
+
+    err = clEnqueueMarkerWithWaitList (ctx->queue, evcnt, evlist, ev);
+    g_assert (err == CL_SUCCESS);
+
+    if (ctx->recording != NULL) {
+        plan_record (ctx->recording, NULL, 0, NULL, NULL,
+                     evcnt, evlist, ev);
+    }
 }
@@ -28,10 +28,17 @@
 #include <glib.h>
 #include <gio/gio.h>
 
+struct plan;
+struct build;
+
 struct context
 {
+    /* Work-group size for one dimensional kernels, picked per device */
     int group_size;
 
+    /* Side of square work-groups of blocked matrix kernels */
+    int gemm_tile;
+
     /* List of network instances */
     GSList *netlist;
 
@@ -48,22 +55,97 @@ struct context
     GRand *rand;
 
     /* OpenCL context handles */
+    cl_platform_id platform;
     cl_device_id device;
     cl_context context;
     cl_command_queue queue;
 
+    /*
+     * Both kinds of the main queue, $queue is one of them. The out
+     * of order one is created on demand, tasks enqueued to it run
+     * as soon as the events they wait for are completed
+     */
+    cl_command_queue ordered_queue;
+    cl_command_queue unordered_queue;
+
+    /* Queue of host to device copies, created on demand */
+    cl_command_queue transfer_queue;
+
+    /* Selected device properties */
+    cl_device_type device_type;
+    size_t max_group_size;
+    cl_ulong local_mem_size;
+    char *device_name;
+
+    /* Alignment of sub-buffer origins in bytes */
+    cl_uint mem_align;
+
+    /* Float vector width used by vectorized kernels, 4 or 8 */
+    int vector_width;
+
     /* Program making variables */
     GString *options;
     GPtrArray *sources;
-    cl_program built_program;
+    cl_program *built_program;
+
+    /* Program binary cache directory, NULL if caching is disabled */
+    char *cache_dir;
+
+    /* Device and driver identity mixed into the cache keys */
+    char *cache_ident;
+
+    /* Binary cache statistics */
+    int cache_hits;
+    int cache_misses;
+
+    /* Shared programs, by key and by program handle */
+    GHashTable *programtable;
+    GHashTable *programrefs;
+
+    /* Number of builds avoided by sharing programs */
+    int programs_shared;
+
+    /*
+     * Deferred build session collecting queued programs, if any.
+     * Detached sessions keep building on their own, so they don't
+     * affect later compiles
+     */
+    struct build *build;
+
+    /* Plan recording tasks enqueued by the run functions, if any */
+    struct plan *recording;
 };
 
 /*
  * context_create
- * Creates new context
+ * Creates new context on the device described by GANN_DEVICE
+ * environment variable or on the best available device if the
+ * variable is not set
  */
 struct context *context_create ();
 
+/*
+ * context_create_for_spec
+ * Creates new context on the device described by the string
+ * spec: device specification, one of "gpu", "cpu", "accelerator",
+ * "all" (may be joined with '|' like "gpu|cpu") or platform and
+ * device indices "P:D" or just platform index "P". NULL selects
+ * the best available device
+ */
+struct context *context_create_for_spec (const char *spec);
+
+/*
+ * context_create_for_device
+ * Creates new context on the selected device. If there's no
+ * matching device the best available one is used instead
+ * platform: platform index or -1 for any platform
+ * device: device index within the platform or -1 for the best one
+ * type: mask of accepted device types
+ */
+struct context *context_create_for_device (int platform,
+                                           int device,
+                                           cl_device_type type);
+
 /*
  * context_free
  * Frees the context
@@ -135,12 +217,115 @@ void context_program_code (struct context *ctx,
 
 /*
  * context_program_build
- * Build program with properties set before,
+ * Build program with properties set before, deferred like
+ * context_queue_program
  * handle: pointer to program handle
  */
 void context_program_build (struct context *ctx,
                             cl_program *handle);
 
+/*
+ * context_build_program
+ * Gives program built from given sources. Programs with the same
+ * sources and options are shared within the context, new ones are
+ * looked up in the on-disk binary cache first and stored there
+ * after building
+ * count: number of sources
+ * sources: array of source strings
+ * options: (nullable) build options
+ * returns: program reference, should be released with
+ * context_program_release
+ */
+cl_program context_build_program (struct context *ctx,
+                                  int count,
+                                  const char **sources,
+                                  const char *options);
+
+/*
+ * context_program_release
+ * Releases program reference given by context_build_program
+ * or context_program_build
+ * prog: program handle
+ */
+void context_program_release (struct context *ctx,
+                              cl_program prog);
+
+/*
+ * context_set_cache_dir
+ * Sets program binary cache directory, by default it's
+ * $XDG_CACHE_HOME/gann
+ * dir: (nullable) directory path, NULL disables the cache
+ */
+void context_set_cache_dir (struct context *ctx,
+                            const char *dir);
+
+/*
+ * context_build_begin
+ * Starts deferred build session. Until it's detached, programs
+ * queued through the context are built concurrently in the
+ * background while the caller goes on, and program and kernel
+ * handles are filled by the matching context_build_end. Calls
+ * made while a session is collecting join it, only the outermost
+ * end counts then
+ * returns: the session
+ */
+struct build *context_build_begin (struct context *ctx);
+
+/*
+ * context_build_detach
+ * Stops the session from collecting queued programs, the ones
+ * queued so far keep building. Later compiles don't join it
+ * build: the session
+ */
+void context_build_detach (struct context *ctx,
+                           struct build *build);
+
+/*
+ * context_build_wait
+ * Blocks until all programs of the session are built, it's safe
+ * to call from other thread than the one which queued them
+ * build: the session
+ */
+void context_build_wait (struct build *build);
+
+/*
+ * context_build_end
+ * Finishes deferred building, waits for the programs and fills
+ * all queued program and kernel handles. The session is freed
+ * unless it's a nested call
+ * build: the session
+ */
+void context_build_end (struct context *ctx,
+                        struct build *build);
+
+/*
+ * context_queue_program
+ * Same as context_build_program, but when building is deferred
+ * the program is built in background and the handle is set by
+ * context_build_end
+ * handle: pointer to program handle, has to be valid until
+ * building is finished
+ */
+void context_queue_program (struct context *ctx,
+                            int count,
+                            const char **sources,
+                            const char *options,
+                            cl_program *handle);
+
+/*
+ * context_queue_kernel
+ * Makes kernel for the program, deferred like the program
+ * itself if building is deferred
+ * program: pointer to program handle given to
+ * context_queue_program
+ * name: name of the kernel
+ * handle: pointer to the kernel handle
+ */
+void context_queue_kernel (struct context *ctx,
+                           cl_program *program,
+                           const char *name,
+                           cl_kernel *handle);
+
 /*
  * context_program_kernel
  * Makes kernel for the program built before
@@ -153,7 +338,7 @@ void context_program_kernel (struct context *ctx,
 
 /*
  * context_clear_buffer:
- * Clears buffer with float values
+ * Enqueues clearing buffer with float values, doesn't block
  * mem: buffer handle
  * size: number of float values in buffer
  * ev: pointer to event handle
@@ -163,6 +348,33 @@ void context_clear_buffer (struct context *ctx,
                            cl_int size,
                            cl_event *ev);
 
+/*
+ * context_set_out_of_order
+ * Switches the main queue between in-order and out-of-order
+ * execution, the latter is also selected by GANN_QUEUE=out-of-order
+ * environment variable. Tasks already enqueued are finished first.
+ * Devices without out-of-order queues stay in order
+ * enable: whether to execute out of order
+ * returns: whether the queue executes out of order now
+ */
+gboolean context_set_out_of_order (struct context *ctx,
+                                   gboolean enable);
+
+/*
+ * context_out_of_order
+ * returns: whether the main queue executes out of order
+ */
+gboolean context_out_of_order (struct context *ctx);
+
+/*
+ * context_transfer_queue
+ * Gives the second command queue for host to device copies, so
+ * they may overlap with kernels of the main queue. It's created
+ * on first call
+ * returns: queue handle
+ */
+cl_command_queue context_transfer_queue (struct context *ctx);
+
 /*
  * context_run_sparse
  * Runs given kernel on as many computation units
@@ -179,3 +391,56 @@ void context_run_sparse (struct context *ctx,
                          cl_int evcnt,
                          const cl_event *evlist,
                          cl_event *ev);
+
+/*
+ * context_run_gemm
+ * Runs given kernel built with gemm.cl over the M x N result
+ * matrix in square work-groups
+ * kern: kernel handle
+ * rows: number of result rows (M)
+ * cols: number of result columns (N)
+ * evcnt: number of events to the queue
+ * evlist: event list to the queue
+ * ev: handle to the event
+ */
+void context_run_gemm (struct context *ctx,
+                       cl_kernel kern,
+                       int rows,
+                       int cols,
+                       cl_int evcnt,
+                       const cl_event *evlist,
+                       cl_event *ev);
+
+/*
+ * context_run_kernel
+ * Runs given kernel, all layer kernels are run through it or the
+ * functions above, so they can be recorded to execution plans
+ * kern: kernel handle
+ * dims: number of dimensions
+ * globsiz: global size of each dimension
+ * locsiz: (nullable) local size of each dimension
+ * evcnt: number of events to the queue
+ * evlist: event list to the queue
+ * ev: handle to the event
+ */
+void context_run_kernel (struct context *ctx,
+                         cl_kernel kern,
+                         cl_uint dims,
+                         const size_t *globsiz,
+                         const size_t *locsiz,
+                         cl_int evcnt,
+                         const cl_event *evlist,
+                         cl_event *ev);
+
+/*
+ * context_mark
+ * Enqueues marker completed with the given events, recorded
+ * to execution plans like kernels
+ * evcnt: number of events
+ * evlist: event list
+ * ev: handle to the event
+ */
+void context_mark (struct context *ctx,
+                   cl_int evcnt,
+                   const cl_event *evlist,
+                   cl_event *ev);
@@ -21,8 +21,28 @@
 
 #include "layer.h"
 #include "network.h"
+#include "context.h"
 #include "util.h"
 
+#include <math.h>
+
+/*
+ * Tiled forward parameters, max number of output channels computed
+ * by a work-item and max edge of the output block computed by
+ * a work-group
+ */
+#define TILED_CHANNELS 4
+#define TILED_EDGE 16
+
+/*
+ * Automatic GEMM backend selection, min number of filters and
+ * filter size which pay for unrolling the input, and max size of
+ * the column matrix in number of values
+ */
+#define GEMM_MIN_FILTERS 16
+#define GEMM_MIN_FILTER_SIZE 16
+#define GEMM_MAX_COLUMNS (64 * 1024 * 1024)
+
 struct conv_layer
 {
     struct layer base;
@@ -31,16 +51,59 @@ struct conv_layer
     int kstride;
     int kxshift;
     int kyshift;
-    float *kbuffer;
+
+    /* padding mode and explicit padding sizes */
+    enum conv_padding padding;
+    int xpad;
+    int ypad;
     cl_program program;
     cl_kernel forward;
-    cl_mem zero_mem;
+    cl_kernel derive_gradient;
+    cl_kernel backward;
+    cl_kernel backward_bias;
+    cl_kernel propagate;
+    cl_kernel im2col;
+    cl_kernel col2im;
+    cl_kernel winograd_filter;
+    cl_kernel winograd_input;
+    cl_kernel winograd_product;
+
+    /* Winograd transformed filters, valid until next weights update */
+    cl_mem transform_mem;
+    gboolean transformed;
+
+    /* convolution strategy, resolved at compile time */
+    enum conv_backend backend;
+
+    /* one filter per channel */
+    gboolean depthwise;
+
+    /* 1x1 stride 1 unpadded filters, input is its own column matrix */
+    gboolean pointwise;
+
+    /* output block and channels per work-item of tiled forward,
+     * 0 if not tiled */
+    int tile_width;
+    int tile_height;
+    int channels;
 };
 
 static void compile (struct layer *lay);
 static void forward (struct layer *lay);
 static void backward (struct layer *lay);
 static void release (struct layer *lay);
+static enum conv_backend choose_backend (struct layer *lay);
+static gboolean setup_tiled (struct layer *lay);
+static void unroll (struct layer *lay, cl_event dep, cl_event *ev);
+static void forward_winograd (struct layer *lay);
+static int output_size (enum conv_padding padding,
+                        int input, int kernel, int stride,
+                        int pad, int *shift);
+static void run_volume (struct layer *lay, cl_kernel kern,
+                        int width, int height, int depth,
+                        const size_t *locsiz,
+                        cl_int evcnt, const cl_event *evlist,
+                        cl_event *ev);
 
 struct layer *
 layer_make_conv (struct network *net,
@@ -65,13 +128,74 @@ layer_make_conv (struct network *net,
     conv->kwidth = size;
     conv->kheight = size;
     conv->kstride = stride;
-    conv->kxshift = -size / 2;
-    conv->kyshift = -size / 2;
-    conv->kbuffer = g_new (float, lay->weights);
+    conv->padding = CONV_PADDING_SAME;
+    conv->backend = CONV_BACKEND_AUTO;
+
+    return lay;
+}
+
+struct layer *
+layer_make_depthwise (struct network *net,
+                      int size, int stride,
+                      const char *activation)
+{
+    struct conv_layer *conv;
+    struct layer *lay;
+
+    /* depth is taken from the previous layer at compile time */
+    lay = layer_make_conv (net, size, stride, 0, activation);
+    conv = (struct conv_layer *) lay;
+    conv->depthwise = TRUE;
+    conv->backend = CONV_BACKEND_DIRECT;
+
+    return lay;
+}
+
+struct layer *
+layer_make_pointwise (struct network *net,
+                      int filters,
+                      const char *activation)
+{
+    struct conv_layer *conv;
+    struct layer *lay;
+
+    lay = layer_make_conv (net, 1, 1, filters, activation);
+    conv = (struct conv_layer *) lay;
+    conv->backend = CONV_BACKEND_GEMM;
 
     return lay;
 }
 
+void
+layer_conv_set_padding (struct layer *lay,
+                        enum conv_padding padding,
+                        int xpad, int ypad)
+{
+    struct conv_layer *conv;
+
+    g_assert (lay->type == LAYER_CONV);
+    g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
+    g_assert (xpad >= 0 && ypad >= 0);
+
+    conv = (struct conv_layer *) lay;
+    conv->padding = padding;
+    conv->xpad = xpad;
+    conv->ypad = ypad;
+}
+
+void
+layer_conv_set_backend (struct layer *lay,
+                        enum conv_backend backend)
+{
+    struct conv_layer *conv;
+
+    g_assert (lay->type == LAYER_CONV);
+    g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
+
+    conv = (struct conv_layer *) lay;
+    conv->backend = backend;
+}
+
 static void
 compile (struct layer *lay)
 {
@@ -79,62 +203,70 @@ compile (struct layer *lay)
     struct layer *prev;
     struct context *ctx;
     g_autofree float *weight_v;
-    int z, y, x, d, i;
+    GRand *rand;
+    int fanin, tiles, i;
 
     g_assert (lay->type == LAYER_CONV);
+    g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
 
     conv = (struct conv_layer *) lay;
     ctx = lay->net->ctx;
-    lay->weights = conv->kwidth * conv->kheight
-        * lay->prev->depth * lay->depth;
-
+    rand = ctx->rand;
     prev = lay->prev;
 
-    lay->width = prev->width;
-    lay->height = prev->height;
+    if (conv->depthwise) {
+        lay->depth = prev->depth;
+        fanin = conv->kwidth * conv->kheight;
+    } else {
+        fanin = conv->kwidth * conv->kheight * prev->depth;
+    }
+
+    lay->weights = fanin * lay->depth;
+    lay->width = output_size (conv->padding,
+                              prev->width, conv->kwidth, conv->kstride,
+                              conv->xpad, &conv->kxshift);
+    lay->height = output_size (conv->padding,
+                               prev->height, conv->kheight, conv->kstride,
+                               conv->ypad, &conv->kyshift);
     lay->size = lay->width * lay->height * lay->depth;
+    conv->pointwise = conv->kwidth == 1 && conv->kheight == 1
+        && conv->kstride == 1 && conv->kxshift == 0 && conv->kyshift == 0
+        && lay->width == prev->width && lay->height == prev->height;
+
 
     /*
-     * Create buffers
+     * Create buffers, there is a single bias per filter, and the
+     * backpropagation ones are created only if it's enabled
      */
-    layer_create_buffer (lay, &lay->value_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->derivative_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->gradient_mem,
-                         lay->size, CL_MEM_READ_WRITE);
+    layer_create_value (lay);
     layer_create_buffer (lay, &lay->bias_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->bias_delta_mem,
-                         lay->size, CL_MEM_READ_WRITE);
+                         lay->depth, CL_MEM_READ_WRITE);
     layer_create_buffer (lay, &lay->weight_mem,
                          lay->weights, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->delta_mem,
-                         lay->weights, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &conv->zero_mem,
-                         lay->prev->depth, CL_MEM_READ_WRITE);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        layer_create_buffer (lay, &lay->derivative_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->gradient_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->bias_delta_mem,
+                             lay->depth, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->delta_mem,
+                             lay->weights, CL_MEM_READ_WRITE);
+    }
+
 
     /*
-     * Set weights
+     * Randomize weights, scaled by the filter's fan-in
      */
     weight_v = g_new (float, lay->weights);
 
-    for (z = 0; z < lay->depth; z++) {
-        for (y = 0; y < conv->kheight; y++) {
-            for (x = 0; x < conv->kwidth; x++) {
-                for (d = 0; d < lay->prev->depth; d++) {
-                    i = z * conv->kwidth * conv->kheight * lay->prev->depth
-                        + y * conv->kwidth * lay->prev->depth
-                        + x * lay->prev->depth
-                        + d;
-                    if (x == 1 && y == 1) {
-                        weight_v[i] = 1.0f / 3;
-                    } else {
-                        weight_v[i] = 0.0f;
-                    }
-                }
-            }
-        }
+    for (i = 0; i < lay->weights; i++) {
+        float r1 = 2.0f * (float) M_PI * (float) g_rand_double (rand);
+        float r2 = -2.0f  * logf ((float) g_rand_double (rand));
+        float d = (cosf (r1) * sqrtf (r2)) * sqrtf (2.0f / fanin);
+
+        weight_v[i] = d;
     }
 
     clEnqueueWriteBuffer (ctx->queue,
@@ -144,38 +276,144 @@ compile (struct layer *lay)
                           weight_v,
                           0, NULL, NULL);
 
+
     /*
      * Clear other buffers
      */
-    context_clear_buffer (ctx, lay->bias_mem, lay->size, NULL);
-    context_clear_buffer (ctx, lay->bias_delta_mem, lay->size, NULL);
-    context_clear_buffer (ctx, lay->delta_mem, lay->weights, NULL);
-    context_clear_buffer (ctx, conv->zero_mem, lay->prev->depth, NULL);
+    context_clear_buffer (ctx, lay->bias_mem, lay->depth, NULL);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        context_clear_buffer (ctx, lay->bias_delta_mem, lay->depth, NULL);
+        context_clear_buffer (ctx, lay->delta_mem, lay->weights, NULL);
+    }
+
 
     /*
      * Build CL program
      */
     context_program_clear (ctx);
-    context_program_file (ctx, "conv-layer.cl");
+    if (g_strcmp0 (lay->activation, "linear") != 0) {
+        context_program_activation (ctx, lay->activation);
+        context_program_option (ctx, "-DWITH_ACTIVATION");
+    }
     context_program_option (ctx, "-DKERNEL_WIDTH=%d", conv->kwidth);
     context_program_option (ctx, "-DKERNEL_HEIGHT=%d", conv->kheight);
-    context_program_option (ctx, "-DKERNEL_DEPTH=%d", lay->depth);
     context_program_option (ctx, "-DKERNEL_STRIDE=%d", conv->kstride);
     context_program_option (ctx, "-DKERNEL_X_SHIFT=%d", conv->kxshift);
     context_program_option (ctx, "-DKERNEL_Y_SHIFT=%d", conv->kyshift);
     context_program_option (ctx, "-DWIDTH=%d", lay->width);
     context_program_option (ctx, "-DHEIGHT=%d", lay->height);
     context_program_option (ctx, "-DDEPTH=%d", lay->depth);
-    context_program_option (ctx, "-DINPUT_WIDTH=%d", lay->prev->width);
-    context_program_option (ctx, "-DINPUT_HEIGHT=%d", lay->prev->height);
-    context_program_option (ctx, "-DINPUT_DEPTH=%d", lay->prev->depth);
+    context_program_option (ctx, "-DINPUT_WIDTH=%d", prev->width);
+    context_program_option (ctx, "-DINPUT_HEIGHT=%d", prev->height);
+    context_program_option (ctx, "-DINPUT_DEPTH=%d", prev->depth);
+    context_program_option (ctx, "-DBATCH=%d", lay->batch);
+
+    if (conv->padding == CONV_PADDING_VALID) {
+        context_program_option (ctx, "-DPADDING_VALID");
+    }
+
+    if (conv->depthwise) {
+        conv->backend = CONV_BACKEND_DIRECT;
+        context_program_option (ctx, "-DDEPTHWISE");
+    }
+
+    if (conv->backend == CONV_BACKEND_AUTO) {
+        conv->backend = choose_backend (lay);
+    }
+
+    if (conv->backend == CONV_BACKEND_TILED && !setup_tiled (lay)) {
+        conv->backend = CONV_BACKEND_DIRECT;
+    }
+
+    if (conv->backend == CONV_BACKEND_WINOGRAD
+        && (conv->kwidth != 3 || conv->kheight != 3 || conv->kstride != 1)) {
+        conv->backend = CONV_BACKEND_DIRECT;
+    }
+
+    if (conv->backend == CONV_BACKEND_WINOGRAD) {
+        tiles = lay->batch * ((lay->width + 1) / 2)
+            * ((lay->height + 1) / 2);
+
+        network_reserve_scratch (lay->net,
+                                 16 * tiles * (prev->depth + lay->depth));
+        layer_create_buffer (lay, &conv->transform_mem,
+                             16 * prev->depth * lay->depth,
+                             CL_MEM_READ_WRITE);
+
+        context_program_file (ctx, "gemm.cl");
+        context_program_option (ctx, "-DWITH_WINOGRAD");
+        context_program_option (ctx, "-DGEMM_TILE=%d", ctx->gemm_tile);
+    }
+
+    if (conv->backend == CONV_BACKEND_GEMM && conv->pointwise) {
+        context_program_option (ctx, "-DPOINTWISE");
+    } else if (conv->backend == CONV_BACKEND_GEMM) {
+        network_reserve_scratch (lay->net,
+                                 lay->batch * lay->width * lay->height
+                                 * fanin);
+    }
+
+    if (conv->backend == CONV_BACKEND_GEMM) {
+        context_program_file (ctx, "gemm.cl");
+        context_program_option (ctx, "-DWITH_GEMM");
+        context_program_option (ctx, "-DGEMM_TILE=%d", ctx->gemm_tile);
+    }
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        context_program_option (ctx, "-DWITH_DERIVATIVE");
+    }
+
+    if ((lay->net->flags & NETWORK_FLAG_UNFUSED) == 0) {
+        context_program_option (ctx, "-DFUSED_DERIVATIVE");
+    }
+
+    if (prev->gradient_mem != 0) {
+        context_program_option (ctx, "-DCALC_GRADIENT");
+    }
+
+    context_program_file (ctx, "conv-layer.cl");
     context_program_build (ctx, &conv->program);
-    context_program_kernel (ctx, "forward", &conv->forward);
+
+    if (conv->backend == CONV_BACKEND_WINOGRAD) {
+        /* output transform takes the place of forward */
+        context_program_kernel (ctx, "winograd_output", &conv->forward);
+        context_program_kernel (ctx, "winograd_filter",
+                                &conv->winograd_filter);
+        context_program_kernel (ctx, "winograd_input",
+                                &conv->winograd_input);
+        context_program_kernel (ctx, "winograd_product",
+                                &conv->winograd_product);
+    } else {
+        context_program_kernel (ctx, "forward", &conv->forward);
+    }
 
     /*
-     * Synchronize
+     * Backward kernels are defined along with derivatives
      */
-    clFinish (ctx->queue);
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        context_program_kernel (ctx, "backward", &conv->backward);
+        context_program_kernel (ctx, "backward_bias",
+                                &conv->backward_bias);
+    }
+
+    if ((lay->net->flags & NETWORK_FLAG_BACKPROP) != 0
+        && (lay->net->flags & NETWORK_FLAG_UNFUSED) != 0) {
+        context_program_kernel (ctx, "derive_gradient",
+                                &conv->derive_gradient);
+    }
+
+    if (prev->gradient_mem != 0) {
+        context_program_kernel (ctx, "propagate", &conv->propagate);
+    }
+
+    if (conv->backend == CONV_BACKEND_GEMM && !conv->pointwise) {
+        context_program_kernel (ctx, "im2col", &conv->im2col);
+
+        if (prev->gradient_mem != 0) {
+            context_program_kernel (ctx, "col2im", &conv->col2im);
+        }
+    }
 
     /*
      * Mark compiled
@@ -187,42 +425,325 @@ static void
 forward (struct layer *lay)
 {
     struct conv_layer *conv;
-    size_t globsiz[3], locsiz[3];
+    size_t locsiz[3];
+    cl_event evunroll;
     cl_kernel kern;
-    cl_int err;
+    cl_mem scratch;
 
     g_assert (lay->type == LAYER_CONV);
     conv = (struct conv_layer *) lay;
+    kern = conv->forward;
 
-    locsiz[0] = 1;
-    locsiz[1] = 1;
-    locsiz[2] = 1;
-    globsiz[0] = lay->width;
-    globsiz[1] = lay->height;
-    globsiz[2] = lay->depth;
+    if (conv->backend == CONV_BACKEND_WINOGRAD) {
+        forward_winograd (lay);
+        return;
+    }
 
-    kern = conv->forward;
+    if (conv->backend == CONV_BACKEND_GEMM) {
+        if (conv->pointwise) {
+            layer_set_value_arg (lay->prev, kern, 0);
+            evunroll = lay->prev->forward_barrier;
+
+            if (evunroll != NULL) {
+                clRetainEvent (evunroll);
+            }
+        } else {
+            unroll (lay, lay->prev->forward_barrier, &evunroll);
+            scratch = network_scratch (lay->net);
+            clSetKernelArg (kern, 0, sizeof (cl_mem), &scratch);
+        }
 
-    clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->prev->value_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->weight_mem);
+        clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_mem);
+        clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->value_mem);
+
+        if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+            clSetKernelArg (kern, 4, sizeof (cl_mem), &lay->derivative_mem);
+        }
+
+        g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+        context_run_gemm (lay->net->ctx, kern,
+                          lay->batch * lay->width * lay->height,
+                          lay->depth,
+                          UTIL_NONNULL (evunroll),
+                          UTIL_PTR_OR_NULL (evunroll),
+                          &lay->forward_barrier);
+
+        if (!conv->pointwise) {
+            network_scratch_release (lay->net, lay->forward_barrier);
+        }
+
+        g_clear_pointer (&evunroll, clReleaseEvent);
+        return;
+    }
+
+    layer_set_value_arg (lay->prev, kern, 0);
     clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->weight_mem);
-    clSetKernelArg (kern, 2, sizeof (cl_mem), &conv->zero_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_mem);
     clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->value_mem);
 
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        clSetKernelArg (kern, 4, sizeof (cl_mem), &lay->derivative_mem);
+    }
+
     g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
 
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 3, NULL,
-                                  globsiz, locsiz,
-                                  UTIL_NONNULL (lay->prev->forward_barrier),
-                                  UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
-                                  &lay->forward_barrier);
-    g_assert (err == CL_SUCCESS);
-    clFinish (lay->net->ctx->queue);
+    if (conv->tile_width > 0) {
+        locsiz[0] = conv->tile_width;
+        locsiz[1] = conv->tile_height;
+        locsiz[2] = 1;
+
+        run_volume (lay, kern,
+                    lay->width, lay->height,
+                    (lay->depth + conv->channels - 1) / conv->channels
+                    * lay->batch,
+                    locsiz,
+                    UTIL_NONNULL (lay->prev->forward_barrier),
+                    UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                    &lay->forward_barrier);
+        return;
+    }
+
+    run_volume (lay, kern,
+                lay->width, lay->height, lay->depth * lay->batch,
+                NULL,
+                UTIL_NONNULL (lay->prev->forward_barrier),
+                UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                &lay->forward_barrier);
 }
 
 static void
 backward (struct layer *lay)
 {
+    struct conv_layer *conv;
+    float ratefactor;
+    cl_event evderive, evpropagate, evbackprop, evbias, evlist[2];
+    cl_event evcolumn, evunroll;
+    cl_event dep, wait, gradlist[2];
+    cl_kernel kern;
+    cl_int evcount, gradcount;
+    cl_mem input;
+
+
+    g_assert (lay->type == LAYER_CONV);
+    g_assert (lay->gradient_mem != 0);
+
+
+    evderive = NULL;
+    evpropagate = NULL;
+    evbackprop = NULL;
+    evbias = NULL;
+    evcolumn = NULL;
+    evunroll = NULL;
+
+    /* same as dense layers, the host side loss is never used here */
+    ratefactor = lay->net->rate * (1 - lay->net->momentum);
+    conv = (struct conv_layer *) lay;
+
+
+    /*
+     * All tasks depend on the next layer's barrier, as it gives
+     * this layer's gradients
+     */
+    dep = layer_next_gradient (lay);
+
+
+    /*
+     * Apply derivative to current layer's gradients, unless it's
+     * fused into the tasks below
+     */
+    if (conv->derive_gradient != NULL) {
+        kern = conv->derive_gradient;
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->derivative_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->gradient_mem);
+
+        context_run_sparse (lay->net->ctx, kern,
+                            lay->batch * lay->size,
+                            UTIL_NONNULL (dep),
+                            UTIL_PTR_OR_NULL (dep),
+                            &evderive);
+
+        dep = evderive;
+    }
+
+
+
+    /*
+     * Propagate gradients to the previous layer, it has to be
+     * done before the filters change
+     */
+    if (conv->propagate != NULL) {
+        kern = conv->propagate;
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->gradient_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->derivative_mem);
+        clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->weight_mem);
+
+        if (conv->backend == CONV_BACKEND_GEMM && conv->pointwise) {
+            clSetKernelArg (kern, 3, sizeof (cl_mem),
+                            &lay->prev->gradient_mem);
+
+            gradcount = layer_propagate_wait_list (lay, dep, gradlist);
+
+            context_run_gemm (lay->net->ctx, kern,
+                              lay->batch * lay->width * lay->height,
+                              lay->prev->depth,
+                              gradcount, gradlist,
+                              &evpropagate);
+        } else if (conv->backend == CONV_BACKEND_GEMM) {
+            /*
+             * Gradients of the column matrix go to the scratch
+             * buffer and are folded back into input gradients
+             */
+            input = network_scratch (lay->net);
+
+            clSetKernelArg (kern, 3, sizeof (cl_mem), &input);
+
+            gradcount = network_scratch_wait_list (lay->net, dep, gradlist);
+
+            context_run_gemm (lay->net->ctx, kern,
+                              lay->batch * lay->width * lay->height,
+                              conv->kwidth * conv->kheight
+                              * lay->prev->depth,
+                              gradcount, gradlist,
+                              &evcolumn);
+
+            kern = conv->col2im;
+
+            clSetKernelArg (kern, 0, sizeof (cl_mem), &input);
+            clSetKernelArg (kern, 1, sizeof (cl_mem),
+                            &lay->prev->gradient_mem);
+
+            gradcount = layer_propagate_wait_list (lay, evcolumn, gradlist);
+
+            run_volume (lay, kern,
+                        lay->prev->width, lay->prev->height,
+                        lay->prev->depth * lay->batch,
+                        NULL,
+                        gradcount, gradlist,
+                        &evpropagate);
+        } else {
+            clSetKernelArg (kern, 3, sizeof (cl_mem),
+                            &lay->prev->gradient_mem);
+
+            gradcount = layer_propagate_wait_list (lay, dep, gradlist);
+
+            run_volume (lay, kern,
+                        lay->prev->width, lay->prev->height,
+                        lay->prev->depth * lay->batch,
+                        NULL,
+                        gradcount, gradlist,
+                        &evpropagate);
+        }
+    }
+
+
+
+    /*
+     * Run filters update
+     */
+    kern = conv->backward;
+    wait = evpropagate != NULL ? evpropagate : dep;
+    input = lay->prev->value_mem;
+
+    if (conv->backend == CONV_BACKEND_GEMM && !conv->pointwise) {
+        unroll (lay, wait, &evunroll);
+        wait = evunroll;
+        input = network_scratch (lay->net);
+    }
+
+    clSetKernelArg (kern, 0, sizeof (cl_mem), &input);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->gradient_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->derivative_mem);
+    clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->weight_mem);
+    clSetKernelArg (kern, 4, sizeof (cl_mem), &lay->delta_mem);
+    clSetKernelArg (kern, 5, sizeof (cl_float), &ratefactor);
+    clSetKernelArg (kern, 6, sizeof (cl_float), &lay->net->momentum);
+    clSetKernelArg (kern, 7, sizeof (cl_float), &lay->net->decay);
+
+    if (conv->backend == CONV_BACKEND_GEMM) {
+        context_run_gemm (lay->net->ctx, kern,
+                          lay->depth,
+                          conv->kwidth * conv->kheight * lay->prev->depth,
+                          UTIL_NONNULL (wait),
+                          UTIL_PTR_OR_NULL (wait),
+                          &evbackprop);
+    } else {
+        context_run_sparse (lay->net->ctx, kern,
+                            lay->weights,
+                            UTIL_NONNULL (wait),
+                            UTIL_PTR_OR_NULL (wait),
+                            &evbackprop);
+    }
+
+    if (evunroll != NULL) {
+        network_scratch_release (lay->net, evbackprop);
+    }
+
+
+
+    /*
+     * Run bias update
+     */
+    kern = conv->backward_bias;
+
+    clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->gradient_mem);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->derivative_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_mem);
+    clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->bias_delta_mem);
+    clSetKernelArg (kern, 4, sizeof (cl_float), &ratefactor);
+    clSetKernelArg (kern, 5, sizeof (cl_float), &lay->net->momentum);
+    clSetKernelArg (kern, 6, sizeof (cl_float), &lay->net->decay);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        lay->depth,
+                        UTIL_NONNULL (dep),
+                        UTIL_PTR_OR_NULL (dep),
+                        &evbias);
+
+
+
+    /*
+     * Previous layer goes on once its gradients are propagated,
+     * along with the weights update
+     */
+    if (evpropagate != NULL) {
+        layer_propagate_done (lay, evpropagate);
+    }
+
+
+    /*
+     * Release events already owned by the tasks depending on them
+     */
+    g_clear_pointer (&evderive, clReleaseEvent);
+    g_clear_pointer (&evpropagate, clReleaseEvent);
+    g_clear_pointer (&evcolumn, clReleaseEvent);
+    g_clear_pointer (&evunroll, clReleaseEvent);
+
+
+    /*
+     * Merge backpropagation events into one barrier, it's a marker
+     * as a barrier would hold off all later tasks of out-of-order
+     * queues
+     */
+    evlist[0] = evbackprop;
+    evlist[1] = evbias;
+    evcount = 2;
+
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+    clEnqueueMarkerWithWaitList (lay->net->ctx->queue,
+                                 evcount, evlist,
+                                 &lay->backward_barrier);
+
+    /*
+     * And release backpropagation events already owned by the barrier
+     */
+    clReleaseEvent (evbackprop);
+    clReleaseEvent (evbias);
+
+    conv->transformed = FALSE;
 }
 
 static void
@@ -233,5 +754,310 @@ release (struct layer *lay)
     g_assert (lay->type == LAYER_CONV);
     conv = (struct conv_layer *) lay;
 
-    g_free (conv->kbuffer);
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+
+    clReleaseKernel (conv->forward);
+    g_clear_pointer (&conv->derive_gradient, clReleaseKernel);
+    g_clear_pointer (&conv->backward, clReleaseKernel);
+    g_clear_pointer (&conv->backward_bias, clReleaseKernel);
+    g_clear_pointer (&conv->propagate, clReleaseKernel);
+    g_clear_pointer (&conv->im2col, clReleaseKernel);
+    g_clear_pointer (&conv->col2im, clReleaseKernel);
+    g_clear_pointer (&conv->winograd_filter, clReleaseKernel);
+    g_clear_pointer (&conv->winograd_input, clReleaseKernel);
+    g_clear_pointer (&conv->winograd_product, clReleaseKernel);
+    g_clear_pointer (&conv->transform_mem, clReleaseMemObject);
+    context_program_release (lay->net->ctx, conv->program);
+    clReleaseMemObject (lay->value_mem);
+    g_clear_pointer (&lay->derivative_mem, clReleaseMemObject);
+    g_clear_pointer (&lay->gradient_mem, clReleaseMemObject);
+    clReleaseMemObject (lay->bias_mem);
+    g_clear_pointer (&lay->bias_delta_mem, clReleaseMemObject);
+    clReleaseMemObject (lay->weight_mem);
+    g_clear_pointer (&lay->delta_mem, clReleaseMemObject);
+}
+
+/*
+ * Winograd is used for all 3x3 stride 1 filters, GEMM pays off for
+ * many large filters, as long as the scratch data stays reasonably
+ * small, otherwise it's the tiled kernel
+ */
+static enum conv_backend
+choose_backend (struct layer *lay)
+{
+    struct conv_layer *conv;
+    int filter, tiles;
+
+    conv = (struct conv_layer *) lay;
+    filter = conv->kwidth * conv->kheight * lay->prev->depth;
+    tiles = lay->batch * ((lay->width + 1) / 2) * ((lay->height + 1) / 2);
+
+    if (conv->kwidth == 3 && conv->kheight == 3 && conv->kstride == 1
+        && (gint64) 16 * tiles * (lay->prev->depth + lay->depth)
+           <= GEMM_MAX_COLUMNS) {
+        return CONV_BACKEND_WINOGRAD;
+    }
+
+    if (lay->depth >= GEMM_MIN_FILTERS
+        && filter >= GEMM_MIN_FILTER_SIZE
+        && (gint64) lay->batch * lay->width * lay->height * filter
+           <= GEMM_MAX_COLUMNS) {
+        return CONV_BACKEND_GEMM;
+    }
+
+    return CONV_BACKEND_TILED;
+}
+
+/*
+ * Unrolls input patches into the scratch buffer
+ */
+static void
+unroll (struct layer *lay, cl_event dep, cl_event *ev)
+{
+    struct conv_layer *conv;
+    cl_event evlist[2];
+    cl_kernel kern;
+    cl_int evcount;
+    cl_mem scratch;
+
+    conv = (struct conv_layer *) lay;
+    kern = conv->im2col;
+    scratch = network_scratch (lay->net);
+
+    layer_set_value_arg (lay->prev, kern, 0);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &scratch);
+
+    evcount = network_scratch_wait_list (lay->net, dep, evlist);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        lay->batch * lay->width * lay->height
+                        * conv->kwidth * conv->kheight * lay->prev->depth,
+                        evcount, evlist,
+                        ev);
+}
+
+/*
+ * Gives output size along one dimension and the offset of the first
+ * filter tap, same padding keeps ceil (input / stride) outputs and
+ * pads evenly with the extra one after, valid padding doesn't pad
+ * at all, explicit padding pads $pad values on both sides
+ */
+static int
+output_size (enum conv_padding padding,
+             int input, int kernel, int stride,
+             int pad, int *shift)
+{
+    int output;
+
+    switch (padding) {
+    case CONV_PADDING_SAME:
+        output = (input + stride - 1) / stride;
+        pad = MAX ((output - 1) * stride + kernel - input, 0);
+        *shift = -pad / 2;
+        break;
+
+    case CONV_PADDING_VALID:
+        output = (input - kernel) / stride + 1;
+        *shift = 0;
+        break;
+
+    case CONV_PADDING_EXPLICIT:
+        output = (input + 2 * pad - kernel) / stride + 1;
+        *shift = -pad;
+        break;
+
+    default:
+        g_assert_not_reached ();
+    }
+
+    g_assert (output > 0);
+
+    return output;
+}
+
+/*
+ * Winograd forward, filters are transformed only if they changed
+ * since the last call
+ */
+static void
+forward_winograd (struct layer *lay)
+{
+    struct conv_layer *conv;
+    size_t locsiz[3];
+    cl_event evfilter, evinput, evproduct, evlist[2], inputlist[2];
+    cl_kernel kern;
+    cl_int evcount, inputcount;
+    cl_mem scratch;
+    int tiles;
+
+    conv = (struct conv_layer *) lay;
+    scratch = network_scratch (lay->net);
+    tiles = lay->batch * ((lay->width + 1) / 2) * ((lay->height + 1) / 2);
+    evcount = 0;
+
+
+    /*
+     * Transform filters after the weights update
+     */
+    if (!conv->transformed) {
+        kern = conv->winograd_filter;
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->weight_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &conv->transform_mem);
+
+        context_run_sparse (lay->net->ctx, kern,
+                            lay->depth * lay->prev->depth,
+                            UTIL_NONNULL (lay->backward_barrier),
+                            UTIL_PTR_OR_NULL (lay->backward_barrier),
+                            &evfilter);
+
+        evlist[evcount++] = evfilter;
+        conv->transformed = TRUE;
+    }
+
+
+    /*
+     * Transform input tiles
+     */
+    kern = conv->winograd_input;
+    inputcount = network_scratch_wait_list (lay->net,
+                                            lay->prev->forward_barrier,
+                                            inputlist);
+
+    layer_set_value_arg (lay->prev, kern, 0);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &scratch);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        tiles * lay->prev->depth,
+                        inputcount, inputlist,
+                        &evinput);
+
+    evlist[evcount++] = evinput;
+
+
+    /*
+     * Multiply all 16 transformed elements at once
+     */
+    kern = conv->winograd_product;
+    locsiz[0] = lay->net->ctx->gemm_tile;
+    locsiz[1] = lay->net->ctx->gemm_tile;
+    locsiz[2] = 1;
+
+    clSetKernelArg (kern, 0, sizeof (cl_mem), &conv->transform_mem);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &scratch);
+
+    run_volume (lay, kern,
+                lay->depth, tiles, 16,
+                locsiz,
+                evcount, evlist,
+                &evproduct);
+
+
+    /*
+     * Transform products back to the output
+     */
+    kern = conv->forward;
+
+    clSetKernelArg (kern, 0, sizeof (cl_mem), &scratch);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->bias_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->value_mem);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->derivative_mem);
+    }
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        tiles * lay->depth,
+                        1, &evproduct,
+                        &lay->forward_barrier);
+
+    network_scratch_release (lay->net, lay->forward_barrier);
+
+    while (evcount > 0) {
+        clReleaseEvent (evlist[--evcount]);
+    }
+
+    clReleaseEvent (evproduct);
+}
+
+/*
+ * Chooses tiled forward parameters for the device and adds
+ * the program options. Output block is the largest square fitting
+ * the work-group, shrunk to the layer's size, and input channels
+ * are staged as many at once as fit in half of the local memory.
+ * Leaves the layer untiled if even a single channel doesn't fit
+ */
+static gboolean
+setup_tiled (struct layer *lay)
+{
+    struct conv_layer *conv;
+    struct context *ctx;
+    int edge, halo, depth;
+
+    conv = (struct conv_layer *) lay;
+    ctx = lay->net->ctx;
+
+    edge = 1;
+
+    while (edge * 2 <= TILED_EDGE
+           && edge * edge * 4 <= ctx->group_size) {
+        edge *= 2;
+    }
+
+    conv->tile_width = MIN (edge, util_upper_power_2 (lay->width));
+    conv->tile_height = MIN (edge, util_upper_power_2 (lay->height));
+    conv->channels = MIN (TILED_CHANNELS, lay->depth);
+
+    halo = ((conv->tile_width - 1) * conv->kstride + conv->kwidth)
+        * ((conv->tile_height - 1) * conv->kstride + conv->kheight);
+    depth = MIN (lay->prev->depth,
+                 (int) (ctx->local_mem_size / 2
+                        / (halo * sizeof (cl_float))));
+
+    if (depth < 1) {
+        conv->tile_width = 0;
+        conv->tile_height = 0;
+        conv->channels = 0;
+        return FALSE;
+    }
+
+    context_program_option (ctx, "-DWITH_TILED");
+    context_program_option (ctx, "-DTILE_WIDTH=%d", conv->tile_width);
+    context_program_option (ctx, "-DTILE_HEIGHT=%d", conv->tile_height);
+    context_program_option (ctx, "-DCHANNELS=%d", conv->channels);
+    context_program_option (ctx, "-DDEPTH_TILE=%d", depth);
+
+    return TRUE;
+}
+
+/*
+ * Runs a kernel over a width x height x depth volume, with NULL
+ * local size it's left to the implementation, otherwise global
+ * size is rounded up to it
+ */
+static void
+run_volume (struct layer *lay, cl_kernel kern,
+            int width, int height, int depth,
+            const size_t *locsiz,
+            cl_int evcnt, const cl_event *evlist,
+            cl_event *ev)
+{
+    size_t globsiz[3];
+
+    globsiz[0] = width;
+    globsiz[1] = height;
+    globsiz[2] = depth;
+
+    if (locsiz != NULL) {
+        globsiz[0] = util_upper_multiply (width, locsiz[0]);
+        globsiz[1] = util_upper_multiply (height, locsiz[1]);
+        globsiz[2] = util_upper_multiply (depth, locsiz[2]);
+    }
+
+    context_run_kernel (lay->net->ctx, kern, 3,
+                        globsiz, locsiz,
+                        evcnt, evlist, ev);
 }
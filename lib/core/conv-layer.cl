@@ -19,67 +19,1003 @@
  * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-__constant float *input_channel (__constant float *input_v,
-                                 __constant float *zero_v,
-                                 const int y,
-                                 const int x)
+/*
+ * Values are stored as (y, x, z) volumes, samples of the batch one
+ * after another. Filters are stored as (z, y, x, d) where z is
+ * the output and d the input channel
+ */
+#define INPUT_SIZE (INPUT_WIDTH * INPUT_HEIGHT * INPUT_DEPTH)
+#define OUTPUT_SIZE (WIDTH * HEIGHT * DEPTH)
+#define FILTER_SIZE (KERNEL_WIDTH * KERNEL_HEIGHT * INPUT_DEPTH)
+#define POSITIONS (WIDTH * HEIGHT)
+
+/*
+ * Tells if a filter tap of a valid output position is inside
+ * the input, with valid padding it always is so the checks compile
+ * out. Tiles which may cover positions past the output check
+ * the bounds on their own
+ */
+#ifdef PADDING_VALID
+#define INSIDE_ROW(y) 1
+#define INSIDE_COLUMN(x) 1
+#else
+#define INSIDE_ROW(y) ((y) >= 0 && (y) < INPUT_HEIGHT)
+#define INSIDE_COLUMN(x) ((x) >= 0 && (x) < INPUT_WIDTH)
+#endif
+
+int input_index (const int batch, const int y, const int x, const int d)
+{
+    return batch * INPUT_SIZE + (y * INPUT_WIDTH + x) * INPUT_DEPTH + d;
+}
+
+int output_index (const int batch, const int y, const int x, const int z)
+{
+    return batch * OUTPUT_SIZE + (y * WIDTH + x) * DEPTH + z;
+}
+
+int filter_index (const int z, const int y, const int x, const int d)
+{
+    return z * FILTER_SIZE + (y * KERNEL_WIDTH + x) * INPUT_DEPTH + d;
+}
+
+void write_output (__global float *value_v,
+#ifdef WITH_DERIVATIVE
+                   __global float *derivative_v,
+#endif
+                   int outid,
+                   float sum)
+{
+#ifdef WITH_DERIVATIVE
+    __private float derivative;
+#endif
+
+#ifdef WITH_ACTIVATION
+#ifdef WITH_DERIVATIVE
+    value_v[outid] = activate (sum, &derivative);
+    derivative_v[outid] = derivative;
+#else
+    value_v[outid] = activate (sum);
+#endif
+#else
+    value_v[outid] = sum;
+#ifdef WITH_DERIVATIVE
+    derivative_v[outid] = 1;
+#endif
+#endif
+}
+
+#if defined (DEPTHWISE)
+/*
+ * Depthwise variant, there is a single KERNEL_WIDTH x KERNEL_HEIGHT
+ * filter per channel and DEPTH equals INPUT_DEPTH. Filters are
+ * stored as (z, y, x). One work-item per output value, work size is
+ * WIDTH x HEIGHT x (DEPTH * BATCH)
+ */
+int depthwise_index (const int z, const int y, const int x)
+{
+    return (z * KERNEL_HEIGHT + y) * KERNEL_WIDTH + x;
+}
+
+__kernel void forward (__global const float *input_value_v,
+                       __global const float *weight_v,
+                       __global const float *bias_v,
+                       __global float *value_v
+#ifdef WITH_DERIVATIVE
+                       , __global float *derivative_v
+#endif
+                       )
+{
+    __private int x, y, z, batch, xk, yk, ix, iy;
+    __private float sum;
+
+    x = get_global_id (0);
+    y = get_global_id (1);
+    z = get_global_id (2) % DEPTH;
+    batch = get_global_id (2) / DEPTH;
+
+    if (x >= WIDTH || y >= HEIGHT || batch >= BATCH) {
+        return;
+    }
+
+    sum = bias_v[z];
+
+    for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+        iy = y * KERNEL_STRIDE + yk + KERNEL_Y_SHIFT;
+
+        if (!INSIDE_ROW (iy)) {
+            continue;
+        }
+
+        for (xk = 0; xk < KERNEL_WIDTH; xk++) {
+            ix = x * KERNEL_STRIDE + xk + KERNEL_X_SHIFT;
+
+            if (!INSIDE_COLUMN (ix)) {
+                continue;
+            }
+
+            sum += input_value_v[input_index (batch, iy, ix, z)]
+                * weight_v[depthwise_index (z, yk, xk)];
+        }
+    }
+
+    write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                  derivative_v,
+#endif
+                  output_index (batch, y, x, z), sum);
+}
+#elif defined (WITH_GEMM)
+/*
+ * GEMM variant, input patches are unrolled by im2col into
+ * a (BATCH * POSITIONS) x FILTER_SIZE column matrix, so the layer is
+ * a single blocked multiply with the transposed filters, the same as
+ * the batched dense layer. The product is already laid out like
+ * the output values. With POINTWISE 1x1 filters the input values
+ * are already the column matrix and are multiplied in place
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void forward (__global const float *column_v,
+              __global const float *weight_v,
+              __global const float *bias_v,
+              __global float *value_v
+#ifdef WITH_DERIVATIVE
+              , __global float *derivative_v
+#endif
+              )
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private float sum;
+    __private int z, row;
+
+    sum = gemm (column_v, FILTER_SIZE, 1,
+                weight_v, 1, FILTER_SIZE,
+                BATCH * POSITIONS, DEPTH, FILTER_SIZE,
+                a_tile, b_tile);
+
+    z = get_global_id (0);
+    row = get_global_id (1);
+
+    if (row < BATCH * POSITIONS && z < DEPTH) {
+        write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                      derivative_v,
+#endif
+                      row * DEPTH + z,
+                      sum + bias_v[z]);
+    }
+}
+
+/*
+ * Unrolls input patches, one work-item per column matrix element,
+ * taps out of the input are zero
+ */
+__kernel void im2col (__global const float *input_value_v,
+                      __global float *column_v)
+{
+    __private int id, k, row, batch, x, y, xk, yk, d, ix, iy;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * POSITIONS * FILTER_SIZE) {
+        return;
+    }
+
+    k = id % FILTER_SIZE;
+    row = id / FILTER_SIZE;
+    batch = row / POSITIONS;
+    y = row % POSITIONS / WIDTH;
+    x = row % WIDTH;
+    d = k % INPUT_DEPTH;
+    xk = k / INPUT_DEPTH % KERNEL_WIDTH;
+    yk = k / INPUT_DEPTH / KERNEL_WIDTH;
+    ix = x * KERNEL_STRIDE + xk + KERNEL_X_SHIFT;
+    iy = y * KERNEL_STRIDE + yk + KERNEL_Y_SHIFT;
+
+    if (!INSIDE_COLUMN (ix) || !INSIDE_ROW (iy)) {
+        column_v[id] = 0;
+    } else {
+        column_v[id] = input_value_v[input_index (batch, iy, ix, d)];
+    }
+}
+#elif defined (WITH_WINOGRAD)
+/*
+ * Winograd F(2x2, 3x3) variant for 3x3 stride 1 filters, output is
+ * computed in 2x2 tiles from 4x4 input tiles overlapping by 2, with
+ * 16 multiplies per tile instead of 36. Filters are transformed to
+ * 4x4 once per weights update, input tiles are transformed into
+ * the scratch buffer, multiplied by the filters with 16 batched
+ * GEMMs, one per transformed element, and the products are
+ * transformed back to the output. Transformed inputs are stored as
+ * [16][TILES][INPUT_DEPTH], filters as [16][DEPTH][INPUT_DEPTH] and
+ * products as [16][TILES][DEPTH] after the inputs
+ */
+#define TILES_X ((WIDTH + 1) / 2)
+#define TILES_Y ((HEIGHT + 1) / 2)
+#define TILES (BATCH * TILES_X * TILES_Y)
+#define PRODUCT_OFFSET (16 * TILES * INPUT_DEPTH)
+
+/*
+ * Filter transform G g G^T, one work-item per (z, d) filter channel
+ */
+__kernel void winograd_filter (__global const float *weight_v,
+                               __global float *transform_v)
+{
+    __private float g[3][3], t[4][3];
+    __private int id, z, d, i, x, y;
+
+    id = get_global_id (0);
+
+    if (id >= DEPTH * INPUT_DEPTH) {
+        return;
+    }
+
+    z = id / INPUT_DEPTH;
+    d = id % INPUT_DEPTH;
+
+    for (y = 0; y < 3; y++) {
+        for (x = 0; x < 3; x++) {
+            g[y][x] = weight_v[filter_index (z, y, x, d)];
+        }
+    }
+
+    for (x = 0; x < 3; x++) {
+        t[0][x] = g[0][x];
+        t[1][x] = (g[0][x] + g[1][x] + g[2][x]) * 0.5f;
+        t[2][x] = (g[0][x] - g[1][x] + g[2][x]) * 0.5f;
+        t[3][x] = g[2][x];
+    }
+
+    for (i = 0; i < 4; i++) {
+        transform_v[(i * 4 + 0) * DEPTH * INPUT_DEPTH + id] = t[i][0];
+        transform_v[(i * 4 + 1) * DEPTH * INPUT_DEPTH + id] =
+            (t[i][0] + t[i][1] + t[i][2]) * 0.5f;
+        transform_v[(i * 4 + 2) * DEPTH * INPUT_DEPTH + id] =
+            (t[i][0] - t[i][1] + t[i][2]) * 0.5f;
+        transform_v[(i * 4 + 3) * DEPTH * INPUT_DEPTH + id] = t[i][2];
+    }
+}
+
+/*
+ * Input transform B^T d B, one work-item per (tile, d) input
+ * channel, taps out of the input are zero
+ */
+__kernel void winograd_input (__global const float *input_value_v,
+                              __global float *scratch_v)
 {
-    __private int off;
+    __private float v[4][4], t[4][4];
+    __private int id, tile, d, batch, ox, oy, ix, iy, x, y, i;
+
+    id = get_global_id (0);
 
-    if (x < 0 || x >= WIDTH || y < 0 || y >= HEIGHT) {
-        return zero_v;
+    if (id >= TILES * INPUT_DEPTH) {
+        return;
     }
 
-    off = y * INPUT_HEIGHT * INPUT_DEPTH + x * INPUT_DEPTH;
+    d = id % INPUT_DEPTH;
+    tile = id / INPUT_DEPTH;
+    batch = tile / (TILES_X * TILES_Y);
+    ox = tile % TILES_X * 2 + KERNEL_X_SHIFT;
+    oy = tile % (TILES_X * TILES_Y) / TILES_X * 2 + KERNEL_Y_SHIFT;
 
-    return input_v + off;
+    for (y = 0; y < 4; y++) {
+        for (x = 0; x < 4; x++) {
+            ix = ox + x;
+            iy = oy + y;
+
+            if (ix < 0 || ix >= INPUT_WIDTH || iy < 0 || iy >= INPUT_HEIGHT) {
+                v[y][x] = 0;
+            } else {
+                v[y][x] = input_value_v[input_index (batch, iy, ix, d)];
+            }
+        }
+    }
+
+    for (x = 0; x < 4; x++) {
+        t[0][x] = v[0][x] - v[2][x];
+        t[1][x] = v[1][x] + v[2][x];
+        t[2][x] = v[2][x] - v[1][x];
+        t[3][x] = v[1][x] - v[3][x];
+    }
+
+    for (i = 0; i < 4; i++) {
+        scratch_v[(i * 4 + 0) * TILES * INPUT_DEPTH + id] = t[i][0] - t[i][2];
+        scratch_v[(i * 4 + 1) * TILES * INPUT_DEPTH + id] = t[i][1] + t[i][2];
+        scratch_v[(i * 4 + 2) * TILES * INPUT_DEPTH + id] = t[i][2] - t[i][1];
+        scratch_v[(i * 4 + 3) * TILES * INPUT_DEPTH + id] = t[i][1] - t[i][3];
+    }
 }
 
-__constant float *filter_channel (__constant float *kernel_v,
-                                  const int x,
-                                  const int y,
-                                  const int z)
+/*
+ * Elementwise products summed over input channels, a TILES x DEPTH
+ * blocked multiply for each of 16 elements, given by global id 2
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void winograd_product (__global const float *transform_v,
+                       __global float *scratch_v)
 {
-    __private int off;
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private float sum;
+    __private int z, tile, i;
+
+    i = get_global_id (2);
+
+    sum = gemm (scratch_v + i * TILES * INPUT_DEPTH, INPUT_DEPTH, 1,
+                transform_v + i * DEPTH * INPUT_DEPTH, 1, INPUT_DEPTH,
+                TILES, DEPTH, INPUT_DEPTH,
+                a_tile, b_tile);
 
-    off = z * KERNEL_WIDTH * KERNEL_HEIGHT * INPUT_DEPTH
-        + y * KERNEL_WIDTH * INPUT_DEPTH
-        + x * INPUT_DEPTH;
+    z = get_global_id (0);
+    tile = get_global_id (1);
 
-    return kernel_v + off;
+    if (tile < TILES && z < DEPTH) {
+        scratch_v[PRODUCT_OFFSET + (i * TILES + tile) * DEPTH + z] = sum;
+    }
 }
 
-__kernel void forward (__constant float *input_v,
-                       __constant float *kernel_v,
-                       __constant float *zero_v,
-                       __global float *output_v)
+/*
+ * Output transform A^T m A, one work-item per (tile, z) output
+ * channel, writes up to 2x2 outputs
+ */
+__kernel void winograd_output (__global const float *scratch_v,
+                               __global const float *bias_v,
+                               __global float *value_v
+#ifdef WITH_DERIVATIVE
+                               , __global float *derivative_v
+#endif
+                               )
+{
+    __private float m[4][4], t[2][4];
+    __private float out;
+    __private int id, tile, z, batch, ox, oy, x, y;
+
+    id = get_global_id (0);
+
+    if (id >= TILES * DEPTH) {
+        return;
+    }
+
+    z = id % DEPTH;
+    tile = id / DEPTH;
+    batch = tile / (TILES_X * TILES_Y);
+    ox = tile % TILES_X * 2;
+    oy = tile % (TILES_X * TILES_Y) / TILES_X * 2;
+
+    for (y = 0; y < 4; y++) {
+        for (x = 0; x < 4; x++) {
+            m[y][x] = scratch_v[PRODUCT_OFFSET
+                                + ((y * 4 + x) * TILES + tile) * DEPTH + z];
+        }
+    }
+
+    for (x = 0; x < 4; x++) {
+        t[0][x] = m[0][x] + m[1][x] + m[2][x];
+        t[1][x] = m[1][x] - m[2][x] - m[3][x];
+    }
+
+    for (y = 0; y < 2 && oy + y < HEIGHT; y++) {
+        for (x = 0; x < 2 && ox + x < WIDTH; x++) {
+            if (x == 0) {
+                out = t[y][0] + t[y][1] + t[y][2];
+            } else {
+                out = t[y][1] - t[y][2] - t[y][3];
+            }
+
+            write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                          derivative_v,
+#endif
+                          output_index (batch, oy + y, ox + x, z),
+                          out + bias_v[z]);
+        }
+    }
+}
+#elif defined (WITH_TILED)
+/*
+ * Tiled variant, each work-group computes a TILE_WIDTH x TILE_HEIGHT
+ * block of outputs and each work-item CHANNELS output channels of
+ * it. The input block with its halo is staged in local memory
+ * DEPTH_TILE input channels at once, so every input value is read
+ * from global memory once per work-group. Work size is the output
+ * size rounded up to the tile times (CHANNEL_GROUPS * BATCH)
+ */
+#define HALO_WIDTH ((TILE_WIDTH - 1) * KERNEL_STRIDE + KERNEL_WIDTH)
+#define HALO_HEIGHT ((TILE_HEIGHT - 1) * KERNEL_STRIDE + KERNEL_HEIGHT)
+#define CHANNEL_GROUPS ((DEPTH + CHANNELS - 1) / CHANNELS)
+
+__kernel __attribute__ ((reqd_work_group_size (TILE_WIDTH, TILE_HEIGHT, 1)))
+void forward (__global const float *input_value_v,
+              __global const float *weight_v,
+              __global const float *bias_v,
+              __global float *value_v
+#ifdef WITH_DERIVATIVE
+              , __global float *derivative_v
+#endif
+              )
+{
+    __local float tile_v[HALO_WIDTH * HALO_HEIGHT * DEPTH_TILE];
+    __private float sum[CHANNELS];
+    __private float value;
+    __private int lx, ly, x, y, z, batch, ox, oy, base, count;
+    __private int i, c, d, hx, hy, ix, iy, xk, yk, off;
+
+    lx = get_local_id (0);
+    ly = get_local_id (1);
+    x = get_global_id (0);
+    y = get_global_id (1);
+    z = get_global_id (2) % CHANNEL_GROUPS * CHANNELS;
+    batch = get_global_id (2) / CHANNEL_GROUPS;
+
+    /*
+     * Input position of the halo's top left corner
+     */
+    ox = get_group_id (0) * TILE_WIDTH * KERNEL_STRIDE + KERNEL_X_SHIFT;
+    oy = get_group_id (1) * TILE_HEIGHT * KERNEL_STRIDE + KERNEL_Y_SHIFT;
+
+    for (c = 0; c < CHANNELS; c++) {
+        sum[c] = z + c < DEPTH ? bias_v[z + c] : 0;
+    }
+
+    for (base = 0; base < INPUT_DEPTH; base += DEPTH_TILE) {
+        count = min (DEPTH_TILE, INPUT_DEPTH - base);
+
+        for (i = ly * TILE_WIDTH + lx; i < HALO_WIDTH * HALO_HEIGHT * count;
+             i += TILE_WIDTH * TILE_HEIGHT) {
+            d = i % count;
+            hx = i / count % HALO_WIDTH;
+            hy = i / count / HALO_WIDTH;
+            ix = ox + hx;
+            iy = oy + hy;
+
+            if (ix < 0 || ix >= INPUT_WIDTH || iy < 0 || iy >= INPUT_HEIGHT) {
+                tile_v[i] = 0;
+            } else {
+                tile_v[i] = input_value_v[input_index (batch, iy, ix,
+                                                       base + d)];
+            }
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+            for (xk = 0; xk < KERNEL_WIDTH; xk++) {
+                off = ((ly * KERNEL_STRIDE + yk) * HALO_WIDTH
+                       + lx * KERNEL_STRIDE + xk) * count;
+
+                for (d = 0; d < count; d++) {
+                    value = tile_v[off + d];
+
+                    for (c = 0; c < CHANNELS; c++) {
+                        sum[c] += value
+                            * weight_v[filter_index (min (z + c, DEPTH - 1),
+                                                     yk, xk, base + d)];
+                    }
+                }
+            }
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (x < WIDTH && y < HEIGHT) {
+        for (c = 0; c < CHANNELS && z + c < DEPTH; c++) {
+            write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                          derivative_v,
+#endif
+                          output_index (batch, y, x, z + c), sum[c]);
+        }
+    }
+}
+#else
+/*
+ * One work-item per output value, work size is
+ * WIDTH x HEIGHT x (DEPTH * BATCH)
+ */
+__kernel void forward (__global const float *input_value_v,
+                       __global const float *weight_v,
+                       __global const float *bias_v,
+                       __global float *value_v
+#ifdef WITH_DERIVATIVE
+                       , __global float *derivative_v
+#endif
+                       )
 {
-    __constant float *__private xvector;
-    __constant float *__private kvector;
-    __private int x, y, z, yk, xk, d, id;
+    __private int x, y, z, batch, xk, yk, ix, iy, d;
     __private float sum;
 
-    y = get_global_id (0);
-    x = get_global_id (1);
-    z = get_global_id (2);
+    x = get_global_id (0);
+    y = get_global_id (1);
+    z = get_global_id (2) % DEPTH;
+    batch = get_global_id (2) / DEPTH;
+
+    if (x >= WIDTH || y >= HEIGHT || batch >= BATCH) {
+        return;
+    }
+
+    sum = bias_v[z];
+
+    for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+        iy = y * KERNEL_STRIDE + yk + KERNEL_Y_SHIFT;
+
+        if (!INSIDE_ROW (iy)) {
+            continue;
+        }
+
+        for (xk = 0; xk < KERNEL_WIDTH; xk++) {
+            ix = x * KERNEL_STRIDE + xk + KERNEL_X_SHIFT;
+
+            if (!INSIDE_COLUMN (ix)) {
+                continue;
+            }
+
+            for (d = 0; d < INPUT_DEPTH; d++) {
+                sum += input_value_v[input_index (batch, iy, ix, d)]
+                    * weight_v[filter_index (z, yk, xk, d)];
+            }
+        }
+    }
+
+    write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                  derivative_v,
+#endif
+                  output_index (batch, y, x, z), sum);
+}
+#endif
+
+#ifdef WITH_DERIVATIVE
+/*
+ * Gives gradient of the layer's weighted sum, with FUSED_DERIVATIVE
+ * activation derivative is applied here instead of by the
+ * derive_gradient kernel
+ */
+float layer_gradient (__global const float *gradient_v,
+                      __global const float *derivative_v,
+                      const int id)
+{
+#ifdef FUSED_DERIVATIVE
+    return gradient_v[id] * derivative_v[id];
+#else
+    return gradient_v[id];
+#endif
+}
+
+#ifdef FUSED_DERIVATIVE
+#define GRADIENT_SCALE derivative_v
+#else
+#define GRADIENT_SCALE 0
+#endif
+
+__kernel void derive_gradient (__global const float *derivative_v,
+                               __global float *gradient_v)
+{
+    __private int outid;
+
+    outid = get_global_id (0);
+
+    if (outid < BATCH * OUTPUT_SIZE) {
+        gradient_v[outid] *= derivative_v[outid];
+    }
+}
+
+#if defined (DEPTHWISE)
+/*
+ * Depthwise filter update, one work-item per weight
+ */
+__kernel void backward (__global const float *input_value_v,
+                        __global const float *gradient_v,
+                        __global const float *derivative_v,
+                        __global float *weight_v,
+                        __global float *delta_v,
+                        const float rate,
+                        const float momentum,
+                        const float decay)
+{
+    __private int id, z, xk, yk, x, y, ix, iy, batch;
+    __private float sum, dt, w;
+
+    id = get_global_id (0);
+
+    if (id >= DEPTH * KERNEL_WIDTH * KERNEL_HEIGHT) {
+        return;
+    }
+
+    z = id / (KERNEL_WIDTH * KERNEL_HEIGHT);
+    yk = id / KERNEL_WIDTH % KERNEL_HEIGHT;
+    xk = id % KERNEL_WIDTH;
+    sum = 0;
+
+    for (batch = 0; batch < BATCH; batch++) {
+        for (y = 0; y < HEIGHT; y++) {
+            iy = y * KERNEL_STRIDE + yk + KERNEL_Y_SHIFT;
+
+            if (!INSIDE_ROW (iy)) {
+                continue;
+            }
+
+            for (x = 0; x < WIDTH; x++) {
+                ix = x * KERNEL_STRIDE + xk + KERNEL_X_SHIFT;
+
+                if (!INSIDE_COLUMN (ix)) {
+                    continue;
+                }
+
+                sum += layer_gradient (gradient_v, derivative_v,
+                                       output_index (batch, y, x, z))
+                    * input_value_v[input_index (batch, iy, ix, z)];
+            }
+        }
+    }
+
+    dt = delta_v[id];
+    w = weight_v[id];
+
+    dt = dt * momentum + sum * rate;
+    w = w * decay + dt;
+
+    weight_v[id] = w;
+    delta_v[id] = dt;
+}
+
+#ifdef CALC_GRADIENT
+/*
+ * Depthwise input gradients, one work-item per input value, work
+ * size is INPUT_WIDTH x INPUT_HEIGHT x (INPUT_DEPTH * BATCH).
+ * Has to be run before the weights are updated
+ */
+__kernel void propagate (__global const float *gradient_v,
+                         __global const float *derivative_v,
+                         __global const float *weight_v,
+                         __global float *input_gradient_v)
+{
+    __private int ix, iy, z, batch, xk, yk, x, y, tx, ty;
+    __private float sum;
+
+    ix = get_global_id (0);
+    iy = get_global_id (1);
+    z = get_global_id (2) % INPUT_DEPTH;
+    batch = get_global_id (2) / INPUT_DEPTH;
+
+    if (ix >= INPUT_WIDTH || iy >= INPUT_HEIGHT || batch >= BATCH) {
+        return;
+    }
 
     sum = 0;
 
     for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+        ty = iy - yk - KERNEL_Y_SHIFT;
+
+        if (ty < 0 || ty % KERNEL_STRIDE != 0) {
+            continue;
+        }
+
+        y = ty / KERNEL_STRIDE;
+
+        if (y >= HEIGHT) {
+            continue;
+        }
+
         for (xk = 0; xk < KERNEL_WIDTH; xk++) {
-            xvector = input_channel (input_v, zero_v,
-                                     y + yk + KERNEL_Y_SHIFT,
-                                     x + xk + KERNEL_X_SHIFT);
-            kvector = filter_channel (kernel_v,
-                                      xk, yk, z);
+            tx = ix - xk - KERNEL_X_SHIFT;
 
-            for (d = 0; d < DEPTH; d++) {
-                sum += xvector[d] * kvector[d];
+            if (tx < 0 || tx % KERNEL_STRIDE != 0) {
+                continue;
             }
+
+            x = tx / KERNEL_STRIDE;
+
+            if (x >= WIDTH) {
+                continue;
+            }
+
+            sum += layer_gradient (gradient_v, derivative_v,
+                                   output_index (batch, y, x, z))
+                * weight_v[depthwise_index (z, yk, xk)];
         }
     }
 
-    id = y * HEIGHT * DEPTH + x * DEPTH + z;
+    input_gradient_v[input_index (batch, iy, ix, z)] += sum;
+}
+#endif
+#elif defined (WITH_GEMM)
+/*
+ * Filter gradients are summed over all positions and samples by
+ * a blocked multiply of the transposed gradients and the column
+ * matrix, which has to be unrolled again as the scratch buffer
+ * is shared
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void backward (__global const float *column_v,
+               __global const float *gradient_v,
+               __global const float *derivative_v,
+               __global float *weight_v,
+               __global float *delta_v,
+               const float rate,
+               const float momentum,
+               const float decay)
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private int k, z, w_index;
+    __private float sum, d, w;
+
+    sum = gemm_scaled (gradient_v, GRADIENT_SCALE, 1, DEPTH,
+                       column_v, FILTER_SIZE, 1,
+                       DEPTH, FILTER_SIZE, BATCH * POSITIONS,
+                       a_tile, b_tile);
+
+    k = get_global_id (0);
+    z = get_global_id (1);
+
+    if (z < DEPTH && k < FILTER_SIZE) {
+        w_index = z * FILTER_SIZE + k;
+        d = delta_v[w_index];
+        w = weight_v[w_index];
+
+        d = d * momentum + sum * rate;
+        w = w * decay + d;
+
+        weight_v[w_index] = w;
+        delta_v[w_index] = d;
+    }
+}
+
+#ifdef CALC_GRADIENT
+/*
+ * Column matrix gradients, a blocked multiply of the gradients and
+ * the filters. With POINTWISE filters the input is its own column
+ * matrix, so gradients are added to input gradients directly. Has
+ * to be run before the filters are updated
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void propagate (__global const float *gradient_v,
+                __global const float *derivative_v,
+                __global const float *weight_v,
+                __global float *column_v)
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private int k, row;
+    __private float sum;
+
+    sum = gemm_scaled (gradient_v, GRADIENT_SCALE, DEPTH, 1,
+                       weight_v, FILTER_SIZE, 1,
+                       BATCH * POSITIONS, FILTER_SIZE, DEPTH,
+                       a_tile, b_tile);
+
+    k = get_global_id (0);
+    row = get_global_id (1);
+
+    if (row < BATCH * POSITIONS && k < FILTER_SIZE) {
+#ifdef POINTWISE
+        column_v[row * FILTER_SIZE + k] += sum;
+#else
+        column_v[row * FILTER_SIZE + k] = sum;
+#endif
+    }
+}
+
+/*
+ * Folds column matrix gradients back into input gradients, one
+ * work-item per input value, work size is
+ * INPUT_WIDTH x INPUT_HEIGHT x (INPUT_DEPTH * BATCH)
+ */
+__kernel void col2im (__global const float *column_v,
+                      __global float *input_gradient_v)
+{
+    __private int ix, iy, d, batch, xk, yk, x, y, tx, ty;
+    __private float sum;
+
+    ix = get_global_id (0);
+    iy = get_global_id (1);
+    d = get_global_id (2) % INPUT_DEPTH;
+    batch = get_global_id (2) / INPUT_DEPTH;
+
+    if (ix >= INPUT_WIDTH || iy >= INPUT_HEIGHT || batch >= BATCH) {
+        return;
+    }
+
+    sum = 0;
+
+    for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+        ty = iy - yk - KERNEL_Y_SHIFT;
+
+        if (ty < 0 || ty % KERNEL_STRIDE != 0) {
+            continue;
+        }
+
+        y = ty / KERNEL_STRIDE;
+
+        if (y >= HEIGHT) {
+            continue;
+        }
+
+        for (xk = 0; xk < KERNEL_WIDTH; xk++) {
+            tx = ix - xk - KERNEL_X_SHIFT;
+
+            if (tx < 0 || tx % KERNEL_STRIDE != 0) {
+                continue;
+            }
+
+            x = tx / KERNEL_STRIDE;
+
+            if (x >= WIDTH) {
+                continue;
+            }
+
+            sum += column_v[(batch * POSITIONS + y * WIDTH + x) * FILTER_SIZE
+                            + (yk * KERNEL_WIDTH + xk) * INPUT_DEPTH + d];
+        }
+    }
+
+    input_gradient_v[input_index (batch, iy, ix, d)] += sum;
+}
+#endif
+#else
+/*
+ * Filter update, one work-item per weight. Gradient of a weight is
+ * the sum over all output positions and samples of the output
+ * gradient times the input value it was multiplied by
+ */
+__kernel void backward (__global const float *input_value_v,
+                        __global const float *gradient_v,
+                        __global const float *derivative_v,
+                        __global float *weight_v,
+                        __global float *delta_v,
+                        const float rate,
+                        const float momentum,
+                        const float decay)
+{
+    __private int id, z, xk, yk, d, x, y, ix, iy, batch;
+    __private float sum, dt, w;
+
+    id = get_global_id (0);
+
+    if (id >= DEPTH * FILTER_SIZE) {
+        return;
+    }
+
+    z = id / FILTER_SIZE;
+    yk = id % FILTER_SIZE / (KERNEL_WIDTH * INPUT_DEPTH);
+    xk = id % (KERNEL_WIDTH * INPUT_DEPTH) / INPUT_DEPTH;
+    d = id % INPUT_DEPTH;
+    sum = 0;
+
+    for (batch = 0; batch < BATCH; batch++) {
+        for (y = 0; y < HEIGHT; y++) {
+            iy = y * KERNEL_STRIDE + yk + KERNEL_Y_SHIFT;
+
+            if (!INSIDE_ROW (iy)) {
+                continue;
+            }
+
+            for (x = 0; x < WIDTH; x++) {
+                ix = x * KERNEL_STRIDE + xk + KERNEL_X_SHIFT;
+
+                if (!INSIDE_COLUMN (ix)) {
+                    continue;
+                }
+
+                sum += layer_gradient (gradient_v, derivative_v,
+                                       output_index (batch, y, x, z))
+                    * input_value_v[input_index (batch, iy, ix, d)];
+            }
+        }
+    }
+
+    dt = delta_v[id];
+    w = weight_v[id];
+
+    dt = dt * momentum + sum * rate;
+    w = w * decay + dt;
+
+    weight_v[id] = w;
+    delta_v[id] = dt;
+}
+
+#ifdef CALC_GRADIENT
+/*
+ * Input gradients as a transposed convolution, one work-item per
+ * input value, work size is
+ * INPUT_WIDTH x INPUT_HEIGHT x (INPUT_DEPTH * BATCH).
+ * Has to be run before the weights are updated
+ */
+__kernel void propagate (__global const float *gradient_v,
+                         __global const float *derivative_v,
+                         __global const float *weight_v,
+                         __global float *input_gradient_v)
+{
+    __private int ix, iy, d, batch, xk, yk, x, y, z, tx, ty;
+    __private float sum;
+
+    ix = get_global_id (0);
+    iy = get_global_id (1);
+    d = get_global_id (2) % INPUT_DEPTH;
+    batch = get_global_id (2) / INPUT_DEPTH;
+
+    if (ix >= INPUT_WIDTH || iy >= INPUT_HEIGHT || batch >= BATCH) {
+        return;
+    }
+
+    sum = 0;
+
+    for (yk = 0; yk < KERNEL_HEIGHT; yk++) {
+        ty = iy - yk - KERNEL_Y_SHIFT;
+
+        if (ty < 0 || ty % KERNEL_STRIDE != 0) {
+            continue;
+        }
+
+        y = ty / KERNEL_STRIDE;
+
+        if (y >= HEIGHT) {
+            continue;
+        }
+
+        for (xk = 0; xk < KERNEL_WIDTH; xk++) {
+            tx = ix - xk - KERNEL_X_SHIFT;
+
+            if (tx < 0 || tx % KERNEL_STRIDE != 0) {
+                continue;
+            }
+
+            x = tx / KERNEL_STRIDE;
+
+            if (x >= WIDTH) {
+                continue;
+            }
+
+            for (z = 0; z < DEPTH; z++) {
+                sum += layer_gradient (gradient_v, derivative_v,
+                                       output_index (batch, y, x, z))
+                    * weight_v[filter_index (z, yk, xk, d)];
+            }
+        }
+    }
+
+    input_gradient_v[input_index (batch, iy, ix, d)] += sum;
+}
+#endif
+#endif
+
+/*
+ * Bias update, one work-item per filter
+ */
+__kernel void backward_bias (__global const float *gradient_v,
+                             __global const float *derivative_v,
+                             __global float *bias_v,
+                             __global float *delta_v,
+                             const float rate,
+                             const float momentum,
+                             const float decay)
+{
+    __private int z, batch, i;
+    __private float g, d, b;
+
+    z = get_global_id (0);
+
+    if (z >= DEPTH) {
+        return;
+    }
+
+    g = 0;
+
+    for (batch = 0; batch < BATCH; batch++) {
+        for (i = 0; i < WIDTH * HEIGHT; i++) {
+            g += layer_gradient (gradient_v, derivative_v,
+                                 batch * OUTPUT_SIZE + i * DEPTH + z);
+        }
+    }
+
+    d = delta_v[z];
+    b = bias_v[z];
+
+    d = d * momentum + g * rate;
+    b = b * decay + d;
 
-    output_v[id] = sum;
+    bias_v[z] = b;
+    delta_v[z] = d;
 }
+#endif
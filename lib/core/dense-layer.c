@@ -27,6 +27,13 @@
 #include <stdio.h>
 #include <math.h>
 
+/*
+ * Tiled forward parameters, number of outputs computed by
+ * a work-group and max number of inputs staged in local memory
+ */
+#define TILED_ROWS 4
+#define TILED_INPUTS 1024
+
 struct dense_layer
 {
     struct layer base;
@@ -35,6 +42,10 @@ struct dense_layer
     cl_kernel derive_gradient;
     cl_kernel backward;
     cl_kernel backward_bias;
+    cl_kernel propagate;
+
+    /* outputs per work-group of tiled forward, 0 if not tiled */
+    int rows;
 };
 
 static void compile (struct layer *lay);
@@ -75,7 +86,7 @@ compile (struct layer *lay)
     struct context *ctx;
     g_autofree float *weight_v;
     GRand *rand;
-    int i;
+    int i, tile;
 
     g_assert (lay->type == LAYER_DENSE);
     g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
@@ -88,22 +99,25 @@ compile (struct layer *lay)
 
 
     /*
-     * Build buffers
+     * Build buffers, the ones used by backpropagation only
+     * if it's enabled
      */
-    layer_create_buffer (lay, &lay->value_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->derivative_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->gradient_mem,
-                         lay->size, CL_MEM_READ_WRITE);
+    layer_create_value (lay);
     layer_create_buffer (lay, &lay->bias_mem,
                          lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->bias_delta_mem,
-                         lay->size, CL_MEM_READ_WRITE);
     layer_create_buffer (lay, &lay->weight_mem,
                          lay->weights, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->delta_mem,
-                         lay->weights, CL_MEM_READ_WRITE);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        layer_create_buffer (lay, &lay->derivative_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->gradient_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->bias_delta_mem,
+                             lay->size, CL_MEM_READ_WRITE);
+        layer_create_buffer (lay, &lay->delta_mem,
+                             lay->weights, CL_MEM_READ_WRITE);
+    }
 
 
     /*
@@ -131,8 +145,11 @@ compile (struct layer *lay)
      * Clear buffers
      */
     context_clear_buffer (ctx, lay->bias_mem, lay->size, NULL);
-    context_clear_buffer (ctx, lay->bias_delta_mem, lay->size, NULL);
-    context_clear_buffer (ctx, lay->delta_mem, lay->weights, NULL);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        context_clear_buffer (ctx, lay->bias_delta_mem, lay->size, NULL);
+        context_clear_buffer (ctx, lay->delta_mem, lay->weights, NULL);
+    }
 
 
     /*
@@ -145,11 +162,36 @@ compile (struct layer *lay)
     }
     context_program_option (ctx, "-DINPUTS=%d", lay->prev->size);
     context_program_option (ctx, "-DOUTPUTS=%d", lay->size);
+    context_program_option (ctx, "-DBATCH=%d", lay->batch);
+    context_program_option (ctx, "-DGROUP_SIZE=%d", ctx->group_size);
+
+    if (lay->batch > 1) {
+        context_program_file (ctx, "gemm.cl");
+        context_program_option (ctx, "-DGEMM_TILE=%d", ctx->gemm_tile);
+    } else if (lay->net->flags & NETWORK_FLAG_TILED) {
+        tile = MIN (TILED_INPUTS,
+                    util_upper_multiply (lay->prev->size,
+                                         ctx->vector_width));
+        dense->rows = MIN (TILED_ROWS, ctx->group_size);
+
+        g_assert ((tile + dense->rows * ctx->group_size)
+                  * sizeof (cl_float) <= ctx->local_mem_size);
+
+        context_program_option (ctx, "-DWITH_TILED");
+        context_program_option (ctx, "-DROWS=%d", dense->rows);
+        context_program_option (ctx, "-DTILE=%d", tile);
+        context_program_option (ctx, "-DVECTOR_WIDTH=%d",
+                                ctx->vector_width);
+    }
 
     if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
         context_program_option (ctx, "-DWITH_DERIVATIVE");
     }
 
+    if ((lay->net->flags & NETWORK_FLAG_UNFUSED) == 0) {
+        context_program_option (ctx, "-DFUSED_DERIVATIVE");
+    }
+
     if (lay->prev->gradient_mem != 0) {
         context_program_option (ctx, "-DCALC_GRADIENT");
     }
@@ -157,14 +199,25 @@ compile (struct layer *lay)
     context_program_file (ctx, "dense-layer.cl");
     context_program_build (ctx, &dense->program);
     context_program_kernel (ctx, "forward", &dense->forward);
-    context_program_kernel (ctx, "derive_gradient", &dense->derive_gradient);
-    context_program_kernel (ctx, "backward", &dense->backward);
-    context_program_kernel (ctx, "backward_bias", &dense->backward_bias);
 
     /*
-     * Synchronize
+     * Backward kernels are defined along with derivatives
      */
-    clFinish (ctx->queue);
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        context_program_kernel (ctx, "backward", &dense->backward);
+        context_program_kernel (ctx, "backward_bias",
+                                &dense->backward_bias);
+    }
+
+    if ((lay->net->flags & NETWORK_FLAG_BACKPROP) != 0
+        && (lay->net->flags & NETWORK_FLAG_UNFUSED) != 0) {
+        context_program_kernel (ctx, "derive_gradient",
+                                &dense->derive_gradient);
+    }
+
+    if (lay->prev->gradient_mem != 0) {
+        context_program_kernel (ctx, "propagate", &dense->propagate);
+    }
 
     /*
      * Mark layer compiled
@@ -178,16 +231,12 @@ forward (struct layer *lay)
     struct dense_layer *dense;
     size_t globsiz, locsiz;
     cl_kernel kern;
-    cl_int err;
 
     g_assert (lay->type == LAYER_DENSE);
     dense = (struct dense_layer *) lay;
-
-    locsiz = MIN (lay->size, lay->net->ctx->group_size);
-    globsiz = util_upper_multiply (lay->size, locsiz);
     kern = dense->forward;
 
-    clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->prev->value_mem);
+    layer_set_value_arg (lay->prev, kern, 0);
     clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->weight_mem);
     clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_mem);
     clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->value_mem);
@@ -198,13 +247,28 @@ forward (struct layer *lay)
 
     g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
 
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsiz, &locsiz,
-                                  UTIL_NONNULL (lay->prev->forward_barrier),
-                                  UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
-                                  &lay->forward_barrier);
-    g_assert (err == CL_SUCCESS);
+    if (lay->batch > 1) {
+        context_run_gemm (lay->net->ctx, kern,
+                          lay->batch, lay->size,
+                          UTIL_NONNULL (lay->prev->forward_barrier),
+                          UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                          &lay->forward_barrier);
+        return;
+    }
+
+    if (dense->rows > 0) {
+        locsiz = lay->net->ctx->group_size;
+        globsiz = (lay->size + dense->rows - 1) / dense->rows * locsiz;
+    } else {
+        locsiz = MIN (lay->size, lay->net->ctx->group_size);
+        globsiz = util_upper_multiply (lay->size, locsiz);
+    }
+
+    context_run_kernel (lay->net->ctx, kern, 1,
+                        &globsiz, &locsiz,
+                        UTIL_NONNULL (lay->prev->forward_barrier),
+                        UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                        &lay->forward_barrier);
 }
 
 static void
@@ -213,9 +277,11 @@ backward (struct layer *lay)
     struct dense_layer *dense;
     size_t globsiz, locsiz;
     float ratefactor;
-    cl_event evderive, evbackprop, evbias, evlist[2];
+    cl_event evderive, evpropagate, evbackprop, evbias, evlist[2];
+    cl_event dep, wait, gradlist[2];
+    cl_int gradcount;
     cl_kernel kern;
-    cl_int err, evcount;
+    cl_int evcount;
 
 
     g_assert (lay->type == LAYER_DENSE);
@@ -223,111 +289,161 @@ backward (struct layer *lay)
 
 
     evderive = NULL;
+    evpropagate = NULL;
     evbackprop = NULL;
     evbias = NULL;
 
-    ratefactor = lay->net->rate * (1 - lay->net->momentum) * lay->net->loss;
+    /*
+     * Loss is fetched in background, so it doesn't scale the rate,
+     * square error gradients are scaled by the loss on the device
+     */
+    ratefactor = lay->net->rate * (1 - lay->net->momentum);
     dense = (struct dense_layer *) lay;
 
 
     /*
-     * Apply derivative to current layer's gradients
+     * All tasks depend on the next layer's barrier, as it gives
+     * this layer's gradients
      */
-    locsiz = MIN (lay->size, lay->net->ctx->group_size);
-    globsiz = ceilf ((float) lay->prev->size / locsiz) * locsiz;
-    kern = dense->derive_gradient;
+    dep = layer_next_gradient (lay);
 
-    clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->derivative_mem);
-    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->gradient_mem);
 
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsiz, &locsiz,
-                                  0, NULL,
-                                  &evderive);
-    g_assert (err == CL_SUCCESS);
+    /*
+     * Apply derivative to current layer's gradients, unless it's
+     * fused into the tasks below
+     */
+    if (dense->derive_gradient != NULL) {
+        locsiz = MIN (lay->batch * lay->size, lay->net->ctx->group_size);
+        globsiz = util_upper_multiply (lay->batch * lay->size, locsiz);
+        kern = dense->derive_gradient;
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->derivative_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->gradient_mem);
+
+        context_run_kernel (lay->net->ctx, kern, 1,
+                            &globsiz, &locsiz,
+                            UTIL_NONNULL (dep),
+                            UTIL_PTR_OR_NULL (dep),
+                            &evderive);
+
+        dep = evderive;
+    }
 
 
 
     /*
-     * Create pending events list for weights backpropagation and
-     * bias update tasks as they depend on derivative application
-     * and next layer's barrier
+     * Propagate gradients to the previous layer, it has to be
+     * done before the weights change
      */
-    evcount = 0;
-    evlist[evcount++] = evderive;
-
-    if (lay->next->backward_barrier != NULL) {
-        evlist[evcount++] = lay->next->backward_barrier;
-        clRetainEvent (lay->next->backward_barrier);
+    if (dense->propagate != NULL) {
+        kern = dense->propagate;
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->gradient_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->derivative_mem);
+        clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->weight_mem);
+        clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->prev->gradient_mem);
+
+        gradcount = layer_propagate_wait_list (lay, dep, gradlist);
+
+        if (lay->batch > 1) {
+            context_run_gemm (lay->net->ctx, kern,
+                              lay->batch, lay->prev->size,
+                              gradcount, gradlist,
+                              &evpropagate);
+        } else {
+            locsiz = lay->net->ctx->group_size;
+            globsiz = util_upper_multiply (lay->prev->size, locsiz);
+
+            context_run_kernel (lay->net->ctx, kern, 1,
+                                &globsiz, &locsiz,
+                                gradcount, gradlist,
+                                &evpropagate);
+        }
     }
 
 
 
     /*
-     * Run weights backpropagation
+     * Run weights update
      */
-    locsiz = lay->net->ctx->group_size;
-    globsiz = ceilf ((float) lay->prev->size / locsiz) * locsiz;
     kern = dense->backward;
+    wait = evpropagate != NULL ? evpropagate : dep;
 
     clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->prev->value_mem);
     clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->gradient_mem);
-    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->prev->gradient_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->derivative_mem);
     clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->weight_mem);
     clSetKernelArg (kern, 4, sizeof (cl_mem), &lay->delta_mem);
     clSetKernelArg (kern, 5, sizeof (cl_float), &ratefactor);
     clSetKernelArg (kern, 6, sizeof (cl_float), &lay->net->momentum);
     clSetKernelArg (kern, 7, sizeof (cl_float), &lay->net->decay);
 
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsiz, &locsiz,
-                                  evcount, evlist,
-                                  &evbackprop);
-    g_assert (err == CL_SUCCESS);
+    if (lay->batch > 1) {
+        context_run_gemm (lay->net->ctx, kern,
+                          lay->size, lay->prev->size,
+                          UTIL_NONNULL (wait),
+                          UTIL_PTR_OR_NULL (wait),
+                          &evbackprop);
+    } else {
+        context_run_sparse (lay->net->ctx, kern,
+                            lay->weights,
+                            UTIL_NONNULL (wait),
+                            UTIL_PTR_OR_NULL (wait),
+                            &evbackprop);
+    }
 
 
 
     /*
      * Run bias update
      */
-    globsiz = ceilf ((float) lay->size / locsiz) * locsiz;
     kern = dense->backward_bias;
 
     clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->gradient_mem);
-    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->bias_mem);
-    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_delta_mem);
-    clSetKernelArg (kern, 3, sizeof (cl_float), &ratefactor);
-    clSetKernelArg (kern, 4, sizeof (cl_float), &lay->net->momentum);
-    clSetKernelArg (kern, 5, sizeof (cl_float), &lay->net->decay);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->derivative_mem);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->bias_mem);
+    clSetKernelArg (kern, 3, sizeof (cl_mem), &lay->bias_delta_mem);
+    clSetKernelArg (kern, 4, sizeof (cl_float), &ratefactor);
+    clSetKernelArg (kern, 5, sizeof (cl_float), &lay->net->momentum);
+    clSetKernelArg (kern, 6, sizeof (cl_float), &lay->net->decay);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        lay->size,
+                        UTIL_NONNULL (dep),
+                        UTIL_PTR_OR_NULL (dep),
+                        &evbias);
+
 
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsiz, &locsiz,
-                                  evcount, evlist,
-                                  &evbias);
-    g_assert (err == CL_SUCCESS);
 
+    /*
+     * Previous layer goes on once its gradients are propagated,
+     * along with the weights update
+     */
+    if (evpropagate != NULL) {
+        layer_propagate_done (lay, evpropagate);
+    }
 
 
     /*
-     * Release derive event already owned by both backpropagation tasks
+     * Release events already owned by the tasks depending on them
      */
-    clReleaseEvent (evderive);
+    g_clear_pointer (&evderive, clReleaseEvent);
+    g_clear_pointer (&evpropagate, clReleaseEvent);
 
 
     /*
-     * Merge backpropagation events into one barrier
+     * Merge backpropagation events into one barrier, it's a marker
+     * as a barrier would hold off all later tasks of out-of-order
+     * queues
      */
     evlist[0] = evbackprop;
     evlist[1] = evbias;
     evcount = 2;
 
     g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
-    clEnqueueBarrierWithWaitList (lay->net->ctx->queue,
-                                  evcount, evlist,
-                                  &lay->backward_barrier);
+    clEnqueueMarkerWithWaitList (lay->net->ctx->queue,
+                                 evcount, evlist,
+                                 &lay->backward_barrier);
 
     /*
      * And release backpropagation events already owned by the barrier
@@ -348,15 +464,16 @@ release (struct layer *lay)
     g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
 
     clReleaseKernel (dense->forward);
-    clReleaseKernel (dense->derive_gradient);
-    clReleaseKernel (dense->backward);
-    clReleaseKernel (dense->backward_bias);
-    clReleaseProgram (dense->program);
+    g_clear_pointer (&dense->derive_gradient, clReleaseKernel);
+    g_clear_pointer (&dense->backward, clReleaseKernel);
+    g_clear_pointer (&dense->backward_bias, clReleaseKernel);
+    g_clear_pointer (&dense->propagate, clReleaseKernel);
+    context_program_release (lay->net->ctx, dense->program);
     clReleaseMemObject (lay->value_mem);
-    clReleaseMemObject (lay->derivative_mem);
-    clReleaseMemObject (lay->gradient_mem);
+    g_clear_pointer (&lay->derivative_mem, clReleaseMemObject);
+    g_clear_pointer (&lay->gradient_mem, clReleaseMemObject);
     clReleaseMemObject (lay->bias_mem);
-    clReleaseMemObject (lay->bias_delta_mem);
+    g_clear_pointer (&lay->bias_delta_mem, clReleaseMemObject);
     clReleaseMemObject (lay->weight_mem);
-    clReleaseMemObject (lay->delta_mem);
+    g_clear_pointer (&lay->delta_mem, clReleaseMemObject);
 }
@@ -19,6 +19,165 @@
  * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+void write_output (__global float *value_v,
+#ifdef WITH_DERIVATIVE
+                   __global float *derivative_v,
+#endif
+                   int outid,
+                   float sum)
+{
+#ifdef WITH_DERIVATIVE
+    __private float derivative;
+#endif
+
+#ifdef WITH_ACTIVATION
+#ifdef WITH_DERIVATIVE
+    value_v[outid] = activate (sum, &derivative);
+    derivative_v[outid] = derivative;
+#else
+    value_v[outid] = activate (sum);
+#endif
+#else
+    value_v[outid] = sum;
+#ifdef WITH_DERIVATIVE
+    derivative_v[outid] = 1;
+#endif
+#endif
+}
+
+#if BATCH > 1
+/*
+ * Batched variant, input and output values are BATCH x INPUTS and
+ * BATCH x OUTPUTS matrices, so the layer is a single blocked
+ * multiply with the transposed weights
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void forward (__global const float *input_value_v,
+              __global const float *weight_v,
+              __global const float *bias_v,
+              __global float *value_v
+#ifdef WITH_DERIVATIVE
+              , __global float *derivative_v
+#endif
+              )
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private float sum;
+    __private int outid, batch;
+
+    sum = gemm (input_value_v, INPUTS, 1,
+                weight_v, 1, INPUTS,
+                BATCH, OUTPUTS, INPUTS,
+                a_tile, b_tile);
+
+    outid = get_global_id (0);
+    batch = get_global_id (1);
+
+    if (batch < BATCH && outid < OUTPUTS) {
+        write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                      derivative_v,
+#endif
+                      batch * OUTPUTS + outid,
+                      sum + bias_v[outid]);
+    }
+}
+#elif defined (WITH_TILED)
+/*
+ * Tiled variant, each work-group computes ROWS outputs. Input is
+ * staged in local memory TILE values at once and work-items split
+ * each row between them, so neighbouring work-items read
+ * neighbouring weights. Partial sums are reduced in local memory,
+ * GROUP_SIZE has to be a power of 2 not less than ROWS
+ */
+#if VECTOR_WIDTH == 8
+#define floatv float8
+#define vloadv vload8
+#define vdot(a, b) (dot ((a).lo, (b).lo) + dot ((a).hi, (b).hi))
+#else
+#define floatv float4
+#define vloadv vload4
+#define vdot(a, b) dot (a, b)
+#endif
+
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void forward (__global const float *input_value_v,
+              __global const float *weight_v,
+              __global const float *bias_v,
+              __global float *value_v
+#ifdef WITH_DERIVATIVE
+              , __global float *derivative_v
+#endif
+              )
+{
+    __local float input_v[TILE];
+    __local float partial_v[ROWS * GROUP_SIZE];
+    __private float sum[ROWS];
+    __private int lid, row, base, count, tail, i, r, off;
+    __global const float *wrow;
+
+    lid = get_local_id (0);
+    row = get_group_id (0) * ROWS;
+
+    for (r = 0; r < ROWS; r++) {
+        sum[r] = 0;
+    }
+
+    for (base = 0; base < INPUTS; base += TILE) {
+        count = min (TILE, INPUTS - base);
+        tail = count - count % VECTOR_WIDTH;
+
+        for (i = lid; i < count; i += GROUP_SIZE) {
+            input_v[i] = input_value_v[base + i];
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (r = 0; r < ROWS && row + r < OUTPUTS; r++) {
+            wrow = weight_v + (row + r) * INPUTS + base;
+
+            for (i = lid * VECTOR_WIDTH; i < tail;
+                 i += GROUP_SIZE * VECTOR_WIDTH) {
+                sum[r] += vdot (vloadv (0, input_v + i),
+                                vloadv (0, wrow + i));
+            }
+
+            for (i = tail + lid; i < count; i += GROUP_SIZE) {
+                sum[r] += input_v[i] * wrow[i];
+            }
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    for (r = 0; r < ROWS; r++) {
+        partial_v[r * GROUP_SIZE + lid] = sum[r];
+    }
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (off = GROUP_SIZE / 2; off > 0; off /= 2) {
+        if (lid < off) {
+            for (r = 0; r < ROWS; r++) {
+                partial_v[r * GROUP_SIZE + lid] +=
+                    partial_v[r * GROUP_SIZE + lid + off];
+            }
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid < ROWS && row + lid < OUTPUTS) {
+        write_output (value_v,
+#ifdef WITH_DERIVATIVE
+                      derivative_v,
+#endif
+                      row + lid,
+                      partial_v[lid * GROUP_SIZE] + bias_v[row + lid]);
+    }
+}
+#else
 __kernel void forward (__global const float *input_value_v,
                        __global const float *weight_v,
                        __global const float *bias_v,
@@ -28,7 +187,7 @@ __kernel void forward (__global const float *input_value_v,
 #endif
                        )
 {
-    __private float sum, derivative;
+    __private float sum;
     __private int outid, inid;
 
     outid = get_global_id (0);
@@ -40,23 +199,38 @@ __kernel void forward (__global const float *input_value_v,
             sum += input_value_v[inid] * weight_v[outid * INPUTS + inid];
         }
 
-#ifdef WITH_ACTIVATION
-#ifdef WITH_DERIVATIVE
-        value_v[outid] = activate (sum, &derivative);
-        derivative_v[outid] = derivative;
-#else
-        value_v[outid] = activate (sum);
-#endif
-#else
-        value_v[outid] = sum;
+        write_output (value_v,
 #ifdef WITH_DERIVATIVE
-        derivative_v[outid] = 1;
-#endif
+                      derivative_v,
 #endif
+                      outid, sum);
     }
 }
+#endif
 
 #ifdef WITH_DERIVATIVE
+/*
+ * Gives gradient of the layer's weighted sum, with FUSED_DERIVATIVE
+ * activation derivative is applied here instead of by the
+ * derive_gradient kernel
+ */
+float layer_gradient (__global const float *gradient_v,
+                      __global const float *derivative_v,
+                      const int id)
+{
+#ifdef FUSED_DERIVATIVE
+    return gradient_v[id] * derivative_v[id];
+#else
+    return gradient_v[id];
+#endif
+}
+
+#ifdef FUSED_DERIVATIVE
+#define GRADIENT_SCALE derivative_v
+#else
+#define GRADIENT_SCALE 0
+#endif
+
 __kernel void derive_gradient (__global const float *derivative_v,
                                __global float *gradient_v)
 {
@@ -64,57 +238,168 @@ __kernel void derive_gradient (__global const float *derivative_v,
 
     outid = get_global_id (0);
 
-    if (outid < OUTPUTS) {
+    if (outid < BATCH * OUTPUTS) {
         gradient_v[outid] *= derivative_v[outid];
     }
 }
 
+#if BATCH > 1
+/*
+ * Weight gradients are summed over the batch by a blocked
+ * multiply of the transposed gradients and input values, and
+ * applied once for the whole batch
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void backward (__global const float *input_value_v,
+               __global const float *gradient_v,
+               __global const float *derivative_v,
+               __global float *weight_v,
+               __global float *delta_v,
+               const float rate,
+               const float momentum,
+               const float decay)
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private int inid, outid, w_index;
+    __private float sum, d, w;
+
+    sum = gemm_scaled (gradient_v, GRADIENT_SCALE, 1, OUTPUTS,
+                       input_value_v, INPUTS, 1,
+                       OUTPUTS, INPUTS, BATCH,
+                       a_tile, b_tile);
+
+    inid = get_global_id (0);
+    outid = get_global_id (1);
+
+    if (outid < OUTPUTS && inid < INPUTS) {
+        w_index = outid * INPUTS + inid;
+        d = delta_v[w_index];
+        w = weight_v[w_index];
+
+        d = d * momentum + sum * rate;
+        w = w * decay + d;
+
+        weight_v[w_index] = w;
+        delta_v[w_index] = d;
+    }
+}
+
+#ifdef CALC_GRADIENT
+/*
+ * Input gradients of the whole batch, has to be run before
+ * the weights are updated
+ */
+__kernel __attribute__ ((reqd_work_group_size (GEMM_TILE, GEMM_TILE, 1)))
+void propagate (__global const float *gradient_v,
+                __global const float *derivative_v,
+                __global const float *weight_v,
+                __global float *input_gradient_v)
+{
+    __local float a_tile[GEMM_TILE * GEMM_TILE];
+    __local float b_tile[GEMM_TILE * GEMM_TILE];
+    __private int inid, batch;
+    __private float sum;
+
+    sum = gemm_scaled (gradient_v, GRADIENT_SCALE, OUTPUTS, 1,
+                       weight_v, INPUTS, 1,
+                       BATCH, INPUTS, OUTPUTS,
+                       a_tile, b_tile);
+
+    inid = get_global_id (0);
+    batch = get_global_id (1);
+
+    if (batch < BATCH && inid < INPUTS) {
+        input_gradient_v[batch * INPUTS + inid] += sum;
+    }
+}
+#endif
+#else
+/*
+ * Weight update as an outer product of gradients and input
+ * values, one work-item per weight so neighbouring work-items
+ * update neighbouring weights
+ */
 __kernel void backward (__global const float *input_value_v,
                         __global const float *gradient_v,
-                        __global float *input_gradient_v,
+                        __global const float *derivative_v,
                         __global float *weight_v,
                         __global float *delta_v,
                         const float rate,
                         const float momentum,
                         const float decay)
 {
-    __private int inid, w_index, outid;
-    __private float in, g, d, w;
+    __private int id, inid, outid;
+    __private float d, w;
+
+    id = get_global_id (0);
+
+    if (id < OUTPUTS * INPUTS) {
+        outid = id / INPUTS;
+        inid = id % INPUTS;
+        d = delta_v[id];
+        w = weight_v[id];
+
+        d = d * momentum
+            + layer_gradient (gradient_v, derivative_v, outid)
+            * rate * input_value_v[inid];
+        w = w * decay + d;
+
+        weight_v[id] = w;
+        delta_v[id] = d;
+    }
+}
+
 #ifdef CALC_GRADIENT
+/*
+ * Input gradients, one work-item per input. Gradients are staged
+ * in local memory GROUP_SIZE at once and weights are read along
+ * the rows, so neighbouring work-items read neighbouring weights.
+ * Has to be run before the weights are updated
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void propagate (__global const float *gradient_v,
+                __global const float *derivative_v,
+                __global const float *weight_v,
+                __global float *input_gradient_v)
+{
+    __local float gradient_tile[GROUP_SIZE];
+    __private int inid, lid, base, count, outid;
     __private float sum;
-#endif
 
     inid = get_global_id (0);
+    lid = get_local_id (0);
+    sum = 0;
 
-    if (inid < INPUTS) {
-        in = input_value_v[inid];
-#ifdef CALC_GRADIENT
-        sum = 0;
-#endif
+    for (base = 0; base < OUTPUTS; base += GROUP_SIZE) {
+        count = min (GROUP_SIZE, OUTPUTS - base);
 
-        for (outid = 0; outid < OUTPUTS; outid++) {
-            w_index = outid * INPUTS + inid;
-            g = gradient_v[outid];
-            d = delta_v[w_index];
-            w = weight_v[w_index];
+        if (lid < count) {
+            gradient_tile[lid] = layer_gradient (gradient_v, derivative_v,
+                                                 base + lid);
+        }
 
-            d = d * momentum + g * rate * in;
-            w = w * decay + d;
-#ifdef CALC_GRADIENT
-            sum += g * w;
-#endif
+        barrier (CLK_LOCAL_MEM_FENCE);
 
-            weight_v[w_index] = w;
-            delta_v[w_index] = d;
+        if (inid < INPUTS) {
+            for (outid = 0; outid < count; outid++) {
+                sum += gradient_tile[outid]
+                    * weight_v[(base + outid) * INPUTS + inid];
+            }
         }
 
-#ifdef CALC_GRADIENT
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (inid < INPUTS) {
         input_gradient_v[inid] += sum;
-#endif
     }
 }
+#endif
+#endif
 
 __kernel void backward_bias (__global const float *gradient_v,
+                             __global const float *derivative_v,
                              __global float *bias_v,
                              __global float *delta_v,
                              const float rate,
@@ -122,14 +407,19 @@ __kernel void backward_bias (__global const float *gradient_v,
                              const float decay)
 {
     __private float d, g, b;
-    __private int id;
+    __private int id, batch;
 
     id = get_global_id (0);
 
     if (id < OUTPUTS) {
         d = delta_v[id];
-        g = gradient_v[id];
         b = bias_v[id];
+        g = 0;
+
+        for (batch = 0; batch < BATCH; batch++) {
+            g += layer_gradient (gradient_v, derivative_v,
+                                 batch * OUTPUTS + id);
+        }
 
         d = d * momentum + g * rate;
         b = b * decay + d;
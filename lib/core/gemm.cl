@@ -0,0 +1,102 @@
+/*
+ * gemm.cl
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Blocked matrix multiply, gives element (row, col) of the M x N
+ * product of A (M x K) and B (K x N), where row and col are the
+ * global ids 1 and 0. Matrices are given with row and column
+ * strides, so transposed operands don't need to be copied.
+ * Work-groups have to be GEMM_TILE x GEMM_TILE and all their
+ * work-items have to call it, even the ones out of bounds
+ * a_scale: NULL or matrix laid out like A, which scales A
+ * elementwise while loading
+ * a_tile, b_tile: local buffers of GEMM_TILE * GEMM_TILE floats
+ */
+float gemm_scaled (__global const float *a,
+                   __global const float *a_scale,
+                   const int a_row,
+                   const int a_col,
+                   __global const float *b,
+                   const int b_row,
+                   const int b_col,
+                   const int m,
+                   const int n,
+                   const int k,
+                   __local float *a_tile,
+                   __local float *b_tile)
+{
+    __private int row, col, lx, ly, t, i, index;
+    __private float sum;
+
+    lx = get_local_id (0);
+    ly = get_local_id (1);
+    col = get_global_id (0);
+    row = get_global_id (1);
+    sum = 0;
+
+    for (t = 0; t < k; t += GEMM_TILE) {
+        if (row < m && t + lx < k) {
+            index = row * a_row + (t + lx) * a_col;
+
+            if (a_scale != 0) {
+                a_tile[ly * GEMM_TILE + lx] = a[index] * a_scale[index];
+            } else {
+                a_tile[ly * GEMM_TILE + lx] = a[index];
+            }
+        } else {
+            a_tile[ly * GEMM_TILE + lx] = 0;
+        }
+
+        if (t + ly < k && col < n) {
+            b_tile[ly * GEMM_TILE + lx] = b[(t + ly) * b_row + col * b_col];
+        } else {
+            b_tile[ly * GEMM_TILE + lx] = 0;
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+
+        for (i = 0; i < GEMM_TILE; i++) {
+            sum += a_tile[ly * GEMM_TILE + i] * b_tile[i * GEMM_TILE + lx];
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    return sum;
+}
+
+float gemm (__global const float *a,
+            const int a_row,
+            const int a_col,
+            __global const float *b,
+            const int b_row,
+            const int b_col,
+            const int m,
+            const int n,
+            const int k,
+            __local float *a_tile,
+            __local float *b_tile)
+{
+    return gemm_scaled (a, 0, a_row, a_col,
+                        b, b_row, b_col,
+                        m, n, k,
+                        a_tile, b_tile);
+}
@@ -27,7 +27,26 @@
 struct input_layer
 {
     struct layer base;
-    float *data;
+
+    /*
+     * Ring of staging buffers, samples are uploaded to the slot
+     * following the pending ones while the network reads the
+     * current one, forward moves to the next pending slot. Slot
+     * may be overwritten once its release event is completed
+     */
+    int ring_depth;
+    int current;
+    int pending;
+    cl_mem *ring_mem;
+    cl_event *upload_event;
+    cl_event *release_event;
+
+    /* host copies of slots being uploaded, NULL if mapped */
+    float **ring_data;
+
+    /* values are written through mapping, pointer if mapped now */
+    gboolean mapped;
+    float *mapping;
 };
 
 static void forward (struct layer *lay);
@@ -57,42 +76,286 @@ layer_make_input (struct network *net,
     base->compile = compile;
     base->release = release;
 
-    input->data = g_new (float, base->size);
+    input->ring_depth = 1;
 
     return base;
 }
 
+void
+layer_input_set_ring_depth (struct layer *lay,
+                            int depth)
+{
+    struct input_layer *input;
+
+    g_assert (lay->type == LAYER_INPUT);
+    g_assert (!(lay->flags & LAYER_FLAG_COMPILED));
+    g_assert (depth > 0);
+
+    input = (struct input_layer *) lay;
+    input->ring_depth = depth;
+}
+
+/*
+ * Makes release event of the slot, it's completed once
+ * barriers of all next layers are
+ */
+static void
+mark_release (struct input_layer *input,
+              int slot)
+{
+    struct layer *lay, *next;
+    cl_event *evlist;
+    cl_int evcount, err;
+    guint i;
+
+    lay = (struct layer *) input;
+    evcount = 0;
+
+    g_clear_pointer (&input->release_event[slot], clReleaseEvent);
+
+    if (lay->next_list == NULL) {
+        return;
+    }
+
+    evlist = g_new (cl_event, lay->next_list->len * 2);
+
+    for (i = 0; i < lay->next_list->len; i++) {
+        next = g_ptr_array_index (lay->next_list, i);
+
+        if (next->forward_barrier != NULL) {
+            evlist[evcount++] = next->forward_barrier;
+        }
+
+        if (next->backward_barrier != NULL) {
+            evlist[evcount++] = next->backward_barrier;
+        }
+    }
+
+    if (evcount > 0) {
+        err = clEnqueueMarkerWithWaitList (lay->net->ctx->queue,
+                                           evcount, evlist,
+                                           &input->release_event[slot]);
+        g_assert (err == CL_SUCCESS);
+
+        /*
+         * Uploads on the transfer queue wait for the marker
+         */
+        clFlush (lay->net->ctx->queue);
+    }
+
+    g_free (evlist);
+}
+
+/*
+ * Gives the slot for next samples, if all slots are pending
+ * it's the newest one and its samples are replaced
+ */
+static int
+next_slot (struct input_layer *input)
+{
+    if (input->pending == input->ring_depth) {
+        return (input->current + input->pending) % input->ring_depth;
+    }
+
+    return (input->current + 1 + input->pending) % input->ring_depth;
+}
+
+/*
+ * Gives the slot for next samples, the current slot is
+ * released just now if there is no other one
+ */
+static int
+acquire_slot (struct input_layer *input)
+{
+    struct layer *lay;
+    int slot;
+
+    lay = (struct layer *) input;
+
+    g_assert (lay->flags & LAYER_FLAG_COMPILED);
+    g_assert (input->mapping == NULL);
+
+    slot = next_slot (input);
+
+    if (slot == input->current && input->pending == 0) {
+        mark_release (input, slot);
+    }
+
+    return slot;
+}
+
 void
 layer_input_set_data (struct layer *lay,
                       const float *data,
                       int size)
 {
     struct input_layer *input;
+    int slot;
+    cl_int err;
+
+    g_assert (lay->type == LAYER_INPUT);
+
+    input = (struct input_layer *) lay;
+
+    /*
+     * Kernels always run the whole batch, so partial batches
+     * would mix in samples of earlier steps
+     */
+    g_assert (lay->batch * lay->size == size);
+
+    if (input->mapped) {
+        memcpy (layer_input_map (lay), data, size * sizeof (float));
+        layer_input_unmap (lay);
+        return;
+    }
+
+    slot = acquire_slot (input);
+
+    /*
+     * Host copy is reused once its previous upload is done,
+     * so the caller's data may be freed just after the call
+     */
+    if (input->upload_event[slot] != NULL) {
+        clWaitForEvents (1, &input->upload_event[slot]);
+        g_clear_pointer (&input->upload_event[slot], clReleaseEvent);
+    }
+
+    memcpy (input->ring_data[slot], data, size * sizeof (float));
+
+    err = clEnqueueWriteBuffer (network_upload_queue (lay->net),
+                                input->ring_mem[slot],
+                                CL_FALSE,
+                                0, size * sizeof (cl_float),
+                                input->ring_data[slot],
+                                UTIL_NONNULL (input->release_event[slot]),
+                                UTIL_PTR_OR_NULL (input->release_event[slot]),
+                                &input->upload_event[slot]);
+    g_assert (err == CL_SUCCESS);
+
+    clFlush (network_upload_queue (lay->net));
+
+    input->pending = MIN (input->pending + 1, input->ring_depth);
+}
+
+void
+layer_input_set_mapped (struct layer *lay,
+                        gboolean mapped)
+{
+    struct input_layer *input;
 
     g_assert (lay->type == LAYER_INPUT);
-    g_assert (size == lay->size);
+    g_assert (!(lay->flags & LAYER_FLAG_COMPILED));
 
     input = (struct input_layer *) lay;
+    input->mapped = mapped;
+}
+
+float *
+layer_input_map (struct layer *lay)
+{
+    struct input_layer *input;
+    cl_event release;
+    cl_int err;
+    int slot;
+
+    g_assert (lay->type == LAYER_INPUT);
 
-    memcpy (input->data, data, size * sizeof (float));
+    input = (struct input_layer *) lay;
+
+    g_assert (input->mapped);
+
+    /*
+     * Previous values of the slot may be still read
+     * by the next layer
+     */
+    slot = acquire_slot (input);
+    release = input->release_event[slot];
+
+    /*
+     * Replaced samples may be still being unmapped
+     */
+    if (input->upload_event[slot] != NULL) {
+        clWaitForEvents (1, &input->upload_event[slot]);
+        g_clear_pointer (&input->upload_event[slot], clReleaseEvent);
+    }
+
+    input->mapping = clEnqueueMapBuffer (network_upload_queue (lay->net),
+                                         input->ring_mem[slot],
+                                         CL_TRUE,
+                                         CL_MAP_WRITE_INVALIDATE_REGION,
+                                         0, lay->batch * lay->size
+                                         * sizeof (cl_float),
+                                         UTIL_NONNULL (release),
+                                         UTIL_PTR_OR_NULL (release),
+                                         NULL, &err);
+    g_assert (err == CL_SUCCESS);
+
+    return input->mapping;
+}
+
+void
+layer_input_unmap (struct layer *lay)
+{
+    struct input_layer *input;
+    cl_int err;
+    int slot;
+
+    g_assert (lay->type == LAYER_INPUT);
+
+    input = (struct input_layer *) lay;
+
+    g_assert (input->mapping != NULL);
+
+    slot = next_slot (input);
+
+    g_clear_pointer (&input->upload_event[slot], clReleaseEvent);
+
+    err = clEnqueueUnmapMemObject (network_upload_queue (lay->net),
+                                   input->ring_mem[slot],
+                                   input->mapping,
+                                   0, NULL,
+                                   &input->upload_event[slot]);
+    g_assert (err == CL_SUCCESS);
+
+    clFlush (network_upload_queue (lay->net));
+
+    input->mapping = NULL;
+    input->pending = MIN (input->pending + 1, input->ring_depth);
 }
 
 static void
 forward (struct layer *lay)
 {
     struct input_layer *input;
+    int slot;
 
     g_assert (lay->type == LAYER_INPUT);
 
     input = (struct input_layer *) lay;
 
-    clEnqueueWriteBuffer (lay->net->ctx->queue,
-                          lay->value_mem,
-                          CL_FALSE,
-                          0, lay->size * sizeof (cl_float),
-                          input->data,
-                          0, NULL,
-                          &lay->forward_barrier);
+    /*
+     * Move to the next uploaded slot, the one left is released
+     * once the next layer is done with it. Without new samples
+     * the current ones are propagated again
+     */
+    if (input->pending > 0) {
+        if (input->ring_depth > 1) {
+            mark_release (input, input->current);
+        }
+
+        input->current = (input->current + 1) % input->ring_depth;
+        input->pending--;
+    }
+
+    slot = input->current;
+    lay->value_mem = input->ring_mem[slot];
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+    if (input->upload_event[slot] != NULL) {
+        lay->forward_barrier = input->upload_event[slot];
+        clRetainEvent (lay->forward_barrier);
+    }
 }
 
 static void
@@ -103,10 +366,37 @@ backward (struct layer *lay)
 static void
 compile (struct layer *lay)
 {
-    layer_create_buffer (lay, &lay->value_mem,
-                         lay->size, CL_MEM_READ_WRITE);
-    layer_create_buffer (lay, &lay->gradient_mem,
-                         lay->size, CL_MEM_READ_WRITE);
+    struct input_layer *input;
+    int flags, slot;
+
+    input = (struct input_layer *) lay;
+    flags = CL_MEM_READ_WRITE;
+
+    if (input->mapped) {
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+    }
+
+    input->ring_mem = g_new0 (cl_mem, input->ring_depth);
+    input->upload_event = g_new0 (cl_event, input->ring_depth);
+    input->release_event = g_new0 (cl_event, input->ring_depth);
+    input->ring_data = g_new0 (float *, input->ring_depth);
+    input->current = input->ring_depth - 1;
+
+    for (slot = 0; slot < input->ring_depth; slot++) {
+        layer_create_buffer (lay, &input->ring_mem[slot],
+                             lay->batch * lay->size, flags);
+
+        if (!input->mapped) {
+            input->ring_data[slot] = g_new (float, lay->batch * lay->size);
+        }
+    }
+
+    lay->value_mem = input->ring_mem[input->current];
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        layer_create_buffer (lay, &lay->gradient_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+    }
 
     lay->flags |= LAYER_FLAG_COMPILED;
 }
@@ -115,14 +405,42 @@ static void
 release (struct layer *lay)
 {
     struct input_layer *input;
+    int slot;
 
     g_assert (lay->type == LAYER_INPUT);
 
     input = (struct input_layer *) lay;
 
     g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
-    g_clear_pointer (&input->data, g_free);
 
-    clReleaseMemObject (lay->value_mem);
-    clReleaseMemObject (lay->gradient_mem);
+    if (input->mapping != NULL) {
+        slot = (input->current + 1 + input->pending) % input->ring_depth;
+        clEnqueueUnmapMemObject (network_upload_queue (lay->net),
+                                 input->ring_mem[slot],
+                                 input->mapping, 0, NULL, NULL);
+    }
+
+    /*
+     * Host copies mustn't be freed while being uploaded
+     */
+    for (slot = 0; slot < input->ring_depth
+         && (lay->flags & LAYER_FLAG_COMPILED); slot++) {
+        if (input->upload_event[slot] != NULL) {
+            clWaitForEvents (1, &input->upload_event[slot]);
+            clReleaseEvent (input->upload_event[slot]);
+        }
+
+        g_clear_pointer (&input->release_event[slot], clReleaseEvent);
+        g_free (input->ring_data[slot]);
+        clReleaseMemObject (input->ring_mem[slot]);
+    }
+
+    g_free (input->ring_mem);
+    g_free (input->upload_event);
+    g_free (input->release_event);
+    g_free (input->ring_data);
+
+    if (lay->gradient_mem != NULL) {
+        clReleaseMemObject (lay->gradient_mem);
+    }
 }
@@ -21,6 +21,9 @@
 
 #include "layer.h"
 #include "network.h"
+#include "context.h"
+#include "plan.h"
+#include "util.h"
 
 #include <math.h>
 
@@ -28,9 +31,15 @@ void
 layer_append (struct layer *lay,
               struct layer *other)
 {
-    if (lay->next != other) {
-        g_assert_null (lay->next);
-        lay->next = other;
+    g_assert (lay != other);
+
+    if (lay->next_list == NULL) {
+        lay->next_list = g_ptr_array_new ();
+    }
+
+    if (!g_ptr_array_find (lay->next_list, other, NULL)) {
+        g_ptr_array_add (lay->next_list, other);
+        lay->next = g_ptr_array_index (lay->next_list, 0);
         layer_prepend (other, lay);
     }
 }
@@ -39,9 +48,17 @@ void
 layer_prepend (struct layer *lay,
                struct layer *other)
 {
-    if (lay->prev != other) {
-        g_assert_null (lay->prev);
-        lay->prev = other;
+    g_assert (lay != other);
+
+    if (lay->prev_list == NULL) {
+        lay->prev_list = g_ptr_array_new ();
+    }
+
+    if (!g_ptr_array_find (lay->prev_list, other, NULL)) {
+        g_assert (lay->prev_list->len == 0
+                  || (lay->flags & LAYER_FLAG_MERGE));
+        g_ptr_array_add (lay->prev_list, other);
+        lay->prev = g_ptr_array_index (lay->prev_list, 0);
         layer_append (other, lay);
     }
 }
@@ -50,6 +67,7 @@ void
 layer_compile (struct layer *lay)
 {
     if ((lay->flags & LAYER_FLAG_COMPILED) == 0) {
+        lay->batch = lay->net->batch;
         lay->compile (lay);
         g_assert (lay->flags & LAYER_FLAG_COMPILED);
     }
@@ -75,6 +93,88 @@ layer_backward (struct layer *lay)
     }
 }
 
+void
+layer_clear_gradient (struct layer *lay)
+{
+    cl_float zero;
+    cl_int err;
+
+    g_clear_pointer (&lay->gradient_barrier, clReleaseEvent);
+
+    /*
+     * Views are cleared along with the next layer's buffer
+     */
+    if (lay->gradient_mem == NULL || (lay->flags & LAYER_FLAG_VIEW)) {
+        return;
+    }
+
+    /*
+     * Gradients are read by the layer's own backward tasks
+     */
+    zero = 0;
+    err = clEnqueueFillBuffer (lay->net->ctx->queue,
+                               lay->gradient_mem,
+                               &zero, sizeof (zero),
+                               0, lay->batch * lay->size
+                               * sizeof (cl_float),
+                               UTIL_NONNULL (lay->backward_barrier),
+                               UTIL_PTR_OR_NULL (lay->backward_barrier),
+                               &lay->gradient_barrier);
+    g_assert (err == CL_SUCCESS);
+}
+
+cl_event
+layer_next_gradient (struct layer *lay)
+{
+    g_assert (lay->next != NULL);
+
+    /*
+     * Next layers are propagated back before this one,
+     * so the last of them wrote the gradients
+     */
+    return lay->gradient_barrier;
+}
+
+cl_int
+layer_propagate_wait_list (struct layer *lay,
+                           cl_event dep,
+                           cl_event *evlist)
+{
+    cl_int evcount;
+
+    evcount = 0;
+
+    if (dep != NULL) {
+        evlist[evcount++] = dep;
+    }
+
+    if (lay->prev != NULL && lay->prev->gradient_barrier != NULL) {
+        evlist[evcount++] = lay->prev->gradient_barrier;
+    }
+
+    return evcount;
+}
+
+void
+layer_propagate_done (struct layer *lay,
+                      cl_event ev)
+{
+    g_assert (lay->prev != NULL);
+
+    layer_gradient_written (lay->prev, ev);
+}
+
+void
+layer_gradient_written (struct layer *lay,
+                        cl_event ev)
+{
+    g_assert (ev != NULL);
+
+    clRetainEvent (ev);
+    g_clear_pointer (&lay->gradient_barrier, clReleaseEvent);
+    lay->gradient_barrier = ev;
+}
+
 void
 layer_free (struct layer *lay)
 {
@@ -82,6 +182,10 @@ layer_free (struct layer *lay)
         lay->release (lay);
     }
 
+    g_clear_pointer (&lay->gradient_barrier, clReleaseEvent);
+    g_clear_pointer (&lay->prev_list, g_ptr_array_unref);
+    g_clear_pointer (&lay->next_list, g_ptr_array_unref);
+
     g_free (lay);
 }
 
@@ -95,7 +199,7 @@ layer_load_value (struct layer *lay,
     if (lay->value_mem == 0) {
         return;
     }
-    g_assert (offset + count <= lay->size);
+    g_assert (offset + count <= lay->batch * lay->size);
     clFinish (lay->net->ctx->queue);
     clEnqueueReadBuffer (lay->net->ctx->queue,
                          lay->value_mem,
@@ -124,3 +228,30 @@ layer_create_buffer (struct layer *lay,
 
     *handle = mem;
 }
+
+void
+layer_create_value (struct layer *lay)
+{
+    if (lay->flags & LAYER_FLAG_SHARED) {
+        lay->value_mem = NULL;
+        return;
+    }
+
+    layer_create_buffer (lay, &lay->value_mem,
+                         lay->batch * lay->size, CL_MEM_READ_WRITE);
+}
+
+void
+layer_set_value_arg (struct layer *lay,
+                     cl_kernel kern,
+                     cl_uint index)
+{
+    cl_int err;
+
+    err = clSetKernelArg (kern, index, sizeof (cl_mem), &lay->value_mem);
+    g_assert (err == CL_SUCCESS);
+
+    if (lay->net->ctx->recording != NULL) {
+        plan_bind (lay->net->ctx->recording, kern, index, lay);
+    }
+}
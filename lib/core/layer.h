@@ -24,6 +24,9 @@
 #include "context.h"
 
 #define LAYER_FLAG_COMPILED 1
+#define LAYER_FLAG_MERGE 2
+#define LAYER_FLAG_VIEW 4
+#define LAYER_FLAG_SHARED 8
 
 enum layer_type
 {
@@ -32,9 +35,52 @@ enum layer_type
     LAYER_OUTPUT,
     LAYER_CONV,
     LAYER_DENSE,
+    LAYER_POOL,
+    LAYER_CONCAT,
+    LAYER_ADD,
     N_LAYERS,
 };
 
+/*
+ * Convolution strategies, AUTO picks one by the layer's shape
+ */
+enum conv_backend
+{
+    CONV_BACKEND_AUTO,
+    CONV_BACKEND_DIRECT,
+    CONV_BACKEND_TILED,
+    CONV_BACKEND_GEMM,
+    CONV_BACKEND_WINOGRAD,
+};
+
+/*
+ * Pooling modes
+ */
+enum pool_mode
+{
+    POOL_MAX,
+    POOL_AVERAGE,
+};
+
+/*
+ * Output loss functions
+ */
+enum loss_function
+{
+    LOSS_SQUARE_ERROR,
+    LOSS_SOFTMAX_CROSS_ENTROPY,
+};
+
+/*
+ * Convolution padding modes
+ */
+enum conv_padding
+{
+    CONV_PADDING_SAME,
+    CONV_PADDING_VALID,
+    CONV_PADDING_EXPLICIT,
+};
+
 struct layer
 {
     /*
@@ -48,13 +94,22 @@ struct layer
     struct layer *prev;
     struct layer *next;
 
+    /*
+     * all previous and next layers, $prev and $next are the first
+     * of them. Only merge layers have many previous layers
+     */
+    GPtrArray *prev_list;
+    GPtrArray *next_list;
+
     /*
      * layer type
      */
     enum layer_type type;
 
     /*
-     * state flags
+     * state flags, MERGE marks layers taking many previous layers
+     * and VIEW the ones whose value and gradient buffers are views
+     * of the next layer's buffers
      */
     int flags;
 
@@ -63,9 +118,15 @@ struct layer
      */
     const char *activation;
 
+    /*
+     * number of samples, taken from the network at compile time
+     */
+    int batch;
+
     /*
      * common memory buffers
-     * with length equals the number of output nodes
+     * with length equals the number of output nodes, times
+     * the batch size for value, derivative and gradient
      */
     cl_mem value_mem;
     cl_mem derivative_mem;
@@ -86,6 +147,13 @@ struct layer
     cl_event forward_barrier;
     cl_event backward_barrier;
 
+    /*
+     * event of the last task writing the gradient buffer, set by
+     * its clearing and then by each next layer accumulating into
+     * it, tasks accumulating gradients have to wait for it
+     */
+    cl_event gradient_barrier;
+
     /*
      * 3D size
      */
@@ -134,13 +202,49 @@ struct layer *layer_make_dense (struct network *net,
  * layer_make_conv:
  * Creates convolutional layer
  * size: size of the kernel, for example 3 for 3x3 kernel
- * depth: number of filters
+ * stride: kernel stride
+ * filters: number of filters, there is a single bias per filter
  * activation: activation function name
  */
 struct layer *layer_make_conv (struct network *net,
-                               int size, int depth, int stride,
+                               int size, int stride, int filters,
                                const char *activation);
 
+/*
+ * layer_make_depthwise:
+ * Creates depthwise convolutional layer, with a single filter per
+ * input channel, so depth is the input's one
+ * size: size of the kernel, for example 3 for 3x3 kernel
+ * stride: kernel stride
+ * activation: activation function name
+ */
+struct layer *layer_make_depthwise (struct network *net,
+                                    int size, int stride,
+                                    const char *activation);
+
+/*
+ * layer_make_pointwise:
+ * Creates pointwise (1x1) convolutional layer, run as a single
+ * matrix multiply of all input positions by the filters
+ * filters: number of filters
+ * activation: activation function name
+ */
+struct layer *layer_make_pointwise (struct network *net,
+                                    int filters,
+                                    const char *activation);
+
+/*
+ * layer_make_pool:
+ * Creates pooling layer, windows don't pad the input so output
+ * size is (input - size) / stride + 1, depth is the input's one
+ * mode: max or average pooling
+ * size: size of the window, for example 2 for 2x2 window
+ * stride: window stride
+ */
+struct layer *layer_make_pool (struct network *net,
+                               enum pool_mode mode,
+                               int size, int stride);
+
 /*
  * layer_make_input:
  * Creates input layer
@@ -154,19 +258,43 @@ struct layer *layer_make_input (struct network *net,
 /*
  * layer_make_output
  * Creates output layer
+ * loss: loss function, with softmax cross entropy the previous
+ * layer's values are treated as logits of each sample and the
+ * output values are their softmax probabilities
+ */
+struct layer *layer_make_output (struct network *net,
+                                 enum loss_function loss);
+
+/*
+ * layer_make_concat:
+ * Creates merge layer joining values of its previous layers along
+ * the depth, they must have the same width and height. Previous
+ * layers are added with layer_append or layer_prepend and their
+ * order is the order of the channels. If samples of all previous
+ * layers are contiguous in the result, that is for flat layers with
+ * single sample batches, they write their values right into it
+ */
+struct layer *layer_make_concat (struct network *net);
+
+/*
+ * layer_make_add:
+ * Creates merge layer summing values of its previous layers, they
+ * must have the same size, for example to close residual blocks
  */
-struct layer *layer_make_output (struct network *net);
+struct layer *layer_make_add (struct network *net);
 
 /*
  * layer_append
- * Appends another layer in front
+ * Appends another layer in front, a layer may feed many next
+ * layers and its gradient sums the ones of all of them
  */
 void layer_append (struct layer *lay,
                    struct layer *other);
 
 /*
  * layer_prepend
- * Prepends another layer back
+ * Prepends another layer back, only merge layers may have
+ * more than one
  */
 void layer_prepend (struct layer *lay,
                     struct layer *other);
@@ -210,10 +338,50 @@ void layer_load_value (struct layer *lay,
 
 /*
  * layer_clear_gradient:
- * Clears the gradient buffer
+ * Enqueues clearing of the gradient buffer once its previous
+ * readers are done, sets the gradient barrier
  */
 void layer_clear_gradient (struct layer *lay);
 
+/*
+ * layer_next_gradient:
+ * Gives the event completing the layer's gradients, once all next
+ * layers are propagated back. All backward tasks of the layer
+ * depend on it
+ * returns: (nullable) event handle owned by the layer
+ */
+cl_event layer_next_gradient (struct layer *lay);
+
+/*
+ * layer_propagate_wait_list:
+ * Makes wait list of tasks accumulating gradients into the
+ * previous layer's gradient buffer
+ * dep: (nullable) event the task depends on besides clearing
+ * of the buffer
+ * evlist: list of at least 2 events, filled by the call
+ * returns: number of events in the list
+ */
+cl_int layer_propagate_wait_list (struct layer *lay,
+                                  cl_event dep,
+                                  cl_event *evlist);
+
+/*
+ * layer_propagate_done:
+ * Sets the task accumulating gradients into the previous layer's
+ * buffer, the following ones wait for it
+ * ev: event of the task
+ */
+void layer_propagate_done (struct layer *lay,
+                           cl_event ev);
+
+/*
+ * layer_gradient_written:
+ * Sets the last task writing the layer's gradient buffer
+ * ev: event of the task, retained by the call
+ */
+void layer_gradient_written (struct layer *lay,
+                             cl_event ev);
+
 /*
  * layer_create_buffer:
  * Creates a memory buffer owned by the layer
@@ -226,16 +394,76 @@ void layer_create_buffer (struct layer *lay,
                           int size,
                           int flags);
 
+/*
+ * layer_create_value:
+ * Creates the layer's value buffer of $batch samples, unless the
+ * values are shared with other layers (LAYER_FLAG_SHARED), then
+ * the network sets the buffer after compiling
+ */
+void layer_create_value (struct layer *lay);
+
+/*
+ * layer_set_value_arg:
+ * Passes the layer's values to the kernel, kernels reading values
+ * of other layers in forward calls set them with it, so execution
+ * plans pass the current buffers of layers rotating them
+ * kern: kernel handle
+ * index: argument index
+ */
+void layer_set_value_arg (struct layer *lay,
+                          cl_kernel kern,
+                          cl_uint index);
+
 /*
  * layer_input_set_data
  * Sets data for the input layer
  * data: data memory
- * size: number of numeric (float) values to write
+ * size: number of numeric (float) values to write, it has to be
+ * the whole batch
  */
 void layer_input_set_data (struct layer *lay,
                            const float *data,
                            int size);
 
+/*
+ * layer_input_set_ring_depth:
+ * Sets number of staging buffers of input values, samples may be
+ * set for up to $depth forward steps ahead and their uploads
+ * overlap with propagation of the current ones. Once all buffers
+ * are pending the newest samples are replaced. Has to be called
+ * before the layer is compiled, the default is 1
+ * depth: number of buffers
+ */
+void layer_input_set_ring_depth (struct layer *lay,
+                                 int depth);
+
+/*
+ * layer_input_set_mapped:
+ * Backs input values with host accessible memory which is written
+ * in place through layer_input_map, it saves copies on devices
+ * sharing memory with the host. Has to be called before the layer
+ * is compiled
+ * mapped: whether to map the values
+ */
+void layer_input_set_mapped (struct layer *lay,
+                             gboolean mapped);
+
+/*
+ * layer_input_map:
+ * Maps input values for writing, waits until the network is done
+ * with the previous ones. Values aren't used by the device until
+ * layer_input_unmap is called
+ * returns: pointer to the batch size times the layer size values
+ */
+float *layer_input_map (struct layer *lay);
+
+/*
+ * layer_input_unmap:
+ * Unmaps input values written after layer_input_map, the next
+ * forward propagation depends on it
+ */
+void layer_input_unmap (struct layer *lay);
+
 /*
  * layer_output_set_truth:
  * Sets truth data to the output layer
@@ -246,6 +474,40 @@ void layer_output_set_truth (struct layer *lay,
                              const float *data,
                              int size);
 
+/*
+ * layer_output_set_ring_depth:
+ * Sets number of staging buffers of truth data, same as
+ * layer_input_set_ring_depth does for input values
+ * depth: number of buffers
+ */
+void layer_output_set_ring_depth (struct layer *lay,
+                                  int depth);
+
+/*
+ * layer_conv_set_padding:
+ * Sets convolution padding mode, has to be called before the layer
+ * is compiled. Output size is ceil (input / stride) with same
+ * padding, the default, (input - kernel) / stride + 1 with valid
+ * padding and (input + 2 * pad - kernel) / stride + 1 with explicit
+ * padding. Padded values are zeros
+ * padding: padding mode
+ * xpad: horizontal padding on each side, used by explicit mode
+ * ypad: vertical padding on each side, used by explicit mode
+ */
+void layer_conv_set_padding (struct layer *lay,
+                             enum conv_padding padding,
+                             int xpad, int ypad);
+
+/*
+ * layer_conv_set_backend:
+ * Overrides the convolution strategy, has to be called before
+ * the layer is compiled. Backends which can't handle the layer
+ * or the device fall back to the direct one
+ * backend: strategy to use
+ */
+void layer_conv_set_backend (struct layer *lay,
+                             enum conv_backend backend);
+
 /*
  * layer_conv_set_filter:
  * Sets convolutional layer filter data
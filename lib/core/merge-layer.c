@@ -0,0 +1,458 @@
+/*
+ * merge-layer.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "layer.h"
+#include "network.h"
+#include "context.h"
+#include "util.h"
+
+struct merge_layer
+{
+    struct layer base;
+
+    /* concatenated inputs write right into the layer's buffers */
+    gboolean views;
+
+    cl_program program;
+
+    /*
+     * Forward kernel of each input, so they keep their arguments
+     * between runs
+     */
+    cl_kernel *forward;
+    cl_kernel backward;
+};
+
+static struct layer *make_merge (struct network *net,
+                                 enum layer_type type);
+static gboolean can_view (struct layer *lay);
+static void make_views (struct layer *lay);
+static void compile (struct layer *lay);
+static void forward (struct layer *lay);
+static void backward (struct layer *lay);
+static void release (struct layer *lay);
+
+struct layer *
+layer_make_concat (struct network *net)
+{
+    return make_merge (net, LAYER_CONCAT);
+}
+
+struct layer *
+layer_make_add (struct network *net)
+{
+    return make_merge (net, LAYER_ADD);
+}
+
+static struct layer *
+make_merge (struct network *net,
+            enum layer_type type)
+{
+    struct merge_layer *merge;
+    struct layer *lay;
+
+    merge = g_new0 (struct merge_layer, 1);
+    lay = (struct layer *) merge;
+
+    lay->net = net;
+    lay->type = type;
+    lay->flags = LAYER_FLAG_MERGE;
+    lay->compile = compile;
+    lay->forward = forward;
+    lay->backward = backward;
+    lay->release = release;
+
+    return lay;
+}
+
+static void
+compile (struct layer *lay)
+{
+    struct merge_layer *merge;
+    struct layer *prev;
+    struct context *ctx;
+    gboolean gradient;
+    guint i;
+
+    g_assert (lay->type == LAYER_CONCAT || lay->type == LAYER_ADD);
+    g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
+    g_assert (lay->prev_list != NULL && lay->prev_list->len > 0);
+
+    merge = (struct merge_layer *) lay;
+    ctx = lay->net->ctx;
+    gradient = FALSE;
+
+    lay->width = lay->prev->width;
+    lay->height = lay->prev->height;
+    lay->depth = 0;
+    lay->weights = 0;
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        prev = g_ptr_array_index (lay->prev_list, i);
+
+        g_assert (prev->flags & LAYER_FLAG_COMPILED);
+        g_assert (prev->width == lay->width
+                  && prev->height == lay->height);
+
+        if (lay->type == LAYER_CONCAT) {
+            lay->depth += prev->depth;
+        } else {
+            g_assert (prev->depth == lay->prev->depth);
+            lay->depth = prev->depth;
+        }
+
+        gradient |= prev->gradient_mem != NULL;
+    }
+
+    lay->size = lay->width * lay->height * lay->depth;
+
+
+    /*
+     * Create buffers, the ones viewed by the inputs
+     * are owned by the layer
+     */
+    merge->views = lay->type == LAYER_CONCAT && can_view (lay);
+
+    if (merge->views) {
+        lay->flags &= ~LAYER_FLAG_SHARED;
+    }
+
+    layer_create_value (lay);
+
+    if (gradient) {
+        layer_create_buffer (lay, &lay->gradient_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+    }
+
+    if (merge->views) {
+        make_views (lay);
+        lay->flags |= LAYER_FLAG_COMPILED;
+        return;
+    }
+
+
+    /*
+     * Build CL program
+     */
+    context_program_clear (ctx);
+    context_program_option (ctx, "-DPOSITIONS=%d", lay->width * lay->height);
+    context_program_option (ctx, "-DDEPTH=%d", lay->depth);
+    context_program_option (ctx, "-DBATCH=%d", lay->batch);
+    context_program_option (ctx, lay->type == LAYER_CONCAT
+                            ? "-DCONCAT" : "-DADD");
+    context_program_file (ctx, "merge-layer.cl");
+    context_program_build (ctx, &merge->program);
+
+    merge->forward = g_new0 (cl_kernel, lay->prev_list->len);
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        context_program_kernel (ctx, "forward", &merge->forward[i]);
+    }
+
+    if (gradient) {
+        context_program_kernel (ctx, "backward", &merge->backward);
+    }
+
+
+    /*
+     * Mark compiled
+     */
+    lay->flags |= LAYER_FLAG_COMPILED;
+}
+
+/*
+ * Inputs may write into views of the concatenated buffers if each
+ * of them is a contiguous part, it's when there's a single row of
+ * values, and if the views are aligned for the device. They also
+ * mustn't feed other layers and must own their buffers
+ */
+static gboolean
+can_view (struct layer *lay)
+{
+    struct layer *prev;
+    size_t offset;
+    guint i;
+
+    if (lay->batch * lay->width * lay->height != 1) {
+        return FALSE;
+    }
+
+    offset = 0;
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        prev = g_ptr_array_index (lay->prev_list, i);
+
+        if (prev->type != LAYER_DENSE
+            && prev->type != LAYER_CONV
+            && prev->type != LAYER_POOL
+            && prev->type != LAYER_ADD) {
+            return FALSE;
+        }
+
+        if (prev->next_list->len != 1
+            || (prev->flags & LAYER_FLAG_VIEW)
+            || offset % lay->net->ctx->mem_align != 0) {
+            return FALSE;
+        }
+
+        offset += prev->size * sizeof (cl_float);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Replaces inputs' value and gradient buffers by views of the
+ * layer's ones, inputs are compiled but they haven't run yet
+ */
+static void
+make_views (struct layer *lay)
+{
+    cl_buffer_region region;
+    struct layer *prev;
+    cl_int err;
+    guint i;
+
+    region.origin = 0;
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        prev = g_ptr_array_index (lay->prev_list, i);
+        region.size = prev->size * sizeof (cl_float);
+
+        g_clear_pointer (&prev->value_mem, clReleaseMemObject);
+        prev->value_mem = clCreateSubBuffer (lay->value_mem,
+                                             CL_MEM_READ_WRITE,
+                                             CL_BUFFER_CREATE_TYPE_REGION,
+                                             &region, &err);
+        g_assert (err == CL_SUCCESS);
+
+        if (prev->gradient_mem != NULL) {
+            clReleaseMemObject (prev->gradient_mem);
+            prev->gradient_mem =
+                clCreateSubBuffer (lay->gradient_mem,
+                                   CL_MEM_READ_WRITE,
+                                   CL_BUFFER_CREATE_TYPE_REGION,
+                                   &region, &err);
+            g_assert (err == CL_SUCCESS);
+        }
+
+        prev->flags |= LAYER_FLAG_VIEW;
+        prev->flags &= ~LAYER_FLAG_SHARED;
+        region.origin += region.size;
+    }
+}
+
+static void
+forward (struct layer *lay)
+{
+    struct merge_layer *merge;
+    struct layer *prev;
+    cl_event *evlist, dep[2];
+    cl_kernel kern;
+    cl_int evcount, depcount, first;
+    int offset;
+    guint i;
+
+    g_assert (lay->type == LAYER_CONCAT || lay->type == LAYER_ADD);
+    merge = (struct merge_layer *) lay;
+    evlist = g_new (cl_event, lay->prev_list->len);
+    evcount = 0;
+    offset = 0;
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        prev = g_ptr_array_index (lay->prev_list, i);
+
+        /*
+         * Views are already in place
+         */
+        if (merge->views) {
+            if (prev->forward_barrier != NULL) {
+                evlist[evcount++] = prev->forward_barrier;
+                clRetainEvent (prev->forward_barrier);
+            }
+
+            continue;
+        }
+
+        depcount = 0;
+        kern = merge->forward[i];
+
+        if (prev->forward_barrier != NULL) {
+            dep[depcount++] = prev->forward_barrier;
+        }
+
+        layer_set_value_arg (prev, kern, 0);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->value_mem);
+
+        if (lay->type == LAYER_CONCAT) {
+            clSetKernelArg (kern, 2, sizeof (cl_int), &prev->depth);
+            clSetKernelArg (kern, 3, sizeof (cl_int), &offset);
+            offset += prev->depth;
+
+            context_run_sparse (lay->net->ctx, kern,
+                                lay->batch * prev->size,
+                                depcount, dep,
+                                &evlist[evcount++]);
+        } else {
+            /*
+             * Sums go one after another
+             */
+            first = i == 0;
+
+            if (evcount > 0) {
+                dep[depcount++] = evlist[evcount - 1];
+            }
+
+            clSetKernelArg (kern, 2, sizeof (cl_int), &first);
+
+            context_run_sparse (lay->net->ctx, kern,
+                                lay->batch * lay->size,
+                                depcount, dep,
+                                &evlist[evcount++]);
+        }
+    }
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+    if (evcount > 0) {
+        context_mark (lay->net->ctx, evcount, evlist,
+                      &lay->forward_barrier);
+    }
+
+    while (evcount > 0) {
+        clReleaseEvent (evlist[--evcount]);
+    }
+
+    g_free (evlist);
+}
+
+static void
+backward (struct layer *lay)
+{
+    struct merge_layer *merge;
+    struct layer *prev;
+    cl_event *evlist, gradient, dep[2], ev;
+    cl_kernel kern;
+    cl_int evcount, depcount;
+    int offset;
+    guint i;
+
+    g_assert (lay->type == LAYER_CONCAT || lay->type == LAYER_ADD);
+    merge = (struct merge_layer *) lay;
+    kern = merge->backward;
+    gradient = layer_next_gradient (lay);
+    evlist = g_new (cl_event, lay->prev_list->len);
+    evcount = 0;
+    offset = 0;
+
+    for (i = 0; i < lay->prev_list->len; i++) {
+        prev = g_ptr_array_index (lay->prev_list, i);
+
+        if (prev->gradient_mem == NULL) {
+            offset += prev->depth;
+            continue;
+        }
+
+        /*
+         * Views hold the gradients already
+         */
+        if (merge->views) {
+            if (gradient != NULL) {
+                layer_gradient_written (prev, gradient);
+            }
+
+            continue;
+        }
+
+        depcount = 0;
+
+        if (gradient != NULL) {
+            dep[depcount++] = gradient;
+        }
+
+        if (prev->gradient_barrier != NULL) {
+            dep[depcount++] = prev->gradient_barrier;
+        }
+
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &lay->gradient_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &prev->gradient_mem);
+
+        if (lay->type == LAYER_CONCAT) {
+            clSetKernelArg (kern, 2, sizeof (cl_int), &prev->depth);
+            clSetKernelArg (kern, 3, sizeof (cl_int), &offset);
+            offset += prev->depth;
+        }
+
+        context_run_sparse (lay->net->ctx, kern,
+                            lay->batch * prev->size,
+                            depcount, dep,
+                            &ev);
+
+        layer_gradient_written (prev, ev);
+        evlist[evcount++] = ev;
+    }
+
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+
+    if (evcount > 0) {
+        clEnqueueMarkerWithWaitList (lay->net->ctx->queue,
+                                     evcount, evlist,
+                                     &lay->backward_barrier);
+    } else if (gradient != NULL) {
+        lay->backward_barrier = gradient;
+        clRetainEvent (gradient);
+    }
+
+    while (evcount > 0) {
+        clReleaseEvent (evlist[--evcount]);
+    }
+
+    g_free (evlist);
+}
+
+static void
+release (struct layer *lay)
+{
+    struct merge_layer *merge;
+    guint i;
+
+    g_assert (lay->type == LAYER_CONCAT || lay->type == LAYER_ADD);
+    merge = (struct merge_layer *) lay;
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+
+    if (merge->forward != NULL) {
+        for (i = 0; i < lay->prev_list->len; i++) {
+            clReleaseKernel (merge->forward[i]);
+        }
+
+        g_clear_pointer (&merge->forward, g_free);
+    }
+    g_clear_pointer (&merge->backward, clReleaseKernel);
+
+    if (merge->program != NULL) {
+        context_program_release (lay->net->ctx, merge->program);
+    }
+
+    g_clear_pointer (&lay->value_mem, clReleaseMemObject);
+    g_clear_pointer (&lay->gradient_mem, clReleaseMemObject);
+}
@@ -0,0 +1,114 @@
+/*
+ * merge-layer.cl
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Values are stored as (y, x, z) volumes, samples of the batch one
+ * after another, so BATCH * POSITIONS rows of DEPTH values. Kernels
+ * run over a single input at once, one work-item per input value
+ */
+#define SIZE (POSITIONS * DEPTH)
+
+#ifdef CONCAT
+/*
+ * Copies input's channels to their place of the output rows
+ */
+__kernel void forward (__global const float *input_v,
+                       __global float *value_v,
+                       const int input_depth,
+                       const int offset)
+{
+    __private int id, row, z;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * POSITIONS * input_depth) {
+        return;
+    }
+
+    row = id / input_depth;
+    z = id % input_depth;
+
+    value_v[row * DEPTH + offset + z] = input_v[id];
+}
+
+/*
+ * Adds gradients of input's channels to the input's ones
+ */
+__kernel void backward (__global const float *gradient_v,
+                        __global float *input_gradient_v,
+                        const int input_depth,
+                        const int offset)
+{
+    __private int id, row, z;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * POSITIONS * input_depth) {
+        return;
+    }
+
+    row = id / input_depth;
+    z = id % input_depth;
+
+    input_gradient_v[id] += gradient_v[row * DEPTH + offset + z];
+}
+#endif
+
+#ifdef ADD
+/*
+ * Adds input values to the output, the first input sets it
+ */
+__kernel void forward (__global const float *input_v,
+                       __global float *value_v,
+                       const int first)
+{
+    __private int id;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * SIZE) {
+        return;
+    }
+
+    if (first) {
+        value_v[id] = input_v[id];
+    } else {
+        value_v[id] += input_v[id];
+    }
+}
+
+/*
+ * Gradients of a sum are passed to all inputs as they are
+ */
+__kernel void backward (__global const float *gradient_v,
+                        __global float *input_gradient_v)
+{
+    __private int id;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * SIZE) {
+        return;
+    }
+
+    input_gradient_v[id] += gradient_v[id];
+}
+#endif
@@ -22,8 +22,46 @@
 #include "network.h"
 #include "layer.h"
 #include "context.h"
+#include "plan.h"
 
 #include <math.h>
+#include <string.h>
+
+/*
+ * Number of backward steps whose loss is kept on the device,
+ * steps not fetched before their row is reused are dropped
+ */
+#define LOSS_RING 64
+
+/*
+ * Layer buffer compared by network_validate
+ */
+struct state_buffer
+{
+    struct layer *lay;
+    const char *name;
+    cl_mem mem;
+    cl_mem backup;
+    size_t size;
+    guint8 *ordered;
+};
+
+/*
+ * Buffer shared by values of layers of inference networks, it's
+ * free for the next layer once all readers of the current one are
+ * its ancestors, so they have completed before it runs
+ */
+struct arena
+{
+    size_t size;
+    GPtrArray *layers;
+    GPtrArray *readers;
+};
+
+static void wait_loss (struct network *net);
+static void CL_CALLBACK loss_read (cl_event event,
+                                   cl_int status,
+                                   void *data);
 
 struct network *
 network_create (struct context *ctx)
@@ -35,7 +73,11 @@ network_create (struct context *ctx)
     net->layers = g_ptr_array_new_with_free_func ((GDestroyNotify)
                                                   layer_free);
     net->flags = NETWORK_FLAG_BACKPROP;
+    net->batch = 1;
     net->loss = 0;
+    net->average_loss = -1;
+    net->loss_interval = 16;
+    net->outputs = g_ptr_array_new ();
     net->rate = 0.5f;
     net->momentum = 0.9f;
     net->decay = 1.0f;
@@ -43,6 +85,9 @@ network_create (struct context *ctx)
     /* manually add itself to the context */
     ctx->netlist = g_slist_prepend (ctx->netlist, net);
 
+    g_mutex_init (&net->loss_mutex);
+    g_cond_init (&net->loss_cond);
+
     return net;
 }
 
@@ -52,7 +97,28 @@ network_free (struct network *net)
     /* manually remove itself from the context */
     net->ctx->netlist = g_slist_remove (net->ctx->netlist, net);
 
+    /*
+     * Wait for the pending loss read callback
+     */
+    wait_loss (net);
+
+    g_clear_pointer (&net->plan, plan_free);
     g_ptr_array_unref (net->layers);
+    g_ptr_array_unref (net->outputs);
+    g_clear_pointer (&net->total_kern, clReleaseKernel);
+    g_clear_pointer (&net->total_event, clReleaseEvent);
+    g_clear_pointer (&net->loss_event, clReleaseEvent);
+    g_clear_pointer (&net->loss_mem, clReleaseMemObject);
+    g_free (net->loss_host);
+
+    if (net->loss_program != NULL) {
+        context_program_release (net->ctx, net->loss_program);
+    }
+    g_clear_pointer (&net->scratch_mem, clReleaseMemObject);
+    g_clear_pointer (&net->scratch_event, clReleaseEvent);
+
+    g_mutex_clear (&net->loss_mutex);
+    g_cond_clear (&net->loss_cond);
 }
 
 struct layer *
@@ -69,36 +135,914 @@ network_layer (struct network *net, int index)
     return g_ptr_array_index (net->layers, index);
 }
 
+struct layer *
+network_layer_last (struct network *net)
+{
+    return network_layer (net, -1);
+}
+
 int
 network_layer_count (struct network *net)
 {
     return net->layers->len;
 }
 
+void
+network_push_layer (struct network *net,
+                    struct layer *lay)
+{
+    g_assert (lay->net == net);
+
+    if (net->layers->len > 0) {
+        layer_append (network_layer_last (net), lay);
+    }
+
+    g_ptr_array_add (net->layers, lay);
+}
+
+void
+network_add_layer (struct network *net,
+                   struct layer *lay)
+{
+    g_assert (lay->net == net);
+
+    g_ptr_array_add (net->layers, lay);
+}
+
+void
+network_reserve_scratch (struct network *net, int size)
+{
+    if (size > net->scratch_size) {
+        net->scratch_size = size;
+
+        /* commands already enqueued keep the old buffer alive */
+        g_clear_pointer (&net->scratch_mem, clReleaseMemObject);
+    }
+}
+
+cl_mem
+network_scratch (struct network *net)
+{
+    cl_int err;
+
+    g_assert (net->scratch_size > 0);
+
+    if (net->scratch_mem == NULL) {
+        net->scratch_mem = clCreateBuffer (net->ctx->context,
+                                           CL_MEM_READ_WRITE,
+                                           net->scratch_size
+                                           * sizeof (cl_float),
+                                           NULL, &err);
+        g_assert (err == CL_SUCCESS);
+    }
+
+    return net->scratch_mem;
+}
+
+cl_int
+network_scratch_wait_list (struct network *net,
+                           cl_event dep,
+                           cl_event *evlist)
+{
+    cl_int evcount;
+
+    evcount = 0;
+
+    if (dep != NULL) {
+        evlist[evcount++] = dep;
+    }
+
+    if (net->scratch_event != NULL) {
+        evlist[evcount++] = net->scratch_event;
+    }
+
+    return evcount;
+}
+
+void
+network_scratch_release (struct network *net,
+                         cl_event ev)
+{
+    if (ev != NULL) {
+        clRetainEvent (ev);
+    }
+
+    g_clear_pointer (&net->scratch_event, clReleaseEvent);
+    net->scratch_event = ev;
+}
+
+cl_command_queue
+network_upload_queue (struct network *net)
+{
+    if (net->flags & NETWORK_FLAG_TRANSFER_QUEUE) {
+        return context_transfer_queue (net->ctx);
+    }
+
+    return net->ctx->queue;
+}
+
+int
+network_loss_slot (struct network *net,
+                   struct layer *lay)
+{
+    gboolean found;
+    guint index;
+
+    found = g_ptr_array_find (net->outputs, lay, &index);
+    g_assert (found);
+
+    return (net->loss_step % LOSS_RING) * net->loss_stride
+        + (net->loss_stride > 1 ? 1 + index : 0);
+}
+
+void
+network_fetch_loss (struct network *net)
+{
+    gboolean reading;
+    cl_int err;
+
+    if (net->loss_mem == NULL) {
+        return;
+    }
+
+    g_mutex_lock (&net->loss_mutex);
+    reading = net->loss_reading;
+    g_mutex_unlock (&net->loss_mutex);
+
+    if (reading || net->loss_step == net->loss_fetched) {
+        return;
+    }
+
+    net->loss_read_first = MAX (net->loss_fetched,
+                                net->loss_step - LOSS_RING);
+    net->loss_read_last = net->loss_step;
+    net->loss_fetched = net->loss_step;
+    net->loss_reading = TRUE;
+
+    /*
+     * Whole ring is read at once, the callback picks up
+     * only the rows of fetched steps
+     */
+    g_clear_pointer (&net->loss_event, clReleaseEvent);
+    err = clEnqueueReadBuffer (net->ctx->queue,
+                               net->loss_mem,
+                               CL_FALSE,
+                               0, LOSS_RING * net->loss_stride
+                               * sizeof (cl_float),
+                               net->loss_host,
+                               1, &net->total_event,
+                               &net->loss_event);
+    g_assert (err == CL_SUCCESS);
+
+    err = clSetEventCallback (net->loss_event, CL_COMPLETE,
+                              loss_read, net);
+    g_assert (err == CL_SUCCESS);
+
+    /*
+     * Read has to reach the device, wait_loss may block
+     * on its callback without finishing the queue
+     */
+    clFlush (net->ctx->queue);
+}
+
+/*
+ * Blocks until the pending loss read, if any, is folded
+ * into the network's loss
+ */
+static void
+wait_loss (struct network *net)
+{
+    g_mutex_lock (&net->loss_mutex);
+
+    while (net->loss_reading) {
+        g_cond_wait (&net->loss_cond, &net->loss_mutex);
+    }
+
+    g_mutex_unlock (&net->loss_mutex);
+}
+
+static void CL_CALLBACK
+loss_read (cl_event event G_GNUC_UNUSED,
+           cl_int status,
+           void *data)
+{
+    struct network *net;
+    struct layer *lay;
+    const float *row;
+    int step;
+    guint i;
+
+    net = data;
+
+    g_mutex_lock (&net->loss_mutex);
+
+    /*
+     * Fold fetched steps into the running average, each step
+     * once however many outputs the network has
+     */
+    for (step = net->loss_read_first;
+         step < net->loss_read_last && status == CL_COMPLETE; step++) {
+        row = net->loss_host + (step % LOSS_RING) * net->loss_stride;
+
+        if (net->average_loss < 0) {
+            net->average_loss = row[0];
+        } else {
+            net->average_loss *= 0.99f;
+            net->average_loss += row[0] * 0.01f;
+        }
+
+        for (i = 0; i < net->outputs->len; i++) {
+            lay = g_ptr_array_index (net->outputs, i);
+            lay->loss = row[net->loss_stride > 1 ? 1 + i : 0];
+        }
+
+        net->loss = row[0];
+    }
+
+    net->loss_serial++;
+    net->loss_reading = FALSE;
+
+    g_cond_broadcast (&net->loss_cond);
+    g_mutex_unlock (&net->loss_mutex);
+}
+
+guint
+network_loss (struct network *net,
+              float *loss,
+              float *average)
+{
+    guint serial;
+
+    g_mutex_lock (&net->loss_mutex);
+
+    if (loss != NULL) {
+        *loss = net->loss;
+    }
+
+    if (average != NULL) {
+        *average = net->average_loss;
+    }
+
+    serial = net->loss_serial;
+
+    g_mutex_unlock (&net->loss_mutex);
+
+    return serial;
+}
+
+/*
+ * Adds the layer to the order after all its previous layers,
+ * the table maps layers being visited to FALSE and visited ones
+ * to TRUE
+ */
+static void
+visit_layer (GPtrArray *order,
+             GHashTable *visited,
+             struct layer *lay)
+{
+    gpointer state;
+    guint i;
+
+    if (g_hash_table_lookup_extended (visited, lay, NULL, &state)) {
+        /* layer being visited is its own predecessor */
+        g_assert (GPOINTER_TO_INT (state));
+        return;
+    }
+
+    g_hash_table_insert (visited, lay, GINT_TO_POINTER (FALSE));
+
+    for (i = 0; lay->prev_list != NULL && i < lay->prev_list->len; i++) {
+        visit_layer (order, visited, g_ptr_array_index (lay->prev_list, i));
+    }
+
+    g_hash_table_insert (visited, lay, GINT_TO_POINTER (TRUE));
+    g_ptr_array_add (order, lay);
+}
+
+/*
+ * Gives layers in topological order, a layer comes after
+ * all the ones it reads values from
+ */
+static GPtrArray *
+sorted_layers (struct network *net)
+{
+    g_autoptr (GHashTable) visited = NULL;
+    GPtrArray *order;
+    guint i;
+
+    order = g_ptr_array_sized_new (net->layers->len);
+    visited = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < net->layers->len; i++) {
+        visit_layer (order, visited, g_ptr_array_index (net->layers, i));
+    }
+
+    g_assert (order->len == net->layers->len);
+
+    return order;
+}
+
+/*
+ * Values which may live in an arena, the ones owned by the layer
+ * and not read once the step is done. Values of layers with no
+ * next ones and of the ones feeding output layers are results.
+ * It's decided before compiling, concatenations turning their
+ * inputs into views drop the flag then
+ */
+static gboolean
+can_share (struct layer *lay)
+{
+    struct layer *other;
+    guint i;
+
+    if (lay->type != LAYER_DENSE
+        && lay->type != LAYER_CONV
+        && lay->type != LAYER_POOL
+        && lay->type != LAYER_CONCAT
+        && lay->type != LAYER_ADD) {
+        return FALSE;
+    }
+
+    if ((lay->flags & LAYER_FLAG_VIEW) || lay->next_list == NULL
+        || lay->next_list->len == 0) {
+        return FALSE;
+    }
+
+    for (i = 0; i < lay->next_list->len; i++) {
+        other = g_ptr_array_index (lay->next_list, i);
+
+        if (other->type == LAYER_OUTPUT) {
+            return FALSE;
+        }
+    }
+
+    /* views of the layer's buffer are inputs' values */
+    for (i = 0; lay->prev_list != NULL && i < lay->prev_list->len; i++) {
+        other = g_ptr_array_index (lay->prev_list, i);
+
+        if (other->flags & LAYER_FLAG_VIEW) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Maps each layer to the set of layers it depends on, the layers
+ * are in topological order
+ */
+static GHashTable *
+find_ancestors (GPtrArray *order)
+{
+    GHashTable *ancestors, *set, *prevset;
+    GHashTableIter iter;
+    struct layer *lay, *prev;
+    gpointer key;
+    guint i, p;
+
+    ancestors = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                       NULL, (GDestroyNotify)
+                                       g_hash_table_unref);
+
+    for (i = 0; i < order->len; i++) {
+        lay = g_ptr_array_index (order, i);
+        set = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        for (p = 0; lay->prev_list != NULL && p < lay->prev_list->len; p++) {
+            prev = g_ptr_array_index (lay->prev_list, p);
+            prevset = g_hash_table_lookup (ancestors, prev);
+
+            g_hash_table_add (set, prev);
+            g_hash_table_iter_init (&iter, prevset);
+
+            while (g_hash_table_iter_next (&iter, &key, NULL)) {
+                g_hash_table_add (set, key);
+            }
+        }
+
+        g_hash_table_insert (ancestors, lay, set);
+    }
+
+    return ancestors;
+}
+
+static gboolean
+arena_free (struct arena *arena,
+            GHashTable *ancestors)
+{
+    guint i;
+
+    for (i = 0; i < arena->readers->len; i++) {
+        if (!g_hash_table_contains (ancestors,
+                                    g_ptr_array_index (arena->readers,
+                                                       i))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/*
+ * Gives values of shared layers arena buffers. Layers take free
+ * arenas in topological order, the smallest one holding the values
+ * or the largest one otherwise, so chains of layers ping-pong
+ * between two of them. Shared layers don't create buffers of their
+ * own, so only the arenas are allocated
+ */
+static void
+share_values (struct network *net,
+              GPtrArray *order)
+{
+    g_autoptr (GHashTable) ancestors = NULL;
+    g_autoptr (GArray) arenas = NULL;
+    struct arena *arena, *best;
+    struct layer *lay;
+    size_t size;
+    cl_mem mem;
+    guint i, a, l;
+
+    ancestors = find_ancestors (order);
+    arenas = g_array_new (FALSE, FALSE, sizeof (struct arena));
+
+    for (i = 0; i < order->len; i++) {
+        lay = g_ptr_array_index (order, i);
+
+        if ((lay->flags & LAYER_FLAG_SHARED) == 0) {
+            continue;
+        }
+
+        size = lay->batch * lay->size * sizeof (cl_float);
+        best = NULL;
+
+        for (a = 0; a < arenas->len; a++) {
+            arena = &g_array_index (arenas, struct arena, a);
+
+            if (!arena_free (arena, g_hash_table_lookup (ancestors, lay))) {
+                continue;
+            }
+
+            if (best == NULL
+                || (best->size < size && arena->size > best->size)
+                || (arena->size >= size && arena->size < best->size)) {
+                best = arena;
+            }
+        }
+
+        if (best == NULL) {
+            g_array_set_size (arenas, arenas->len + 1);
+            best = &g_array_index (arenas, struct arena, arenas->len - 1);
+            best->layers = g_ptr_array_new ();
+            best->readers = g_ptr_array_new ();
+        }
+
+        best->size = MAX (best->size, size);
+        g_ptr_array_add (best->layers, lay);
+        g_ptr_array_set_size (best->readers, 0);
+
+        for (l = 0; l < lay->next_list->len; l++) {
+            g_ptr_array_add (best->readers,
+                             g_ptr_array_index (lay->next_list, l));
+        }
+    }
+
+    for (a = 0; a < arenas->len; a++) {
+        arena = &g_array_index (arenas, struct arena, a);
+
+        layer_create_buffer (g_ptr_array_index (arena->layers, 0),
+                             &mem, arena->size / sizeof (cl_float),
+                             CL_MEM_READ_WRITE);
+
+        for (l = 0; l < arena->layers->len; l++) {
+            lay = g_ptr_array_index (arena->layers, l);
+
+            g_assert (lay->value_mem == NULL);
+            lay->value_mem = mem;
+            clRetainMemObject (mem);
+        }
+
+        clReleaseMemObject (mem);
+
+        g_ptr_array_unref (arena->layers);
+        g_ptr_array_unref (arena->readers);
+    }
+}
+
+/*
+ * Makes the loss ring of output layers, with more than one
+ * of them their total is summed by a kernel
+ */
+static void
+compile_loss (struct network *net,
+              GPtrArray *order)
+{
+    struct context *ctx;
+    struct layer *lay;
+    guint i;
+
+    ctx = net->ctx;
+
+    wait_loss (net);
+
+    g_ptr_array_set_size (net->outputs, 0);
+    g_clear_pointer (&net->total_kern, clReleaseKernel);
+    g_clear_pointer (&net->total_event, clReleaseEvent);
+    g_clear_pointer (&net->loss_event, clReleaseEvent);
+    g_clear_pointer (&net->loss_mem, clReleaseMemObject);
+    g_clear_pointer (&net->loss_host, g_free);
+
+    if (net->loss_program != NULL) {
+        context_program_release (ctx, net->loss_program);
+        net->loss_program = NULL;
+    }
+
+    for (i = 0; i < order->len; i++) {
+        lay = g_ptr_array_index (order, i);
+
+        if (lay->type == LAYER_OUTPUT) {
+            g_ptr_array_add (net->outputs, lay);
+        }
+    }
+
+    if (net->outputs->len == 0) {
+        return;
+    }
+
+    net->loss_stride = net->outputs->len > 1 ? net->outputs->len + 1 : 1;
+    net->loss_step = 0;
+    net->loss_fetched = 0;
+    net->loss_host = g_new0 (cl_float, LOSS_RING * net->loss_stride);
+
+    layer_create_buffer (g_ptr_array_index (net->outputs, 0),
+                         &net->loss_mem, LOSS_RING * net->loss_stride,
+                         CL_MEM_READ_WRITE);
+
+    if (net->loss_stride > 1) {
+        context_program_clear (ctx);
+        context_program_file (ctx, "network.cl");
+        context_program_option (ctx, "-DOUTPUTS=%d", net->outputs->len);
+        context_program_build (ctx, &net->loss_program);
+        context_program_kernel (ctx, "loss_total", &net->total_kern);
+    }
+}
+
+/*
+ * Finishes loss of the backward step, it's summed over the
+ * output layers on the device and fetched every $loss_interval
+ * steps
+ */
+static void
+total_loss (struct network *net)
+{
+    g_autofree cl_event *evlist = NULL;
+    struct layer *lay;
+    size_t globsiz;
+    cl_int evcount, row;
+    guint i;
+
+    g_clear_pointer (&net->total_event, clReleaseEvent);
+
+    if (net->loss_stride == 1) {
+        lay = g_ptr_array_index (net->outputs, 0);
+        net->total_event = lay->backward_barrier;
+        clRetainEvent (net->total_event);
+    } else {
+        evlist = g_new (cl_event, net->outputs->len);
+        evcount = 0;
+
+        for (i = 0; i < net->outputs->len; i++) {
+            lay = g_ptr_array_index (net->outputs, i);
+
+            if (lay->backward_barrier != NULL) {
+                evlist[evcount++] = lay->backward_barrier;
+            }
+        }
+
+        row = net->loss_step % LOSS_RING;
+        clSetKernelArg (net->total_kern, 0, sizeof (cl_mem),
+                        &net->loss_mem);
+        clSetKernelArg (net->total_kern, 1, sizeof (cl_int), &row);
+
+        globsiz = 1;
+        context_run_kernel (net->ctx, net->total_kern, 1,
+                            &globsiz, NULL,
+                            evcount, evlist,
+                            &net->total_event);
+    }
+
+    /*
+     * Loss stays on the device until it's fetched
+     */
+    net->loss_step++;
+
+    if (net->loss_interval > 0
+        && net->loss_step - net->loss_fetched >= net->loss_interval) {
+        network_fetch_loss (net);
+    }
+}
+
+void
+network_compile (struct network *net)
+{
+    g_autoptr (GPtrArray) order = NULL;
+    struct build *build;
+    struct layer *lay;
+    guint i;
+
+    /*
+     * Layers take their shapes from the previous ones
+     */
+    order = sorted_layers (net);
+
+    /*
+     * Shared values of inference networks are planned
+     * before layers would create their own buffers
+     */
+    for (i = 0; i < order->len; i++) {
+        lay = g_ptr_array_index (order, i);
+        lay->flags &= ~LAYER_FLAG_SHARED;
+
+        if ((net->flags & NETWORK_FLAG_BACKPROP) == 0 && can_share (lay)) {
+            lay->flags |= LAYER_FLAG_SHARED;
+        }
+    }
+
+    build = context_build_begin (net->ctx);
+
+    for (i = 0; i < order->len; i++) {
+        layer_compile (g_ptr_array_index (order, i));
+    }
+
+    compile_loss (net, order);
+
+    context_build_end (net->ctx, build);
+
+    /*
+     * Steps of inference networks are all the same, so they're
+     * recorded once and replayed
+     */
+    g_clear_pointer (&net->plan, plan_free);
+
+    if ((net->flags & NETWORK_FLAG_BACKPROP) == 0) {
+        share_values (net, order);
+        net->plan = plan_create (net);
+    }
+}
+
+void
+network_forward (struct network *net)
+{
+    g_autoptr (GPtrArray) order = NULL;
+    g_autoptr (GPtrArray) recorded = NULL;
+    struct layer *lay;
+    guint i;
+
+    order = sorted_layers (net);
+
+    /*
+     * Layers wait only for the events of this step, so with an
+     * out-of-order queue nothing else keeps them from reading
+     * weights still being updated by the previous one
+     */
+    if (context_out_of_order (net->ctx)) {
+        clEnqueueBarrierWithWaitList (net->ctx->queue, 0, NULL, NULL);
+    }
+
+    if (net->plan == NULL) {
+        for (i = 0; i < order->len; i++) {
+            layer_forward (g_ptr_array_index (order, i));
+        }
+
+        return;
+    }
+
+    /*
+     * Live layers go first, the rest is replayed or recorded again
+     * unless it can't be recorded at all. The first step isn't
+     * recorded either, as layers run their one-time setup in it,
+     * like transforming Winograd filters
+     */
+    for (i = 0; i < net->plan->live->len; i++) {
+        layer_forward (g_ptr_array_index (net->plan->live, i));
+    }
+
+    if (net->plan->failed || !net->plan->warm) {
+        for (i = 0; i < order->len; i++) {
+            lay = g_ptr_array_index (order, i);
+
+            if (lay->type != LAYER_INPUT) {
+                layer_forward (lay);
+            }
+        }
+
+        net->plan->warm = TRUE;
+
+        return;
+    }
+
+    if (plan_replay (net->plan)) {
+        return;
+    }
+
+    recorded = g_ptr_array_sized_new (order->len);
+    plan_record_begin (net->plan);
+
+    for (i = 0; i < order->len; i++) {
+        lay = g_ptr_array_index (order, i);
+
+        if (lay->type != LAYER_INPUT) {
+            layer_forward (lay);
+            g_ptr_array_add (recorded, lay);
+        }
+    }
+
+    plan_record_end (net->plan, recorded);
+}
+
 void
 network_backward (struct network *net)
 {
-    /* struct layer *lay; */
-    /* int i, count; */
-    /*  */
-    /* count = network_layer_count (net); */
-    /*  */
-    /* for (i = 0; i < count; i++) { */
-    /*     lay = network_layer (net, i); */
-    /*     layer_clear_gradient (lay); */
-    /* } */
-    /*  */
-    /* for (i = count; i > 0; i--) { */
-    /*     lay = network_layer (net, i - 1); */
-    /*     layer_backward (lay); */
-    /* } */
-    /*  */
-    /* net->loss = 0; */
-    /*  */
-    /* for (i = 0; i < count; i++) { */
-    /*     lay = network_layer (net, i - 1); */
-    /*     net->loss += lay->loss; */
-    /* } */
-    /*  */
-    /* net->loss = logf (net->loss + 1); */
+    g_autoptr (GPtrArray) order = NULL;
+    guint i;
+
+    order = sorted_layers (net);
+
+    /*
+     * Gradients are accumulated by the layers in front, so they're
+     * cleared first. Layers' tasks wait only for barriers of the
+     * layers they exchange data with, so the queue may run
+     * independent ones concurrently
+     */
+    for (i = 0; i < order->len; i++) {
+        layer_clear_gradient (g_ptr_array_index (order, i));
+    }
+
+    for (i = order->len; i > 0; i--) {
+        layer_backward (g_ptr_array_index (order, i - 1));
+    }
+
+    if (net->loss_mem != NULL) {
+        total_loss (net);
+    }
+}
+
+static void
+add_state_buffer (GArray *state,
+                  struct layer *lay,
+                  const char *name,
+                  cl_mem mem)
+{
+    struct state_buffer buf = { 0 };
+    cl_int err;
+
+    if (mem == NULL) {
+        return;
+    }
+
+    buf.lay = lay;
+    buf.name = name;
+    buf.mem = mem;
+
+    err = clGetMemObjectInfo (mem, CL_MEM_SIZE,
+                              sizeof (buf.size), &buf.size, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    buf.backup = clCreateBuffer (lay->net->ctx->context,
+                                 CL_MEM_READ_WRITE,
+                                 buf.size, NULL, &err);
+    g_assert (err == CL_SUCCESS);
+
+    err = clEnqueueCopyBuffer (lay->net->ctx->queue,
+                               buf.mem, buf.backup,
+                               0, 0, buf.size,
+                               0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    g_array_append_val (state, buf);
+}
+
+/*
+ * Copies buffers of all layers aside, the queue is
+ * finished before it's used again
+ */
+static GArray *
+save_state (struct network *net)
+{
+    struct layer *lay;
+    GArray *state;
+    guint i;
+
+    state = g_array_new (FALSE, FALSE, sizeof (struct state_buffer));
+
+    for (i = 0; i < net->layers->len; i++) {
+        lay = g_ptr_array_index (net->layers, i);
+
+        add_state_buffer (state, lay, "value", lay->value_mem);
+        add_state_buffer (state, lay, "derivative", lay->derivative_mem);
+        add_state_buffer (state, lay, "gradient", lay->gradient_mem);
+        add_state_buffer (state, lay, "bias", lay->bias_mem);
+        add_state_buffer (state, lay, "bias delta", lay->bias_delta_mem);
+        add_state_buffer (state, lay, "weight", lay->weight_mem);
+        add_state_buffer (state, lay, "delta", lay->delta_mem);
+    }
+
+    return state;
+}
+
+/*
+ * Waits for the queue and the pending loss reads, so no
+ * callback runs while the buffers are being swapped
+ */
+static void
+finish_step (struct network *net)
+{
+    clFinish (net->ctx->queue);
+    wait_loss (net);
+}
+
+gboolean
+network_validate (struct network *net)
+{
+    struct state_buffer *buf;
+    gboolean unordered, equal;
+    guint8 *result;
+    GArray *state;
+    cl_int err;
+    guint i;
+
+    unordered = context_out_of_order (net->ctx);
+
+    /*
+     * There's nothing to compare with, so no step is run
+     */
+    if (!context_set_out_of_order (net->ctx, TRUE)) {
+        return FALSE;
+    }
+
+    context_set_out_of_order (net->ctx, FALSE);
+    finish_step (net);
+    state = save_state (net);
+
+
+    /*
+     * Reference run
+     */
+    network_forward (net);
+    network_backward (net);
+    finish_step (net);
+
+    for (i = 0; i < state->len; i++) {
+        buf = &g_array_index (state, struct state_buffer, i);
+        buf->ordered = g_malloc (buf->size);
+
+        err = clEnqueueReadBuffer (net->ctx->queue, buf->mem, CL_TRUE,
+                                   0, buf->size, buf->ordered,
+                                   0, NULL, NULL);
+        g_assert (err == CL_SUCCESS);
+
+        err = clEnqueueCopyBuffer (net->ctx->queue,
+                                   buf->backup, buf->mem,
+                                   0, 0, buf->size,
+                                   0, NULL, NULL);
+        g_assert (err == CL_SUCCESS);
+    }
+
+
+    /*
+     * Out-of-order run from the same state
+     */
+    context_set_out_of_order (net->ctx, TRUE);
+    network_forward (net);
+    network_backward (net);
+    finish_step (net);
+
+    equal = TRUE;
+
+    for (i = 0; i < state->len; i++) {
+        buf = &g_array_index (state, struct state_buffer, i);
+        result = g_malloc (buf->size);
+
+        err = clEnqueueReadBuffer (net->ctx->queue, buf->mem, CL_TRUE,
+                                   0, buf->size, result,
+                                   0, NULL, NULL);
+        g_assert (err == CL_SUCCESS);
+
+        if (memcmp (result, buf->ordered, buf->size) != 0) {
+            g_warning ("%s buffer of layer %p (type %d) differs "
+                       "from in-order execution",
+                       buf->name, buf->lay, buf->lay->type);
+            equal = FALSE;
+        }
+
+        g_free (result);
+        g_free (buf->ordered);
+        clReleaseMemObject (buf->backup);
+    }
+
+    g_array_unref (state);
+
+    context_set_out_of_order (net->ctx, unordered);
+
+    return equal;
 }
@@ -0,0 +1,40 @@
+/*
+ * network.cl
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sums losses of OUTPUTS output layers into the total at the
+ * beginning of the loss ring's row, they follow it in the row
+ */
+__kernel void loss_total (__global float *loss_v,
+                          int row)
+{
+    __private float sum;
+    __private int index;
+
+    loss_v += row * (OUTPUTS + 1);
+    sum = 0;
+
+    for (index = 1; index <= OUTPUTS; index++) {
+        sum += loss_v[index];
+    }
+
+    loss_v[0] = sum;
+}
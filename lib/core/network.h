@@ -22,11 +22,16 @@
 #pragma once
 
 #include <glib.h>
+#include <CL/cl.h>
 
 #define NETWORK_FLAG_BACKPROP 1
+#define NETWORK_FLAG_TILED 2
+#define NETWORK_FLAG_UNFUSED 4
+#define NETWORK_FLAG_TRANSFER_QUEUE 8
 
 struct layer;
 struct context;
+struct plan;
 
 struct network
 {
@@ -39,13 +44,66 @@ struct network
     /* some flags */
     int flags;
 
-    /* lates error loss */
+    /* number of samples propagated at once */
+    int batch;
+
+    /* lates error loss, summed over all output layers */
     float loss;
 
+    /* running average of the loss, negative until first fetched */
+    float average_loss;
+
+    /*
+     * Loss is accumulated on the device and fetched without
+     * blocking, every $loss_interval backward steps or on demand
+     * if it's 0. Fetched values are guarded by the mutex and
+     * $loss_serial counts the fetches
+     */
+    int loss_interval;
+    guint loss_serial;
+    GMutex loss_mutex;
+    GCond loss_cond;
+
+    /*
+     * Loss ring on the device, a row of $loss_stride values per
+     * backward step. Output layers write their losses after the
+     * row's total, which is summed on the device, the only output
+     * writes the total directly. Steps in range of
+     * [loss_read_first, loss_read_last) are being read into
+     * $loss_host while $loss_reading is set, it's guarded by
+     * the loss mutex
+     */
+    GPtrArray *outputs;
+    int loss_stride;
+    cl_mem loss_mem;
+    cl_program loss_program;
+    cl_kernel total_kern;
+    cl_event total_event;
+    cl_event loss_event;
+    int loss_step;
+    int loss_fetched;
+    int loss_read_first;
+    int loss_read_last;
+    gboolean loss_reading;
+    cl_float *loss_host;
+
     /* learning parameters */
     float rate;
     float momentum;
     float decay;
+
+    /* scratch buffer shared by layers, created on demand */
+    cl_mem scratch_mem;
+    int scratch_size;
+
+    /* event of the lastly enqueued tasks using the scratch buffer */
+    cl_event scratch_event;
+
+    /*
+     * Execution plan of forward steps, made for networks compiled
+     * without backpropagation
+     */
+    struct plan *plan;
 };
 
 /*
@@ -86,20 +144,130 @@ int network_layer_count (struct network *net);
 
 /*
  * network_push_layer:
- * Adds layer to the layer list. After call the layer is
- * owned by the network.
+ * Adds layer to the layer list and appends it to the lastly
+ * added layer. After call the layer is owned by the network.
  * lay: pointer to the layer
  */
 void network_push_layer (struct network *net, struct layer *lay);
 
+/*
+ * network_add_layer:
+ * Adds layer to the layer list without connecting it, layers of
+ * branching graphs are connected with layer_append. After call
+ * the layer is owned by the network.
+ * lay: pointer to the layer
+ */
+void network_add_layer (struct network *net, struct layer *lay);
+
+/*
+ * network_reserve_scratch:
+ * Makes the shared scratch buffer at least $size values long, it's
+ * used by layers for temporary data which doesn't outlive a single
+ * forward or backward call
+ * size: size in number of numeric (float) values
+ */
+void network_reserve_scratch (struct network *net, int size);
+
+/*
+ * network_scratch:
+ * Gives the shared scratch buffer, creates it if needed. Handle
+ * is valid until next network_reserve_scratch call
+ * returns: buffer handle
+ */
+cl_mem network_scratch (struct network *net);
+
+/*
+ * network_scratch_wait_list:
+ * Makes wait list of a task overwriting the scratch buffer, it has
+ * to wait for the previous users of the buffer
+ * dep: (nullable) event the task depends on besides the users
+ * evlist: list of at least 2 events, filled by the call
+ * returns: number of events in the list
+ */
+cl_int network_scratch_wait_list (struct network *net,
+                                  cl_event dep,
+                                  cl_event *evlist);
+
+/*
+ * network_scratch_release:
+ * Sets the event completing the current users of the scratch
+ * buffer, the next task overwriting it waits for it
+ * ev: (nullable) event handle, retained by the call
+ */
+void network_scratch_release (struct network *net,
+                              cl_event ev);
+
+/*
+ * network_upload_queue:
+ * Gives the queue of input and truth uploads, it's the context's
+ * transfer queue if NETWORK_FLAG_TRANSFER_QUEUE is set
+ * returns: queue handle
+ */
+cl_command_queue network_upload_queue (struct network *net);
+
+/*
+ * network_loss_slot:
+ * Gives the element of the loss buffer the output layer writes
+ * its loss of the current backward step to
+ * lay: output layer of the network
+ * returns: index in $loss_mem
+ */
+int network_loss_slot (struct network *net,
+                       struct layer *lay);
+
+/*
+ * network_fetch_loss:
+ * Enqueues non-blocking read of the loss values accumulated on the
+ * device since the last fetch, they are available with network_loss
+ * once the read is completed
+ */
+void network_fetch_loss (struct network *net);
+
+/*
+ * network_loss:
+ * Gives the lastly fetched loss values, doesn't synchronize
+ * with the device
+ * loss: (nullable) loss of the latest fetched step
+ * average: (nullable) running average of the fetched steps
+ * returns: fetch serial number, changes once new values arrive
+ */
+guint network_loss (struct network *net,
+                    float *loss,
+                    float *average);
+
+/*
+ * network_compile
+ * Compiles all layers in topological order, programs of all layers
+ * are built concurrently while buffers are being created and
+ * initialized. Without backpropagation, values of hidden layers
+ * share buffers, so only input and result values stay readable
+ * after a forward step
+ */
+void network_compile (struct network *net);
+
 /*
  * network_forward:
- * Propagates network forward
+ * Propagates network forward, layers go in topological order
  */
 void network_forward (struct network *net);
 
 /*
  * network_backward:
- * Backpropagates error
+ * Backpropagates error, layers go in reverse topological order.
+ * Loss is reduced by output layers and summed over them on the
+ * device, it's fetched in background, see network_loss
  */
 void network_backward (struct network *net);
+
+/*
+ * network_validate:
+ * Validation mode step, runs forward and backward propagation on
+ * the in-order queue and then again from the same state on the
+ * out-of-order one and compares all layers' buffers bit for bit.
+ * Differing buffers are reported with warnings. The network is
+ * left in the state after the step, which is counted twice by
+ * the loss. Blocks until both runs are finished
+ * returns: whether results are equal, FALSE if the device can't
+ * execute out of order, the network is left untouched then
+ */
+gboolean network_validate (struct network *net);
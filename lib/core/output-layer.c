@@ -26,12 +26,36 @@
 struct output_layer
 {
     struct layer base;
+    enum loss_function loss;
     cl_mem truth_mem;
-    cl_mem loss_mem;
-    cl_event truth_event;
-    cl_event loss_event;
+    cl_mem partial_mem;
+    cl_mem probability_mem;
     cl_program program;
     cl_kernel backprop_kern;
+    cl_kernel reduce_kern;
+    cl_kernel final_kern;
+    cl_kernel gradient_kern;
+    cl_kernel softmax_kern;
+    cl_event reduce_event;
+    cl_event final_event;
+
+    /*
+     * Ring of truth staging buffers, truth is uploaded to the slot
+     * following the pending ones, backward moves to the next
+     * pending slot and sets $truth_mem to it. Slot is released
+     * by the backward barrier of the last step which used it
+     */
+    int ring_depth;
+    int current;
+    int pending;
+    cl_mem *truth_ring;
+    cl_event *truth_upload;
+    cl_event *truth_release;
+    float **truth_data;
+
+    /* Work-group size and count of the loss reduction */
+    int group_size;
+    int groups;
 };
 
 static void compile (struct layer *lay);
@@ -40,14 +64,16 @@ static void backward (struct layer *lay);
 static void release (struct layer *lay);
 
 struct layer *
-layer_make_output (struct network *net)
+layer_make_output (struct network *net,
+                   enum loss_function loss)
 {
     struct output_layer *out;
     struct layer *base;
-    int size;
 
     out = g_new0 (struct output_layer, 1);
     base = (struct layer *) out;
+    out->loss = loss;
+    out->ring_depth = 1;
 
     base->net = net;
     base->type = LAYER_OUTPUT;
@@ -65,21 +91,72 @@ layer_output_set_truth (struct layer *lay,
                         int size)
 {
     struct output_layer *out;
-    g_message ("set truth %d %d", lay->size, size);
+    cl_event release;
+    cl_int err;
+    int slot;
 
     g_assert (lay->type == LAYER_OUTPUT);
-    g_assert (lay->size == size);
+    g_assert (lay->flags & LAYER_FLAG_COMPILED);
+    g_assert (lay->batch * lay->size == size);
 
     out = (struct output_layer *) lay;
 
-    g_clear_pointer (&out->truth_event, clReleaseEvent);
+    /*
+     * If all slots are pending the newest truth is replaced
+     */
+    if (out->pending == out->ring_depth) {
+        slot = (out->current + out->pending) % out->ring_depth;
+    } else {
+        slot = (out->current + 1 + out->pending) % out->ring_depth;
+    }
+
+    release = out->truth_release[slot];
+
+    /*
+     * Upload may wait for the backward step on the main queue
+     */
+    if (release != NULL) {
+        clFlush (lay->net->ctx->queue);
+    }
+
+    /*
+     * Host copy is reused once its previous upload is done,
+     * so the caller's data may be freed just after the call
+     */
+    if (out->truth_upload[slot] != NULL) {
+        clWaitForEvents (1, &out->truth_upload[slot]);
+        g_clear_pointer (&out->truth_upload[slot], clReleaseEvent);
+    }
+
+    memcpy (out->truth_data[slot], data, size * sizeof (float));
+
+    err = clEnqueueWriteBuffer (network_upload_queue (lay->net),
+                                out->truth_ring[slot],
+                                CL_FALSE,
+                                0, size * sizeof (cl_float),
+                                out->truth_data[slot],
+                                UTIL_NONNULL (release),
+                                UTIL_PTR_OR_NULL (release),
+                                &out->truth_upload[slot]);
+    g_assert (err == CL_SUCCESS);
+
+    clFlush (network_upload_queue (lay->net));
 
-    clEnqueueWriteBuffer (lay->net->ctx->queue,
-                          out->truth_mem,
-                          CL_TRUE,
-                          0, size * sizeof (cl_float),
-                          data, 0, NULL,
-                          &out->truth_event);
+    out->pending = MIN (out->pending + 1, out->ring_depth);
+}
+
+void
+layer_output_set_ring_depth (struct layer *lay,
+                             int depth)
+{
+    struct output_layer *out;
+
+    g_assert (lay->type == LAYER_OUTPUT);
+    g_assert (!(lay->flags & LAYER_FLAG_COMPILED));
+    g_assert (depth > 0);
+
+    out = (struct output_layer *) lay;
+    out->ring_depth = depth;
 }
 
 static void
@@ -88,6 +165,7 @@ compile (struct layer *lay)
     struct output_layer *out;
     struct layer *prev;
     struct context *ctx;
+    int units, slot;
 
     out = (struct output_layer *) lay;
     ctx = lay->net->ctx;
@@ -104,26 +182,96 @@ compile (struct layer *lay)
     /*
      * Create buffers
      */
-    layer_create_buffer (lay, &out->truth_mem,
-                         lay->size, CL_MEM_READ_ONLY);
-    layer_create_buffer (lay, &out->loss_mem,
-                         1, CL_MEM_WRITE_ONLY);
+    out->truth_ring = g_new0 (cl_mem, out->ring_depth);
+    out->truth_upload = g_new0 (cl_event, out->ring_depth);
+    out->truth_release = g_new0 (cl_event, out->ring_depth);
+    out->truth_data = g_new0 (float *, out->ring_depth);
+    out->current = out->ring_depth - 1;
+
+    for (slot = 0; slot < out->ring_depth; slot++) {
+        layer_create_buffer (lay, &out->truth_ring[slot],
+                             lay->batch * lay->size, CL_MEM_READ_ONLY);
+        out->truth_data[slot] = g_new (float, lay->batch * lay->size);
+    }
+
+    out->truth_mem = out->truth_ring[out->current];
+
+    /*
+     * Outputs fitting in a single work-group are reduced
+     * in one pass, larger ones are split between groups
+     * writing partial sums which are summed by the last one.
+     * Softmax takes a work-group per sample
+     */
+    units = lay->batch * lay->size;
+
+    if (out->loss == LOSS_SOFTMAX_CROSS_ENTROPY) {
+        out->group_size = MIN (util_upper_power_2 (lay->size),
+                               ctx->group_size);
+        out->groups = lay->batch;
+
+        layer_create_buffer (lay, &out->probability_mem,
+                             units, CL_MEM_READ_WRITE);
+
+        if (out->groups > 1) {
+            layer_create_buffer (lay, &out->partial_mem,
+                                 out->groups, CL_MEM_READ_WRITE);
+        }
+    } else if (units <= ctx->group_size) {
+        out->group_size = util_upper_power_2 (units);
+        out->groups = 1;
+    } else {
+        out->group_size = ctx->group_size;
+        out->groups = MIN (util_upper_multiply (units, ctx->group_size)
+                           / ctx->group_size, ctx->group_size);
+
+        layer_create_buffer (lay, &out->partial_mem,
+                             out->groups, CL_MEM_READ_WRITE);
+    }
 
     /*
      * Build program
      */
     context_program_clear (ctx);
     context_program_file (ctx, "output-layer.cl");
-    context_program_option (ctx, "-DSIZE=%d", lay->size);
-    context_program_option (ctx, "-DSIZE_P2U=%d",
-                            util_upper_power_2 (lay->size));
+    /*
+     * Loss is taken over values of the whole batch
+     */
+    context_program_option (ctx, "-DSIZE=%d", units);
+    context_program_option (ctx, "-DGROUP_SIZE=%d", out->group_size);
+    context_program_option (ctx, "-DGROUPS=%d", out->groups);
+
+    if (out->loss == LOSS_SOFTMAX_CROSS_ENTROPY) {
+        context_program_option (ctx, "-DLOSS_SOFTMAX_CROSS_ENTROPY");
+        context_program_option (ctx, "-DBATCH=%d", lay->batch);
+    }
+
+    if (out->groups == 1) {
+        context_program_option (ctx, "-DSINGLE_GROUP");
+    }
 
     if (lay->prev->gradient_mem != 0) {
         context_program_option (ctx, "-DCALC_GRADIENT");
     }
 
     context_program_build (ctx, &out->program);
-    context_program_kernel (ctx, "backprop", &out->backprop_kern);
+
+    if (out->loss == LOSS_SOFTMAX_CROSS_ENTROPY) {
+        context_program_kernel (ctx, "softmax", &out->softmax_kern);
+        context_program_kernel (ctx, "backprop", &out->backprop_kern);
+
+        if (out->groups > 1) {
+            context_program_kernel (ctx, "reduce_final", &out->final_kern);
+        }
+    } else if (out->groups == 1) {
+        context_program_kernel (ctx, "backprop", &out->backprop_kern);
+    } else {
+        context_program_kernel (ctx, "reduce", &out->reduce_kern);
+        context_program_kernel (ctx, "reduce_final", &out->final_kern);
+
+        if (lay->prev->gradient_mem != 0) {
+            context_program_kernel (ctx, "gradient", &out->gradient_kern);
+        }
+    }
 
     /*
      * Mark compiled
@@ -134,91 +282,235 @@ compile (struct layer *lay)
 static void
 forward (struct layer *lay)
 {
+    struct output_layer *out;
+    size_t globsiz, locsiz;
+    cl_kernel kern;
+
     g_assert (lay->type == LAYER_OUTPUT);
     g_assert (lay->size == lay->prev->size);
     g_assert (lay->prev != NULL);
 
-    lay->value_mem = lay->prev->value_mem;
+    out = (struct output_layer *) lay;
+
+    if (out->loss != LOSS_SOFTMAX_CROSS_ENTROPY) {
+        lay->value_mem = lay->prev->value_mem;
+        return;
+    }
+
+    /*
+     * Normalize each sample into probabilities
+     */
+    kern = out->softmax_kern;
+    layer_set_value_arg (lay->prev, kern, 0);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &out->probability_mem);
+
+    lay->value_mem = out->probability_mem;
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+    locsiz = out->group_size;
+    globsiz = locsiz * out->groups;
+    context_run_kernel (lay->net->ctx, kern, 1,
+                        &globsiz, &locsiz,
+                        UTIL_NONNULL (lay->prev->forward_barrier),
+                        UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                        &lay->forward_barrier);
 }
 
 static void
 backward (struct layer *lay)
 {
     struct output_layer *out;
+    struct network *net;
+    struct context *ctx;
     size_t globsiz, locsiz;
-    cl_event evlist[2];
+    cl_event evlist[4];
     cl_kernel kern;
-    cl_int err, evcount;
+    cl_int evcount, slot;
 
     g_assert (lay->type == LAYER_OUTPUT);
     g_assert (lay->size == lay->prev->size);
 
     out = (struct output_layer *) lay;
-    kern = out->backprop_kern;
+    net = lay->net;
+    ctx = net->ctx;
+    slot = network_loss_slot (net, lay);
+
+    /*
+     * Move to the next uploaded truth, without new one
+     * the current is used again
+     */
+    if (out->pending > 0) {
+        out->current = (out->current + 1) % out->ring_depth;
+        out->pending--;
+    }
+
+    out->truth_mem = out->truth_ring[out->current];
 
     /*
      * Make event dependencies list for backpropgation
      * It depends on truth setting and previous layer's
-     * forward barrier
+     * forward barrier, loss ring mustn't be overwritten
+     * while it's being read and previous layer's gradients
+     * have to be cleared first
      */
     evcount = 0;
 
-    if (out->truth_event != NULL) {
-        evlist[evcount++] = out->truth_event;
+    if (out->truth_upload[out->current] != NULL) {
+        evlist[evcount++] = out->truth_upload[out->current];
     }
 
     if (lay->prev->forward_barrier != NULL) {
         evlist[evcount++] = lay->prev->forward_barrier;
     }
 
+    if (net->loss_event != NULL) {
+        evlist[evcount++] = net->loss_event;
+    }
 
-    /*
-     * Run backpropagation
-     */
-    clSetKernelArg (kern, 0, sizeof (cl_mem), &out->truth_mem);
-    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->value_mem);
-    clSetKernelArg (kern, 2, sizeof (cl_mem), &lay->prev->gradient_mem);
-    clSetKernelArg (kern, 3, sizeof (cl_mem), &out->loss_mem);
+    if (lay->prev->gradient_barrier != NULL) {
+        evlist[evcount++] = lay->prev->gradient_barrier;
+    }
 
     g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
 
-    locsiz = lay->size;
-    globsiz = locsiz;
-    err = clEnqueueNDRangeKernel (lay->net->ctx->queue,
-                                  kern, 1, NULL,
-                                  &globsiz, &locsiz,
-                                  evcount, evlist,
-                                  &lay->backward_barrier);
-    g_assert (err == CL_SUCCESS);
+    if (out->groups == 1) {
+        /*
+         * Reduce loss and compute gradients in a single group
+         */
+        kern = out->backprop_kern;
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &out->truth_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->prev->value_mem);
+        clSetKernelArg (kern, 2, sizeof (cl_mem),
+                        &lay->prev->gradient_mem);
+        clSetKernelArg (kern, 3, sizeof (cl_mem), &net->loss_mem);
+        clSetKernelArg (kern, 4, sizeof (cl_int), &slot);
+
+        locsiz = out->group_size;
+        globsiz = locsiz;
+        context_run_kernel (ctx, kern, 1,
+                            &globsiz, &locsiz,
+                            evcount, evlist,
+                            &lay->backward_barrier);
+    } else {
+        if (out->loss == LOSS_SOFTMAX_CROSS_ENTROPY) {
+            /*
+             * Compute gradients and loss per sample
+             */
+            kern = out->backprop_kern;
+            clSetKernelArg (kern, 0, sizeof (cl_mem), &out->truth_mem);
+            clSetKernelArg (kern, 1, sizeof (cl_mem),
+                            &lay->prev->value_mem);
+            clSetKernelArg (kern, 2, sizeof (cl_mem),
+                            &lay->prev->gradient_mem);
+            clSetKernelArg (kern, 3, sizeof (cl_mem), &out->partial_mem);
+        } else {
+            /*
+             * Sum squared errors per work-group
+             */
+            kern = out->reduce_kern;
+            clSetKernelArg (kern, 0, sizeof (cl_mem), &out->truth_mem);
+            clSetKernelArg (kern, 1, sizeof (cl_mem),
+                            &lay->prev->value_mem);
+            clSetKernelArg (kern, 2, sizeof (cl_mem), &out->partial_mem);
+        }
+
+        g_clear_pointer (&out->reduce_event, clReleaseEvent);
+
+        locsiz = out->group_size;
+        globsiz = locsiz * out->groups;
+        context_run_kernel (ctx, kern, 1,
+                            &globsiz, &locsiz,
+                            evcount, evlist,
+                            &out->reduce_event);
+
+
+        /*
+         * Sum partial sums into the loss
+         */
+        kern = out->final_kern;
+        clSetKernelArg (kern, 0, sizeof (cl_mem), &out->partial_mem);
+        clSetKernelArg (kern, 1, sizeof (cl_mem), &net->loss_mem);
+        clSetKernelArg (kern, 2, sizeof (cl_int), &slot);
+
+        g_clear_pointer (&out->final_event, clReleaseEvent);
+
+        globsiz = locsiz;
+        context_run_kernel (ctx, kern, 1,
+                            &globsiz, &locsiz,
+                            1, &out->reduce_event,
+                            &out->final_event);
+
+
+        /*
+         * Scale errors by the loss
+         */
+        if (out->gradient_kern != NULL) {
+            kern = out->gradient_kern;
+            clSetKernelArg (kern, 0, sizeof (cl_mem), &out->truth_mem);
+            clSetKernelArg (kern, 1, sizeof (cl_mem),
+                            &lay->prev->value_mem);
+            clSetKernelArg (kern, 2, sizeof (cl_mem),
+                            &lay->prev->gradient_mem);
+            clSetKernelArg (kern, 3, sizeof (cl_mem), &net->loss_mem);
+            clSetKernelArg (kern, 4, sizeof (cl_int), &slot);
+
+            context_run_sparse (ctx, kern, lay->batch * lay->size,
+                                1, &out->final_event,
+                                &lay->backward_barrier);
+        } else {
+            lay->backward_barrier = out->final_event;
+            clRetainEvent (lay->backward_barrier);
+        }
+    }
 
+    layer_propagate_done (lay, lay->backward_barrier);
 
-    /*
-     * Enqueue loss reading
-     */
-    g_clear_pointer (&out->loss_event, clReleaseEvent);
-    clEnqueueReadBuffer (lay->net->ctx->queue,
-                         out->loss_mem,
-                         CL_TRUE,
-                         0, sizeof (cl_float),
-                         &lay->loss,
-                         evcount, evlist,
-                         &out->loss_event);
+    g_clear_pointer (&out->truth_release[out->current], clReleaseEvent);
+    out->truth_release[out->current] = lay->backward_barrier;
+    clRetainEvent (lay->backward_barrier);
 }
 
 static void
 release (struct layer *lay)
 {
     struct output_layer *out;
+    int slot;
 
     g_assert (lay->type == LAYER_OUTPUT);
     out = (struct output_layer *) lay;
 
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
     g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
-    g_clear_pointer (&out->truth_event, clReleaseEvent);
-    g_clear_pointer (&out->loss_event, clReleaseEvent);
+    g_clear_pointer (&out->reduce_event, clReleaseEvent);
+    g_clear_pointer (&out->final_event, clReleaseEvent);
+
+    g_clear_pointer (&out->backprop_kern, clReleaseKernel);
+    g_clear_pointer (&out->reduce_kern, clReleaseKernel);
+    g_clear_pointer (&out->final_kern, clReleaseKernel);
+    g_clear_pointer (&out->gradient_kern, clReleaseKernel);
+    g_clear_pointer (&out->softmax_kern, clReleaseKernel);
+    context_program_release (lay->net->ctx, out->program);
+
+    /*
+     * Host copies mustn't be freed while being uploaded
+     */
+    for (slot = 0; slot < out->ring_depth
+         && (lay->flags & LAYER_FLAG_COMPILED); slot++) {
+        if (out->truth_upload[slot] != NULL) {
+            clWaitForEvents (1, &out->truth_upload[slot]);
+            clReleaseEvent (out->truth_upload[slot]);
+        }
+
+        g_clear_pointer (&out->truth_release[slot], clReleaseEvent);
+        g_free (out->truth_data[slot]);
+        clReleaseMemObject (out->truth_ring[slot]);
+    }
 
-    clReleaseKernel (out->backprop_kern);
-    clReleaseProgram (out->program);
-    clReleaseMemObject (out->truth_mem);
-    clReleaseMemObject (out->loss_mem);
+    g_free (out->truth_ring);
+    g_free (out->truth_upload);
+    g_free (out->truth_release);
+    g_free (out->truth_data);
+    g_clear_pointer (&out->partial_mem, clReleaseMemObject);
+    g_clear_pointer (&out->probability_mem, clReleaseMemObject);
 }
@@ -19,38 +19,278 @@
  * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-__kernel void backprop (__global const float *truth_v,
-                        __global const float *value_v,
-                        __global float *prev_gradient_v,
-                        __global float *loss_p)
+/*
+ * Square error loss is the square root of the summed squared
+ * errors, gradients are the errors scaled by the loss. Softmax
+ * cross entropy loss is the mean of samples' cross entropies,
+ * gradients are the truth minus softmax probabilities. Loss is
+ * stored at the slot of the network's loss ring, gradients are
+ * added to the previous layer's ones as it may feed other layers
+ * too.
+ *
+ * SIZE values of BATCH samples are reduced by work-groups of
+ * GROUP_SIZE work-items, GROUP_SIZE has to be a power of 2
+ */
+#ifdef LOSS_SOFTMAX_CROSS_ENTROPY
+#define LOSS_TOTAL(sum) ((sum) / BATCH)
+#define SAMPLE_SIZE (SIZE / BATCH)
+#else
+#define LOSS_TOTAL(sum) sqrt (sum)
+#endif
+
+float group_sum (__local float *partial_v, float value)
 {
-    __local float local_loss[SIZE];
-    __private float sub, loss;
-    __private int index, off;
+    __private int lid, off;
 
-    index = get_local_id (0);
-    sub = truth_v[index] - value_v[index];
+    lid = get_local_id (0);
+    partial_v[lid] = value;
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (off = GROUP_SIZE / 2; off > 0; off /= 2) {
+        if (lid < off) {
+            partial_v[lid] += partial_v[lid + off];
+        }
+
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    value = partial_v[0];
+
+    /*
+     * Local memory may be reused just after return
+     */
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    return value;
+}
+
+#ifdef LOSS_SOFTMAX_CROSS_ENTROPY
+float group_max (__local float *partial_v, float value)
+{
+    __private int lid, off;
 
-    local_loss[index] = sub * sub;
+    lid = get_local_id (0);
+    partial_v[lid] = value;
 
-    for (off = SIZE_P2U >> 1; off > 0; off >>= 1) {
-        if (index <= off && index + off < SIZE) {
-            local_loss[index] += local_loss[index + off];
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    for (off = GROUP_SIZE / 2; off > 0; off /= 2) {
+        if (lid < off) {
+            partial_v[lid] = fmax (partial_v[lid], partial_v[lid + off]);
         }
 
-        barrier(CLK_LOCAL_MEM_FENCE);
+        barrier (CLK_LOCAL_MEM_FENCE);
+    }
+
+    value = partial_v[0];
+
+    barrier (CLK_LOCAL_MEM_FENCE);
+
+    return value;
+}
+
+/*
+ * Gives log of the sum of exponents of the sample's values,
+ * the max value is subtracted before exponentiation so large
+ * values don't overflow
+ */
+float log_sum_exp (__global const float *value_v,
+                   __local float *partial_v)
+{
+    __private float max, sum;
+    __private int index;
+
+    max = -INFINITY;
+
+    for (index = get_local_id (0); index < SAMPLE_SIZE;
+         index += GROUP_SIZE) {
+        max = fmax (max, value_v[index]);
+    }
+
+    max = group_max (partial_v, max);
+    sum = 0;
+
+    for (index = get_local_id (0); index < SAMPLE_SIZE;
+         index += GROUP_SIZE) {
+        sum += exp (value_v[index] - max);
+    }
+
+    return max + log (group_sum (partial_v, sum));
+}
+
+/*
+ * Normalizes each sample's values into probabilities,
+ * one work-group per sample
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void softmax (__global const float *value_v,
+              __global float *probability_v)
+{
+    __local float partial_v[GROUP_SIZE];
+    __private float lse;
+    __private int index, base;
+
+    base = get_group_id (0) * SAMPLE_SIZE;
+    lse = log_sum_exp (value_v + base, partial_v);
+
+    for (index = get_local_id (0); index < SAMPLE_SIZE;
+         index += GROUP_SIZE) {
+        probability_v[base + index] = exp (value_v[base + index] - lse);
+    }
+}
+
+/*
+ * Computes sample's loss and gradients in a single pass, one
+ * work-group per sample. Loss of a single sample is written
+ * to the ring directly, otherwise it's summed by reduce_final
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void backprop (__global const float *truth_v,
+               __global const float *value_v,
+               __global float *prev_gradient_v,
+#ifdef SINGLE_GROUP
+               __global float *loss_p,
+               int slot)
+#else
+               __global float *partial_sum_v)
+#endif
+{
+    __local float partial_v[GROUP_SIZE];
+    __private float lse, truth, loss;
+    __private int index, base;
+
+    base = get_group_id (0) * SAMPLE_SIZE;
+    lse = log_sum_exp (value_v + base, partial_v);
+    loss = 0;
+
+    for (index = get_local_id (0); index < SAMPLE_SIZE;
+         index += GROUP_SIZE) {
+        truth = truth_v[base + index];
+        loss += truth * (lse - value_v[base + index]);
+
+#ifdef CALC_GRADIENT
+        prev_gradient_v[base + index] +=
+            truth - exp (value_v[base + index] - lse);
+#endif
+    }
+
+    loss = group_sum (partial_v, loss);
+
+    if (get_local_id (0) == 0) {
+#ifdef SINGLE_GROUP
+        loss_p[slot] = LOSS_TOTAL (loss);
+#else
+        partial_sum_v[get_group_id (0)] = loss;
+#endif
+    }
+}
+#elif defined (SINGLE_GROUP)
+/*
+ * Small outputs are reduced by a single work-group, which computes
+ * gradients in the same pass
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void backprop (__global const float *truth_v,
+               __global const float *value_v,
+               __global float *prev_gradient_v,
+               __global float *loss_p,
+               int slot)
+{
+    __local float partial_v[GROUP_SIZE];
+    __private float sub, loss;
+    __private int index;
+
+    index = get_local_id (0);
+    sub = 0;
+
+    if (index < SIZE) {
+        sub = truth_v[index] - value_v[index];
     }
 
+    loss = LOSS_TOTAL (group_sum (partial_v, sub * sub));
+
     if (index == 0) {
-        loss = sqrt (local_loss[0]);
-        loss_p[0] = loss;
+        loss_p[slot] = loss;
+    }
+
 #ifdef CALC_GRADIENT
-        local_loss[0] = loss;
+    if (index < SIZE) {
+        prev_gradient_v[index] += sub * loss;
+    }
 #endif
+}
+#else
+/*
+ * First stage, GROUPS work-groups stride over the values and each
+ * writes its partial sum
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void reduce (__global const float *truth_v,
+             __global const float *value_v,
+             __global float *partial_sum_v)
+{
+    __local float partial_v[GROUP_SIZE];
+    __private float sub, sum;
+    __private int index;
+
+    sum = 0;
+
+    for (index = get_global_id (0); index < SIZE;
+         index += GROUPS * GROUP_SIZE) {
+        sub = truth_v[index] - value_v[index];
+        sum += sub * sub;
     }
 
+    sum = group_sum (partial_v, sum);
+
+    if (get_local_id (0) == 0) {
+        partial_sum_v[get_group_id (0)] = sum;
+    }
+}
+
 #ifdef CALC_GRADIENT
-    barrier(CLK_LOCAL_MEM_FENCE);
-    prev_gradient_v[index] = sub * local_loss[0];
+__kernel void gradient (__global const float *truth_v,
+                        __global const float *value_v,
+                        __global float *prev_gradient_v,
+                        __global const float *loss_p,
+                        int slot)
+{
+    __private int index;
+
+    index = get_global_id (0);
+
+    if (index < SIZE) {
+        prev_gradient_v[index] += (truth_v[index] - value_v[index])
+            * loss_p[slot];
+    }
+}
 #endif
+#endif
+
+#ifndef SINGLE_GROUP
+/*
+ * Second stage, a single work-group sums the GROUPS partial sums
+ */
+__kernel __attribute__ ((reqd_work_group_size (GROUP_SIZE, 1, 1)))
+void reduce_final (__global const float *partial_sum_v,
+                   __global float *loss_p,
+                   int slot)
+{
+    __local float partial_v[GROUP_SIZE];
+    __private float sum;
+    __private int index;
+
+    sum = 0;
+
+    for (index = get_local_id (0); index < GROUPS; index += GROUP_SIZE) {
+        sum += partial_sum_v[index];
+    }
+
+    sum = group_sum (partial_v, sum);
+
+    if (get_local_id (0) == 0) {
+        loss_p[slot] = LOSS_TOTAL (sum);
+    }
 }
+#endif
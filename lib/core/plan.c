@@ -0,0 +1,400 @@
+/*
+ * plan.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "plan.h"
+#include "layer.h"
+#include "network.h"
+
+struct plan_task
+{
+    /* kernel handle, NULL for markers */
+    cl_kernel kernel;
+
+    cl_uint dims;
+    size_t global[3];
+    size_t local[3];
+    gboolean has_local;
+
+    /* range of the plan's dependencies */
+    guint first_dep;
+    guint dep_count;
+};
+
+/*
+ * Kernel argument set to values of a live layer
+ */
+struct plan_binding
+{
+    cl_kernel kernel;
+    cl_uint index;
+    guint live;
+};
+
+/*
+ * Forward barrier given to a recorded layer by each replay
+ */
+struct plan_barrier
+{
+    struct layer *lay;
+    int dep;
+};
+
+static void clear_tasks (struct plan *plan);
+static int find_dep (struct plan *plan, cl_event ev);
+static cl_event resolve_dep (struct plan *plan, int dep);
+
+struct plan *
+plan_create (struct network *net)
+{
+    struct plan *plan;
+    struct layer *lay;
+    guint i;
+
+    plan = g_new0 (struct plan, 1);
+    plan->net = net;
+    plan->tasks = g_array_new (FALSE, FALSE, sizeof (struct plan_task));
+    plan->deps = g_array_new (FALSE, FALSE, sizeof (int));
+    plan->live = g_ptr_array_new ();
+    plan->bindings = g_array_new (FALSE, FALSE,
+                                  sizeof (struct plan_binding));
+    plan->barriers = g_array_new (FALSE, FALSE,
+                                  sizeof (struct plan_barrier));
+
+    for (i = 0; i < net->layers->len; i++) {
+        lay = g_ptr_array_index (net->layers, i);
+
+        if (lay->type == LAYER_INPUT) {
+            g_ptr_array_add (plan->live, lay);
+        }
+    }
+
+    return plan;
+}
+
+void
+plan_free (struct plan *plan)
+{
+    g_assert (plan->recorded == NULL);
+
+    clear_tasks (plan);
+
+    g_array_unref (plan->tasks);
+    g_array_unref (plan->deps);
+    g_ptr_array_unref (plan->live);
+    g_array_unref (plan->bindings);
+    g_array_unref (plan->barriers);
+    g_free (plan);
+}
+
+void
+plan_record_begin (struct plan *plan)
+{
+    g_assert (plan->net->ctx->recording == NULL);
+
+    clear_tasks (plan);
+
+    /*
+     * Events are kept while recording, so their handles
+     * aren't reused for other tasks
+     */
+    plan->recorded = g_hash_table_new_full (g_direct_hash,
+                                            g_direct_equal,
+                                            (GDestroyNotify)
+                                            clReleaseEvent,
+                                            NULL);
+    plan->kernels = g_hash_table_new (g_direct_hash, g_direct_equal);
+    plan->failed = FALSE;
+
+    plan->net->ctx->recording = plan;
+}
+
+void
+plan_record (struct plan *plan,
+             cl_kernel kern,
+             cl_uint dims,
+             const size_t *globsiz,
+             const size_t *locsiz,
+             cl_int evcnt,
+             const cl_event *evlist,
+             const cl_event *ev)
+{
+    struct plan_task task = { 0 };
+    cl_int i;
+    int dep;
+
+    g_assert (dims <= 3);
+
+    /*
+     * Arguments of the first run would be overwritten
+     */
+    if (kern != NULL) {
+        if (g_hash_table_contains (plan->kernels, kern)) {
+            plan->failed = TRUE;
+        }
+
+        g_hash_table_add (plan->kernels, kern);
+        clRetainKernel (kern);
+    }
+
+    task.kernel = kern;
+    task.dims = dims;
+    task.has_local = locsiz != NULL;
+    task.first_dep = plan->deps->len;
+
+    for (i = 0; i < (cl_int) dims; i++) {
+        task.global[i] = globsiz[i];
+        task.local[i] = locsiz != NULL ? locsiz[i] : 0;
+    }
+
+    for (i = 0; i < evcnt; i++) {
+        dep = find_dep (plan, evlist[i]);
+
+        if (dep != PLAN_NONE) {
+            g_array_append_val (plan->deps, dep);
+            task.dep_count++;
+        }
+    }
+
+    if (ev != NULL && *ev != NULL) {
+        clRetainEvent (*ev);
+        g_hash_table_insert (plan->recorded, *ev,
+                             GINT_TO_POINTER (plan->tasks->len));
+    }
+
+    g_array_append_val (plan->tasks, task);
+}
+
+void
+plan_bind (struct plan *plan,
+           cl_kernel kern,
+           cl_uint index,
+           struct layer *lay)
+{
+    struct plan_binding binding;
+    guint live;
+
+    if (!g_ptr_array_find (plan->live, lay, &live)) {
+        return;
+    }
+
+    binding.kernel = kern;
+    binding.index = index;
+    binding.live = live;
+    clRetainKernel (kern);
+
+    g_array_append_val (plan->bindings, binding);
+}
+
+void
+plan_record_end (struct plan *plan,
+                 GPtrArray *layers)
+{
+    struct plan_barrier barrier;
+    struct layer *lay;
+    guint i, maxdeps;
+
+    g_assert (plan->net->ctx->recording == plan);
+
+    plan->net->ctx->recording = NULL;
+
+    for (i = 0; i < layers->len; i++) {
+        lay = g_ptr_array_index (layers, i);
+
+        barrier.lay = lay;
+        barrier.dep = lay->forward_barrier != NULL
+            ? find_dep (plan, lay->forward_barrier) : PLAN_NONE;
+        g_array_append_val (plan->barriers, barrier);
+    }
+
+    g_clear_pointer (&plan->recorded, g_hash_table_unref);
+    g_clear_pointer (&plan->kernels, g_hash_table_unref);
+
+    maxdeps = 0;
+
+    for (i = 0; i < plan->tasks->len; i++) {
+        maxdeps = MAX (maxdeps, g_array_index (plan->tasks,
+                                               struct plan_task,
+                                               i).dep_count);
+    }
+
+    plan->events = g_new0 (cl_event, plan->tasks->len);
+    plan->waits = g_new (cl_event, MAX (maxdeps, 1));
+    plan->frozen = !plan->failed;
+}
+
+gboolean
+plan_replay (struct plan *plan)
+{
+    struct plan_barrier *barrier;
+    struct plan_binding *binding;
+    struct plan_task *task;
+    struct layer *lay;
+    cl_command_queue queue;
+    cl_event ev;
+    cl_int err, evcount;
+    guint i, d;
+
+    if (!plan->frozen) {
+        return FALSE;
+    }
+
+    /*
+     * Live layers may have rotated their staging buffers
+     */
+    for (i = 0; i < plan->bindings->len; i++) {
+        binding = &g_array_index (plan->bindings, struct plan_binding, i);
+        lay = g_ptr_array_index (plan->live, binding->live);
+
+        err = clSetKernelArg (binding->kernel, binding->index,
+                              sizeof (cl_mem), &lay->value_mem);
+        g_assert (err == CL_SUCCESS);
+    }
+
+    queue = plan->net->ctx->queue;
+
+    for (i = 0; i < plan->tasks->len; i++) {
+        task = &g_array_index (plan->tasks, struct plan_task, i);
+        evcount = 0;
+
+        for (d = 0; d < task->dep_count; d++) {
+            ev = resolve_dep (plan, g_array_index (plan->deps, int,
+                                                   task->first_dep + d));
+
+            if (ev != NULL) {
+                plan->waits[evcount++] = ev;
+            }
+        }
+
+        g_clear_pointer (&plan->events[i], clReleaseEvent);
+
+        if (task->kernel != NULL) {
+            err = clEnqueueNDRangeKernel (queue, task->kernel,
+                                          task->dims, NULL,
+                                          task->global,
+                                          task->has_local
+                                          ? task->local : NULL,
+                                          evcount,
+                                          evcount > 0 ? plan->waits : NULL,
+                                          &plan->events[i]);
+        } else {
+            err = clEnqueueMarkerWithWaitList (queue, evcount,
+                                               evcount > 0
+                                               ? plan->waits : NULL,
+                                               &plan->events[i]);
+        }
+
+        g_assert (err == CL_SUCCESS);
+    }
+
+    /*
+     * Layers' barriers are used by backward calls and live layers
+     */
+    for (i = 0; i < plan->barriers->len; i++) {
+        barrier = &g_array_index (plan->barriers, struct plan_barrier, i);
+        ev = resolve_dep (plan, barrier->dep);
+
+        if (ev != NULL) {
+            clRetainEvent (ev);
+        }
+
+        g_clear_pointer (&barrier->lay->forward_barrier, clReleaseEvent);
+        barrier->lay->forward_barrier = ev;
+    }
+
+    return TRUE;
+}
+
+static void
+clear_tasks (struct plan *plan)
+{
+    struct plan_task *task;
+    guint i;
+
+    for (i = 0; i < plan->bindings->len; i++) {
+        clReleaseKernel (g_array_index (plan->bindings,
+                                        struct plan_binding, i).kernel);
+    }
+
+    for (i = 0; i < plan->tasks->len; i++) {
+        task = &g_array_index (plan->tasks, struct plan_task, i);
+
+        if (task->kernel != NULL) {
+            clReleaseKernel (task->kernel);
+        }
+
+        if (plan->events != NULL && plan->events[i] != NULL) {
+            clReleaseEvent (plan->events[i]);
+        }
+    }
+
+    g_array_set_size (plan->tasks, 0);
+    g_array_set_size (plan->deps, 0);
+    g_array_set_size (plan->bindings, 0);
+    g_array_set_size (plan->barriers, 0);
+    g_clear_pointer (&plan->events, g_free);
+    g_clear_pointer (&plan->waits, g_free);
+    plan->frozen = FALSE;
+}
+
+/*
+ * Gives dependency on the event. Events of neither recorded tasks
+ * nor live layers come from before the step, ordered by the queue
+ * or by the step's barrier, so they're dropped
+ */
+static int
+find_dep (struct plan *plan, cl_event ev)
+{
+    struct layer *lay;
+    gpointer index;
+    guint i;
+
+    if (g_hash_table_lookup_extended (plan->recorded, ev, NULL, &index)) {
+        return GPOINTER_TO_INT (index);
+    }
+
+    for (i = 0; i < plan->live->len; i++) {
+        lay = g_ptr_array_index (plan->live, i);
+
+        if (lay->forward_barrier == ev) {
+            return PLAN_LIVE (i);
+        }
+    }
+
+    return PLAN_NONE;
+}
+
+static cl_event
+resolve_dep (struct plan *plan, int dep)
+{
+    struct layer *lay;
+
+    if (dep >= 0) {
+        return plan->events[dep];
+    }
+
+    if (dep == PLAN_NONE) {
+        return NULL;
+    }
+
+    lay = g_ptr_array_index (plan->live, PLAN_LIVE (0) - dep);
+
+    return lay->forward_barrier;
+}
@@ -0,0 +1,152 @@
+/*
+ * plan.h
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "context.h"
+
+struct layer;
+struct network;
+
+/*
+ * Execution plan, tasks enqueued by layers' forward calls recorded
+ * once and replayed without going through the layers. Kernels keep
+ * the arguments they were recorded with, so each of them may be run
+ * once per plan, and global and local sizes are stored along. Tasks
+ * refer to each other by indices, so their events are kept in
+ * preallocated slots.
+ *
+ * Live layers, the input ones, run their forward calls as usual
+ * before the plan is replayed, as they rotate staging buffers.
+ * Kernel arguments bound to their values are set again by each
+ * replay, so a single plan serves all the buffers
+ */
+struct plan
+{
+    struct network *net;
+
+    /* array of struct plan_task */
+    GArray *tasks;
+
+    /*
+     * Dependencies of the tasks, indices of earlier tasks or
+     * PLAN_LIVE (i) for forward barrier of the ith live layer
+     */
+    GArray *deps;
+
+    /* layers running their forward calls as usual */
+    GPtrArray *live;
+
+    /* array of struct plan_binding, arguments of live values */
+    GArray *bindings;
+
+    /* array of struct plan_barrier */
+    GArray *barriers;
+
+    /* event slot of each task and the wait list */
+    cl_event *events;
+    cl_event *waits;
+
+    /* whether the plan was recorded and may be replayed */
+    gboolean frozen;
+
+    /* whether a step was run before recording */
+    gboolean warm;
+
+    /* maps recorded events to task indices while recording */
+    GHashTable *recorded;
+    GHashTable *kernels;
+    gboolean failed;
+};
+
+#define PLAN_NONE (-1)
+#define PLAN_LIVE(i) (-2 - (i))
+
+/*
+ * plan_create:
+ * Creates empty plan of the network, input layers are live
+ */
+struct plan *plan_create (struct network *net);
+
+/*
+ * plan_free:
+ * Frees the plan
+ */
+void plan_free (struct plan *plan);
+
+/*
+ * plan_record_begin:
+ * Starts recording of tasks enqueued through the context, live
+ * layers have to be propagated already
+ */
+void plan_record_begin (struct plan *plan);
+
+/*
+ * plan_record:
+ * Records enqueued task, called by the context
+ * kern: (nullable) kernel handle, NULL for markers
+ * dims: number of dimensions
+ * globsiz: global size of each dimension
+ * locsiz: (nullable) local size of each dimension
+ * evcnt: number of events the task waits for
+ * evlist: event list
+ * ev: (nullable) pointer to the task's event
+ */
+void plan_record (struct plan *plan,
+                  cl_kernel kern,
+                  cl_uint dims,
+                  const size_t *globsiz,
+                  const size_t *locsiz,
+                  cl_int evcnt,
+                  const cl_event *evlist,
+                  const cl_event *ev);
+
+/*
+ * plan_bind:
+ * Records kernel argument set to values of the layer, called
+ * by layer_set_value_arg. Arguments of live layers are set
+ * again by replays
+ * kern: kernel handle
+ * index: argument index
+ * lay: layer whose values are passed
+ */
+void plan_bind (struct plan *plan,
+                cl_kernel kern,
+                cl_uint index,
+                struct layer *lay);
+
+/*
+ * plan_record_end:
+ * Finishes recording, the plan is frozen unless a kernel was
+ * run more than once
+ * layers: layers propagated while recording
+ */
+void plan_record_end (struct plan *plan,
+                      GPtrArray *layers);
+
+/*
+ * plan_replay:
+ * Enqueues recorded tasks again with the current values of live
+ * layers and sets forward barriers of the recorded layers, live
+ * layers have to be propagated already
+ * returns: FALSE if the plan isn't frozen, nothing is enqueued then
+ */
+gboolean plan_replay (struct plan *plan);
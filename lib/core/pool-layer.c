@@ -0,0 +1,254 @@
+/*
+ * pool-layer.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "layer.h"
+#include "network.h"
+#include "context.h"
+#include "util.h"
+
+struct pool_layer
+{
+    struct layer base;
+    enum pool_mode mode;
+    int psize;
+    int pstride;
+    cl_program program;
+    cl_kernel forward;
+    cl_kernel backward;
+
+    /* input index chosen by each max pooling output */
+    cl_mem index_mem;
+};
+
+static void compile (struct layer *lay);
+static void forward (struct layer *lay);
+static void backward (struct layer *lay);
+static void release (struct layer *lay);
+
+struct layer *
+layer_make_pool (struct network *net,
+                 enum pool_mode mode,
+                 int size, int stride)
+{
+    struct pool_layer *pool;
+    struct layer *lay;
+
+    g_assert (size > 0 && stride > 0);
+
+    pool = g_new0 (struct pool_layer, 1);
+    lay = (struct layer *) pool;
+
+    lay->net = net;
+    lay->type = LAYER_POOL;
+    lay->compile = compile;
+    lay->forward = forward;
+    lay->backward = backward;
+    lay->release = release;
+
+    pool->mode = mode;
+    pool->psize = size;
+    pool->pstride = stride;
+
+    return lay;
+}
+
+static void
+compile (struct layer *lay)
+{
+    struct pool_layer *pool;
+    struct layer *prev;
+    struct context *ctx;
+    gboolean indices;
+
+    g_assert (lay->type == LAYER_POOL);
+    g_assert ((lay->flags & LAYER_FLAG_COMPILED) == 0);
+
+    pool = (struct pool_layer *) lay;
+    ctx = lay->net->ctx;
+    prev = lay->prev;
+
+    g_assert (prev->width >= pool->psize && prev->height >= pool->psize);
+
+    lay->width = (prev->width - pool->psize) / pool->pstride + 1;
+    lay->height = (prev->height - pool->psize) / pool->pstride + 1;
+    lay->depth = prev->depth;
+    lay->size = lay->width * lay->height * lay->depth;
+    lay->weights = 0;
+
+    indices = pool->mode == POOL_MAX
+        && (lay->net->flags & NETWORK_FLAG_BACKPROP) != 0;
+
+
+    /*
+     * Create buffers, indices are ints of the same size as floats
+     */
+    layer_create_value (lay);
+
+    if (lay->net->flags & NETWORK_FLAG_BACKPROP) {
+        layer_create_buffer (lay, &lay->gradient_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+    }
+
+    if (indices) {
+        layer_create_buffer (lay, &pool->index_mem,
+                             lay->batch * lay->size, CL_MEM_READ_WRITE);
+    }
+
+
+    /*
+     * Build CL program
+     */
+    context_program_clear (ctx);
+    context_program_option (ctx, "-DPOOL_SIZE=%d", pool->psize);
+    context_program_option (ctx, "-DPOOL_STRIDE=%d", pool->pstride);
+    context_program_option (ctx, "-DWIDTH=%d", lay->width);
+    context_program_option (ctx, "-DHEIGHT=%d", lay->height);
+    context_program_option (ctx, "-DDEPTH=%d", lay->depth);
+    context_program_option (ctx, "-DINPUT_WIDTH=%d", prev->width);
+    context_program_option (ctx, "-DINPUT_HEIGHT=%d", prev->height);
+    context_program_option (ctx, "-DBATCH=%d", lay->batch);
+
+    if (pool->mode == POOL_MAX) {
+        context_program_option (ctx, "-DPOOL_MAX");
+    }
+
+    if (indices) {
+        context_program_option (ctx, "-DWITH_INDICES");
+    }
+
+    if (pool->pstride >= pool->psize) {
+        context_program_option (ctx, "-DSCATTER");
+    }
+
+    if (prev->gradient_mem != 0) {
+        context_program_option (ctx, "-DCALC_GRADIENT");
+    }
+
+    context_program_file (ctx, "pool-layer.cl");
+    context_program_build (ctx, &pool->program);
+    context_program_kernel (ctx, "forward", &pool->forward);
+
+    if (prev->gradient_mem != 0) {
+        context_program_kernel (ctx, "backward", &pool->backward);
+    }
+
+    /*
+     * Mark compiled
+     */
+    lay->flags |= LAYER_FLAG_COMPILED;
+}
+
+static void
+forward (struct layer *lay)
+{
+    struct pool_layer *pool;
+    cl_kernel kern;
+
+    g_assert (lay->type == LAYER_POOL);
+    pool = (struct pool_layer *) lay;
+    kern = pool->forward;
+
+    layer_set_value_arg (lay->prev, kern, 0);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &lay->value_mem);
+
+    if (pool->index_mem != NULL) {
+        clSetKernelArg (kern, 2, sizeof (cl_mem), &pool->index_mem);
+    }
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        lay->batch * lay->size,
+                        UTIL_NONNULL (lay->prev->forward_barrier),
+                        UTIL_PTR_OR_NULL (lay->prev->forward_barrier),
+                        &lay->forward_barrier);
+}
+
+static void
+backward (struct layer *lay)
+{
+    struct pool_layer *pool;
+    cl_event dep, gradlist[2];
+    cl_kernel kern;
+    cl_int arg, gradcount;
+
+    g_assert (lay->type == LAYER_POOL);
+    pool = (struct pool_layer *) lay;
+    dep = layer_next_gradient (lay);
+
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+
+    /*
+     * Nothing to propagate, just pass the gradients' barrier
+     */
+    if (pool->backward == NULL) {
+        if (dep != NULL) {
+            clRetainEvent (dep);
+        }
+
+        lay->backward_barrier = dep;
+        return;
+    }
+
+    kern = pool->backward;
+    arg = 0;
+
+    clSetKernelArg (kern, arg++, sizeof (cl_mem), &lay->gradient_mem);
+
+    if (pool->index_mem != NULL) {
+        clSetKernelArg (kern, arg++, sizeof (cl_mem), &pool->index_mem);
+    }
+
+    clSetKernelArg (kern, arg++, sizeof (cl_mem), &lay->prev->gradient_mem);
+
+    /*
+     * Scatter runs over outputs, gather over inputs
+     */
+    gradcount = layer_propagate_wait_list (lay, dep, gradlist);
+
+    context_run_sparse (lay->net->ctx, kern,
+                        pool->pstride >= pool->psize
+                        ? lay->batch * lay->size
+                        : lay->batch * lay->prev->size,
+                        gradcount, gradlist,
+                        &lay->backward_barrier);
+
+    layer_propagate_done (lay, lay->backward_barrier);
+}
+
+static void
+release (struct layer *lay)
+{
+    struct pool_layer *pool;
+
+    g_assert (lay->type == LAYER_POOL);
+    pool = (struct pool_layer *) lay;
+
+    g_clear_pointer (&lay->forward_barrier, clReleaseEvent);
+    g_clear_pointer (&lay->backward_barrier, clReleaseEvent);
+
+    clReleaseKernel (pool->forward);
+    g_clear_pointer (&pool->backward, clReleaseKernel);
+    context_program_release (lay->net->ctx, pool->program);
+    clReleaseMemObject (lay->value_mem);
+    g_clear_pointer (&lay->gradient_mem, clReleaseMemObject);
+    g_clear_pointer (&pool->index_mem, clReleaseMemObject);
+}
@@ -0,0 +1,192 @@
+/*
+ * pool-layer.cl
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Values are stored as (y, x, z) volumes, samples of the batch one
+ * after another. Windows are always inside the input
+ */
+#define INPUT_SIZE (INPUT_WIDTH * INPUT_HEIGHT * DEPTH)
+#define OUTPUT_SIZE (WIDTH * HEIGHT * DEPTH)
+#define AREA (POOL_SIZE * POOL_SIZE)
+
+int input_index (const int batch, const int y, const int x, const int z)
+{
+    return batch * INPUT_SIZE + (y * INPUT_WIDTH + x) * DEPTH + z;
+}
+
+/*
+ * One work-item per output value, max pooling records the index
+ * of the chosen input for backward
+ */
+__kernel void forward (__global const float *input_value_v,
+                       __global float *value_v
+#ifdef WITH_INDICES
+                       , __global int *index_v
+#endif
+                       )
+{
+    __private int id, z, x, y, batch, xw, yw, i;
+#ifdef POOL_MAX
+    __private int best_id;
+    __private float best;
+#else
+    __private float sum;
+#endif
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * OUTPUT_SIZE) {
+        return;
+    }
+
+    z = id % DEPTH;
+    x = id / DEPTH % WIDTH;
+    y = id / DEPTH / WIDTH % HEIGHT;
+    batch = id / OUTPUT_SIZE;
+
+#ifdef POOL_MAX
+    best_id = input_index (batch, y * POOL_STRIDE, x * POOL_STRIDE, z);
+    best = input_value_v[best_id];
+
+    for (yw = 0; yw < POOL_SIZE; yw++) {
+        for (xw = 0; xw < POOL_SIZE; xw++) {
+            i = input_index (batch,
+                             y * POOL_STRIDE + yw,
+                             x * POOL_STRIDE + xw,
+                             z);
+
+            if (input_value_v[i] > best) {
+                best = input_value_v[i];
+                best_id = i;
+            }
+        }
+    }
+
+    value_v[id] = best;
+#ifdef WITH_INDICES
+    index_v[id] = best_id;
+#endif
+#else
+    sum = 0;
+
+    for (yw = 0; yw < POOL_SIZE; yw++) {
+        for (xw = 0; xw < POOL_SIZE; xw++) {
+            i = input_index (batch,
+                             y * POOL_STRIDE + yw,
+                             x * POOL_STRIDE + xw,
+                             z);
+            sum += input_value_v[i];
+        }
+    }
+
+    value_v[id] = sum / AREA;
+#endif
+}
+
+#ifdef CALC_GRADIENT
+#ifdef SCATTER
+/*
+ * Windows don't overlap, so each output scatters its gradient to
+ * its window without races. One work-item per output value
+ */
+__kernel void backward (__global const float *gradient_v,
+#ifdef WITH_INDICES
+                        __global const int *index_v,
+#endif
+                        __global float *input_gradient_v)
+{
+    __private int id;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * OUTPUT_SIZE) {
+        return;
+    }
+
+#ifdef POOL_MAX
+    input_gradient_v[index_v[id]] += gradient_v[id];
+#else
+    __private int z, x, y, batch, xw, yw;
+
+    z = id % DEPTH;
+    x = id / DEPTH % WIDTH;
+    y = id / DEPTH / WIDTH % HEIGHT;
+    batch = id / OUTPUT_SIZE;
+
+    for (yw = 0; yw < POOL_SIZE; yw++) {
+        for (xw = 0; xw < POOL_SIZE; xw++) {
+            input_gradient_v[input_index (batch,
+                                          y * POOL_STRIDE + yw,
+                                          x * POOL_STRIDE + xw,
+                                          z)] += gradient_v[id] / AREA;
+        }
+    }
+#endif
+}
+#else
+/*
+ * Windows overlap, so each input gathers gradients of all windows
+ * covering it. One work-item per input value
+ */
+__kernel void backward (__global const float *gradient_v,
+#ifdef WITH_INDICES
+                        __global const int *index_v,
+#endif
+                        __global float *input_gradient_v)
+{
+    __private int id, z, ix, iy, batch, x, y, xlo, ylo, xhi, yhi, o;
+    __private float sum;
+
+    id = get_global_id (0);
+
+    if (id >= BATCH * INPUT_SIZE) {
+        return;
+    }
+
+    z = id % DEPTH;
+    ix = id / DEPTH % INPUT_WIDTH;
+    iy = id / DEPTH / INPUT_WIDTH % INPUT_HEIGHT;
+    batch = id / INPUT_SIZE;
+
+    xlo = ix >= POOL_SIZE ? (ix - POOL_SIZE) / POOL_STRIDE + 1 : 0;
+    ylo = iy >= POOL_SIZE ? (iy - POOL_SIZE) / POOL_STRIDE + 1 : 0;
+    xhi = min (ix / POOL_STRIDE, WIDTH - 1);
+    yhi = min (iy / POOL_STRIDE, HEIGHT - 1);
+    sum = 0;
+
+    for (y = ylo; y <= yhi; y++) {
+        for (x = xlo; x <= xhi; x++) {
+            o = batch * OUTPUT_SIZE + (y * WIDTH + x) * DEPTH + z;
+
+#ifdef POOL_MAX
+            if (index_v[o] == id) {
+                sum += gradient_v[o];
+            }
+#else
+            sum += gradient_v[o] / AREA;
+#endif
+        }
+    }
+
+    input_gradient_v[id] += sum;
+}
+#endif
+#endif
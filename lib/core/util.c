@@ -37,6 +37,20 @@ util_upper_power_2 (int v)
     return p2;
 }
 
+int
+util_lower_power_2 (int v)
+{
+    int p2;
+
+    p2 = 1;
+
+    while (p2 * 2 <= v) {
+        p2 *= 2;
+    }
+
+    return p2;
+}
+
 int
 util_upper_multiply (int v, int g)
 {
@@ -25,4 +25,5 @@
 #define UTIL_PTR_OR_NULL(r) (((r) != NULL) ? &(r) : NULL)
 
 int util_upper_power_2 (int v);
+int util_lower_power_2 (int v);
 int util_upper_multiply (int v, int g);
@@ -30,8 +30,10 @@ typedef struct {
     gint width;
     gint depth;
     gint size;
+    gboolean host_mapped;
 
     gfloat *data;
+    gfloat *mapping;
     cl_mem mem;
     cl_event event;
     cl_int evcount;
@@ -48,6 +50,7 @@ enum
     PROP_WIDTH,
     PROP_DEPTH,
     PROP_SIZE,
+    PROP_HOST_MAPPED,
     N_PROPS,
 };
 
@@ -139,6 +142,16 @@ gann_buffer_class_init (GannBufferClass *cls)
                           G_PARAM_READABLE |
                           G_PARAM_STATIC_STRINGS);
 
+    props[PROP_HOST_MAPPED] =
+        g_param_spec_boolean ("host-mapped",
+                              "Host mapped",
+                              "Allocated in host accessible memory "
+                              "to be written through mapping",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY |
+                              G_PARAM_STATIC_STRINGS);
+
     g_object_class_install_properties (gcls, N_PROPS, props);
 }
 
@@ -147,6 +160,7 @@ constructed (GObject *gobj)
 {
     GannBuffer *self = GANN_BUFFER (gobj);
     GannBufferPrivate *p = gann_buffer_get_instance_private (self);
+    cl_mem_flags flags;
 	cl_int err;
 
     if (p->element_type == G_TYPE_FLOAT) {
@@ -157,8 +171,14 @@ constructed (GObject *gobj)
 
     p->size = p->height * p->width * p->depth;
 	p->data = g_new (gfloat, p->size);
+    flags = CL_MEM_READ_WRITE;
+
+    if (p->host_mapped) {
+        flags |= CL_MEM_ALLOC_HOST_PTR;
+    }
+
 	p->mem = clCreateBuffer (gann_context_cl_context (p->context),
-							 CL_MEM_READ_WRITE,
+							 flags,
 							 p->size * p->element_size,
 							 NULL, &err);
 	g_assert (err == 0);
@@ -175,6 +195,11 @@ finalize (GObject *gobj)
     GannBuffer *self = GANN_BUFFER (gobj);
     GannBufferPrivate *p = gann_buffer_get_instance_private (self);
 
+    if (p->mapping != NULL) {
+        clEnqueueUnmapMemObject (gann_context_cl_queue (p->context),
+                                 p->mem, p->mapping, 0, NULL, NULL);
+    }
+
 	g_clear_pointer (&p->data, g_free);
     g_clear_pointer (&p->event, clReleaseEvent);
     g_clear_object (&p->context);
@@ -210,6 +235,10 @@ set_property (GObject *gobj, guint propid,
         p->depth = g_value_get_int (value);
         break;
 
+    case PROP_HOST_MAPPED:
+        p->host_mapped = g_value_get_boolean (value);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
     }
@@ -251,6 +280,10 @@ get_property (GObject *gobj, guint propid,
         g_value_set_int (value, p->size);
         break;
 
+    case PROP_HOST_MAPPED:
+        g_value_set_boolean (value, p->host_mapped);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
     }
@@ -396,6 +429,67 @@ gann_buffer_read (GannBuffer *self,
     return p->data;
 }
 
+/**
+ * gann_buffer_map:
+ * @offset: first element to map
+ * @count: number of elements to map
+ *
+ * Maps the buffer region for writing in place, it's not used by
+ * the device until gann_buffer_unmap is called. Saves copying if
+ * the buffer is host mapped
+ *
+ * returns: (transfer none): pointer to mapped elements
+ */
+gfloat *
+gann_buffer_map (GannBuffer *self,
+                 gint offset,
+                 gint count)
+{
+    GannBufferPrivate *p;
+    const cl_event *evlist;
+    cl_int err;
+
+    p = gann_buffer_get_instance_private (self);
+    evlist = p->evcount > 0 ? p->evlist : NULL;
+
+    g_assert (p->mapping == NULL);
+    g_assert (offset + count <= p->size);
+
+    p->mapping = clEnqueueMapBuffer (gann_context_cl_queue (p->context),
+                                     p->mem,
+                                     CL_TRUE,
+                                     CL_MAP_WRITE_INVALIDATE_REGION,
+                                     offset * p->element_size,
+                                     count * p->element_size,
+                                     p->evcount, evlist, NULL, &err);
+    g_assert (err == CL_SUCCESS);
+
+    return p->mapping;
+}
+
+/**
+ * gann_buffer_unmap:
+ *
+ * Unmaps the region mapped by gann_buffer_map
+ */
+void
+gann_buffer_unmap (GannBuffer *self)
+{
+    GannBufferPrivate *p = gann_buffer_get_instance_private (self);
+    cl_int err;
+
+    g_assert (p->mapping != NULL);
+
+    g_clear_pointer (&p->event, clReleaseEvent);
+
+    err = clEnqueueUnmapMemObject (gann_context_cl_queue (p->context),
+                                   p->mem, p->mapping,
+                                   0, NULL, &p->event);
+    g_assert (err == CL_SUCCESS);
+
+    p->mapping = NULL;
+}
+
 void
 gann_buffer_clear (GannBuffer *self)
 {
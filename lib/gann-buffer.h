@@ -58,5 +58,9 @@ const gfloat *gann_buffer_read (GannBuffer *self,
                                 gint offset,
                                 gint count,
                                 gsize *size);
+gfloat *gann_buffer_map (GannBuffer *self,
+                         gint offset,
+                         gint count);
+void gann_buffer_unmap (GannBuffer *self);
 
 G_END_DECLS
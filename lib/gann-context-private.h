@@ -33,5 +33,9 @@ const gchar *gann_context_code (GannContext *self,
                                 const gchar *filename);
 const gchar *gann_context_activation (GannContext *self,
                                       const gchar *name);
+cl_program gann_context_build_program (GannContext *self,
+                                       gint count,
+                                       const gchar **sources,
+                                       const gchar *options);
 
 G_END_DECLS
@@ -28,12 +28,33 @@ struct _GannContext
     GObject parent_instance;
     struct context *core;
     GSList *networks;
+    gchar *device;
 };
 
 G_DEFINE_TYPE (GannContext, gann_context, G_TYPE_OBJECT);
 
+enum
+{
+    PROP_0,
+    PROP_DEVICE,
+    PROP_DEVICE_NAME,
+    PROP_GROUP_SIZE,
+    PROP_CACHE_HITS,
+    PROP_CACHE_MISSES,
+    PROP_PROGRAMS_SHARED,
+    PROP_OUT_OF_ORDER,
+    N_PROPS,
+};
+
+static GParamSpec *props[N_PROPS];
+
 static void dispose (GObject *gobj);
+static void finalize (GObject *gobj);
 static void constructed (GObject *gobj);
+static void set_property (GObject *gobj, guint propid,
+                          const GValue *value, GParamSpec *spec);
+static void get_property (GObject *gobj, guint propid,
+                          GValue *value, GParamSpec *spec);
 
 static void
 gann_context_init (GannContext *self)
@@ -47,7 +68,73 @@ gann_context_class_init (GannContextClass *cls)
     GObjectClass *gcls = G_OBJECT_CLASS (cls);
 
     gcls->dispose = dispose;
+    gcls->finalize = finalize;
     gcls->constructed = constructed;
+    gcls->set_property = set_property;
+    gcls->get_property = get_property;
+
+    props[PROP_DEVICE] =
+        g_param_spec_string ("device",
+                             "Device",
+                             "Device specification like \"gpu\", "
+                             "\"cpu\" or \"0:1\", NULL to use "
+                             "GANN_DEVICE environment variable",
+                             NULL,
+                             G_PARAM_READWRITE |
+                             G_PARAM_CONSTRUCT_ONLY |
+                             G_PARAM_STATIC_STRINGS);
+
+    props[PROP_DEVICE_NAME] =
+        g_param_spec_string ("device-name",
+                             "Device name",
+                             "Name of the selected device",
+                             NULL,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS);
+
+    props[PROP_GROUP_SIZE] =
+        g_param_spec_int ("group-size",
+                          "Group size",
+                          "Work-group size picked for the device",
+                          1, G_MAXINT32, 1,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_CACHE_HITS] =
+        g_param_spec_int ("cache-hits",
+                          "Cache hits",
+                          "Programs loaded from the binary cache",
+                          0, G_MAXINT32, 0,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_CACHE_MISSES] =
+        g_param_spec_int ("cache-misses",
+                          "Cache misses",
+                          "Programs built from the source",
+                          0, G_MAXINT32, 0,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_PROGRAMS_SHARED] =
+        g_param_spec_int ("programs-shared",
+                          "Programs shared",
+                          "Builds avoided by reusing a program",
+                          0, G_MAXINT32, 0,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_OUT_OF_ORDER] =
+        g_param_spec_boolean ("out-of-order",
+                              "Out of order",
+                              "Whether tasks run as soon as the ones "
+                              "they depend on are done, stays FALSE "
+                              "if the device doesn't support it",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties (gcls, N_PROPS, props);
 }
 
 static void
@@ -60,22 +147,116 @@ dispose (GObject *gobj)
     G_OBJECT_CLASS (gann_context_parent_class)->dispose (gobj);
 }
 
+static void
+finalize (GObject *gobj)
+{
+    GannContext *self = GANN_CONTEXT (gobj);
+
+    g_clear_pointer (&self->device, g_free);
+
+    G_OBJECT_CLASS (gann_context_parent_class)->finalize (gobj);
+}
+
 static void
 constructed (GObject *gobj)
 {
     GannContext *self = GANN_CONTEXT (gobj);
 
-    self->core = context_create ();
+    if (self->device != NULL) {
+        self->core = context_create_for_spec (self->device);
+    } else {
+        self->core = context_create ();
+    }
 
     G_OBJECT_CLASS (gann_context_parent_class)->constructed (gobj);
 }
 
+static void
+set_property (GObject *gobj,
+              guint propid,
+              const GValue *value,
+              GParamSpec *spec)
+{
+    GannContext *self = GANN_CONTEXT (gobj);
+
+    switch (propid) {
+    case PROP_DEVICE:
+        g_clear_pointer (&self->device, g_free);
+        self->device = g_value_dup_string (value);
+        break;
+
+    case PROP_OUT_OF_ORDER:
+        gann_context_set_out_of_order (self, g_value_get_boolean (value));
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static void
+get_property (GObject *gobj,
+              guint propid,
+              GValue *value,
+              GParamSpec *spec)
+{
+    GannContext *self = GANN_CONTEXT (gobj);
+
+    switch (propid) {
+    case PROP_DEVICE:
+        g_value_set_string (value, self->device);
+        break;
+
+    case PROP_DEVICE_NAME:
+        g_value_set_string (value, gann_context_get_device_name (self));
+        break;
+
+    case PROP_GROUP_SIZE:
+        g_value_set_int (value, self->core->group_size);
+        break;
+
+    case PROP_CACHE_HITS:
+        g_value_set_int (value, self->core->cache_hits);
+        break;
+
+    case PROP_CACHE_MISSES:
+        g_value_set_int (value, self->core->cache_misses);
+        break;
+
+    case PROP_PROGRAMS_SHARED:
+        g_value_set_int (value, self->core->programs_shared);
+        break;
+
+    case PROP_OUT_OF_ORDER:
+        g_value_set_boolean (value, gann_context_get_out_of_order (self));
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
 GannContext *
 gann_context_new ()
 {
     return g_object_new (GANN_TYPE_CONTEXT, NULL);
 }
 
+/**
+ * gann_context_new_for_device:
+ * @device: (nullable): device specification like "gpu", "cpu",
+ * "gpu|accelerator" or "0:1" for platform and device indices
+ *
+ * returns: (transfer full): New context instance
+ */
+GannContext *
+gann_context_new_for_device (const gchar *device)
+{
+    return g_object_new (GANN_TYPE_CONTEXT,
+                         "device", device,
+                         NULL);
+}
+
 void
 gann_context_add_network (GannContext *self,
                           GannNetwork *network)
@@ -96,6 +277,44 @@ gann_context_get_core (GannContext *self)
     return self->core;
 }
 
+/**
+ * gann_context_get_device_name:
+ *
+ * returns: (transfer none): Name of the selected device
+ */
+const gchar *
+gann_context_get_device_name (GannContext *self)
+{
+    return self->core->device_name;
+}
+
+/**
+ * gann_context_set_out_of_order:
+ * @enable: whether to execute out of order
+ *
+ * Switches between in-order and out-of-order execution, tasks
+ * already enqueued are finished first
+ */
+void
+gann_context_set_out_of_order (GannContext *self,
+                               gboolean enable)
+{
+    gboolean old;
+
+    old = context_out_of_order (self->core);
+
+    if (context_set_out_of_order (self->core, enable) != old) {
+        g_object_notify_by_pspec (G_OBJECT (self),
+                                  props[PROP_OUT_OF_ORDER]);
+    }
+}
+
+gboolean
+gann_context_get_out_of_order (GannContext *self)
+{
+    return context_out_of_order (self->core);
+}
+
 /***************
  * PRIVATE API *
  ***************/
@@ -131,3 +350,12 @@ gann_context_activation (GannContext *self,
 {
     return name;
 }
+
+cl_program
+gann_context_build_program (GannContext *self,
+                            gint count,
+                            const gchar **sources,
+                            const gchar *options)
+{
+    return context_build_program (self->core, count, sources, options);
+}
@@ -39,10 +39,15 @@ G_DECLARE_FINAL_TYPE (GannContext, gann_context,
  * returns: (transfer full): New context instance
  */
 GannContext *gann_context_new ();
+GannContext *gann_context_new_for_device (const gchar *device);
 void gann_context_add_network (GannContext *self,
                                GannNetwork *network);
 void gann_context_remove_network (GannContext *self,
                                   GannNetwork *network);
 struct context *gann_context_get_core (GannContext *self);
+const gchar *gann_context_get_device_name (GannContext *self);
+void gann_context_set_out_of_order (GannContext *self,
+                                    gboolean enable);
+gboolean gann_context_get_out_of_order (GannContext *self);
 
 G_END_DECLS
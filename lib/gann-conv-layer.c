@@ -33,6 +33,10 @@ struct _GannConvLayer
     gint xshift;
     gint yshift;
 
+    GannPadding padding;
+    gint xpad;
+    gint ypad;
+
     gfloat *filterdata;
     gsize filtersize;
 };
@@ -45,6 +49,9 @@ enum
     PROP_KERNEL_WIDTH,
     PROP_KERNEL_HEIGHT,
     PROP_KERNEL_STRIDE,
+    PROP_PADDING,
+    PROP_PADDING_X,
+    PROP_PADDING_Y,
     N_PROPS,
 };
 
@@ -57,6 +64,28 @@ static void get_property (GObject *gobj, guint propid,
 static void finalize (GObject *gobj);
 static void constructed (GObject *gobj);
 static void compile (GannLayer *layer);
+static gint output_size (GannPadding padding,
+                         gint input, gint kernel, gint stride,
+                         gint pad, gint *shift);
+
+GType
+gann_padding_get_type (void)
+{
+    static const GEnumValue values[] = {
+        { GANN_PADDING_SAME, "GANN_PADDING_SAME", "same" },
+        { GANN_PADDING_VALID, "GANN_PADDING_VALID", "valid" },
+        { GANN_PADDING_EXPLICIT, "GANN_PADDING_EXPLICIT", "explicit" },
+        { 0, NULL, NULL },
+    };
+    static gsize type;
+
+    if (g_once_init_enter (&type)) {
+        g_once_init_leave (&type,
+                           g_enum_register_static ("GannPadding", values));
+    }
+
+    return type;
+}
 
 static void
 gann_conv_layer_init (GannConvLayer *self)
@@ -103,6 +132,31 @@ gann_conv_layer_class_init (GannConvLayerClass *cls)
                           G_PARAM_CONSTRUCT_ONLY |
                           G_PARAM_STATIC_STRINGS);
 
+    props[PROP_PADDING] =
+        g_param_spec_enum ("padding",
+                           "Padding",
+                           "Padding mode",
+                           GANN_TYPE_PADDING,
+                           GANN_PADDING_SAME,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS);
+
+    props[PROP_PADDING_X] =
+        g_param_spec_int ("padding-x",
+                          "Padding X",
+                          "Horizontal padding of explicit mode",
+                          0, G_MAXINT32, 0,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_PADDING_Y] =
+        g_param_spec_int ("padding-y",
+                          "Padding Y",
+                          "Vertical padding of explicit mode",
+                          0, G_MAXINT32, 0,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS);
+
     g_object_class_install_properties (gcls, N_PROPS, props);
 }
 
@@ -127,6 +181,18 @@ set_property (GObject *gobj,
         self->kernel_stride = g_value_get_int (value);
         break;
 
+    case PROP_PADDING:
+        self->padding = g_value_get_enum (value);
+        break;
+
+    case PROP_PADDING_X:
+        self->xpad = g_value_get_int (value);
+        break;
+
+    case PROP_PADDING_Y:
+        self->ypad = g_value_get_int (value);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
     }
@@ -153,6 +219,18 @@ get_property (GObject *gobj,
         g_value_set_int (value, self->kernel_stride);
         break;
 
+    case PROP_PADDING:
+        g_value_set_enum (value, self->padding);
+        break;
+
+    case PROP_PADDING_X:
+        g_value_set_int (value, self->xpad);
+        break;
+
+    case PROP_PADDING_Y:
+        g_value_set_int (value, self->ypad);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
     }
@@ -181,6 +259,19 @@ compile (GannLayer *layer)
     g_assert_nonnull (prev);
 
     g_message ("compiled conv");
+    g_object_set (self,
+                  "width", output_size (self->padding,
+                                        gann_layer_get_width (prev),
+                                        self->kernel_width,
+                                        self->kernel_stride,
+                                        self->xpad, &self->xshift),
+                  "height", output_size (self->padding,
+                                         gann_layer_get_height (prev),
+                                         self->kernel_height,
+                                         self->kernel_stride,
+                                         self->ypad, &self->yshift),
+                  NULL);
+
     self->filtersize = self->kernel_width * self->kernel_height
                      * gann_layer_get_depth (layer)
                      * gann_layer_get_depth (prev);
@@ -248,3 +339,68 @@ gann_conv_layer_get_kernel_stride (GannConvLayer *self)
 {
     return self->kernel_stride;
 }
+
+/**
+ * gann_conv_layer_set_padding:
+ * @padding: padding mode
+ * @xpad: horizontal padding on each side, used by explicit mode
+ * @ypad: vertical padding on each side, used by explicit mode
+ *
+ * Sets padding mode, has to be called before the layer is compiled
+ */
+void
+gann_conv_layer_set_padding (GannConvLayer *self,
+                             GannPadding padding,
+                             gint xpad,
+                             gint ypad)
+{
+    g_object_set (self,
+                  "padding", padding,
+                  "padding-x", xpad,
+                  "padding-y", ypad,
+                  NULL);
+}
+
+/**
+ * gann_conv_layer_get_padding:
+ *
+ * returns: padding mode
+ */
+GannPadding
+gann_conv_layer_get_padding (GannConvLayer *self)
+{
+    return self->padding;
+}
+
+static gint
+output_size (GannPadding padding,
+             gint input, gint kernel, gint stride,
+             gint pad, gint *shift)
+{
+    gint output;
+
+    switch (padding) {
+    case GANN_PADDING_SAME:
+        output = (input + stride - 1) / stride;
+        pad = MAX ((output - 1) * stride + kernel - input, 0);
+        *shift = -pad / 2;
+        break;
+
+    case GANN_PADDING_VALID:
+        output = (input - kernel) / stride + 1;
+        *shift = 0;
+        break;
+
+    case GANN_PADDING_EXPLICIT:
+        output = (input + 2 * pad - kernel) / stride + 1;
+        *shift = -pad;
+        break;
+
+    default:
+        g_assert_not_reached ();
+    }
+
+    g_assert (output > 0);
+
+    return output;
+}
@@ -26,6 +26,22 @@
 G_BEGIN_DECLS
 
 #define GANN_TYPE_CONV_LAYER (gann_conv_layer_get_type ())
+#define GANN_TYPE_PADDING (gann_padding_get_type ())
+
+/**
+ * GannPadding:
+ * @GANN_PADDING_SAME: output has ceil (input / stride) values
+ * @GANN_PADDING_VALID: no padding, filters stay inside the input
+ * @GANN_PADDING_EXPLICIT: padding-x and padding-y zeros on each side
+ */
+typedef enum
+{
+    GANN_PADDING_SAME,
+    GANN_PADDING_VALID,
+    GANN_PADDING_EXPLICIT,
+} GannPadding;
+
+GType gann_padding_get_type (void);
 
 G_DECLARE_FINAL_TYPE (GannConvLayer, gann_conv_layer,
                       GANN, CONV_LAYER, GannLayer);
@@ -38,5 +54,10 @@ GannConvLayer *gann_conv_layer_new (GannNetwork *network,
 gint gann_conv_layer_get_kernel_width (GannConvLayer *self);
 gint gann_conv_layer_get_kernel_height (GannConvLayer *self);
 gint gann_conv_layer_get_stride (GannConvLayer *self);
+void gann_conv_layer_set_padding (GannConvLayer *self,
+                                  GannPadding padding,
+                                  gint xpad,
+                                  gint ypad);
+GannPadding gann_conv_layer_get_padding (GannConvLayer *self);
 
 G_END_DECLS
@@ -25,12 +25,39 @@
 
 struct _GannInputLayer
 {
-    GObject parent_instance;
+    GannLayer parent_instance;
+
+    gboolean mapped;
+
+    /*
+     * Ring of value buffers, samples are written to the slot
+     * following the pending ones and forward moves to the next
+     * pending slot
+     */
+    gint ring_depth;
+    gint current;
+    gint pending;
+    GPtrArray *ring;
+};
+
+enum
+{
+    PROP_0,
+    PROP_MAPPED,
+    PROP_RING_DEPTH,
+    N_PROPS,
 };
 
+static GParamSpec *props[N_PROPS];
+
 static void dispose (GObject *gobj);
 static void constructed (GObject *gobj);
 static void finalize (GObject *gobj);
+static void set_property (GObject *gobj, guint propid,
+                          const GValue *value, GParamSpec *spec);
+static void get_property (GObject *gobj, guint propid,
+                          GValue *value, GParamSpec *spec);
+static GannBuffer *value_buffer (GannLayer *layer);
 static void forward (GannLayer *layer);
 static void backward (GannLayer *layer);
 static void compile (GannLayer *layer);
@@ -48,6 +75,7 @@ G_DEFINE_TYPE_WITH_CODE (GannInputLayer, gann_input_layer,
 static void
 gann_input_layer_init (GannInputLayer *self)
 {
+    self->ring_depth = 1;
 }
 
 static void
@@ -59,15 +87,44 @@ gann_input_layer_class_init (GannInputLayerClass *cls)
     gcls->dispose = dispose;
     gcls->constructed = constructed;
     gcls->finalize = finalize;
+    gcls->set_property = set_property;
+    gcls->get_property = get_property;
 
     lcls->forward = forward;
     lcls->backward = backward;
     lcls->compile = compile;
+    lcls->value_buffer = value_buffer;
+
+    props[PROP_MAPPED] =
+        g_param_spec_boolean ("mapped",
+                              "Mapped",
+                              "Values are kept in host accessible memory "
+                              "and written in place",
+                              FALSE,
+                              G_PARAM_READWRITE |
+                              G_PARAM_CONSTRUCT_ONLY |
+                              G_PARAM_STATIC_STRINGS);
+
+    props[PROP_RING_DEPTH] =
+        g_param_spec_int ("ring-depth",
+                          "Ring depth",
+                          "Number of value buffers, samples may be set "
+                          "that many forward steps ahead",
+                          1, G_MAXINT16, 1,
+                          G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT_ONLY |
+                          G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties (gcls, N_PROPS, props);
 }
 
 static void
 dispose (GObject *gobj)
 {
+    GannInputLayer *self = GANN_INPUT_LAYER (gobj);
+
+    g_clear_pointer (&self->ring, g_ptr_array_unref);
+
     /* allocated data block is freed by core layer */
     G_OBJECT_CLASS (gann_input_layer_parent_class)->dispose (gobj);
 }
@@ -84,9 +141,110 @@ finalize (GObject *gobj)
     G_OBJECT_CLASS (gann_input_layer_parent_class)->finalize (gobj);
 }
 
+static void
+set_property (GObject *gobj,
+              guint propid,
+              const GValue *value,
+              GParamSpec *spec)
+{
+    GannInputLayer *self = GANN_INPUT_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_MAPPED:
+        self->mapped = g_value_get_boolean (value);
+        break;
+
+    case PROP_RING_DEPTH:
+        self->ring_depth = g_value_get_int (value);
+        self->current = self->ring_depth - 1;
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static void
+get_property (GObject *gobj,
+              guint propid,
+              GValue *value,
+              GParamSpec *spec)
+{
+    GannInputLayer *self = GANN_INPUT_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_MAPPED:
+        g_value_set_boolean (value, self->mapped);
+        break;
+
+    case PROP_RING_DEPTH:
+        g_value_set_int (value, self->ring_depth);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static GannBuffer *
+ring_buffer (GannInputLayer *self,
+             gint slot)
+{
+    GannLayer *layer = GANN_LAYER (self);
+    GannBuffer *buff;
+    gint i;
+
+    if (self->ring == NULL) {
+        self->ring = g_ptr_array_new_with_free_func (g_object_unref);
+
+        for (i = 0; i < self->ring_depth; i++) {
+            buff = g_object_new (GANN_TYPE_BUFFER,
+                                 "context", gann_layer_get_context (layer),
+                                 "element-type", G_TYPE_FLOAT,
+                                 "height", gann_layer_get_height (layer)
+                                           * gann_layer_get_batch (layer),
+                                 "width", gann_layer_get_width (layer),
+                                 "depth", gann_layer_get_depth (layer),
+                                 "host-mapped", self->mapped,
+                                 NULL);
+            g_ptr_array_add (self->ring, buff);
+        }
+    }
+
+    return g_ptr_array_index (self->ring, slot);
+}
+
+static GannBuffer *
+next_buffer (GannInputLayer *self)
+{
+    g_return_val_if_fail (self->pending < self->ring_depth, NULL);
+
+    return ring_buffer (self, (self->current + 1 + self->pending)
+                              % self->ring_depth);
+}
+
+static GannBuffer *
+value_buffer (GannLayer *layer)
+{
+    GannInputLayer *self = GANN_INPUT_LAYER (layer);
+
+    return ring_buffer (self, self->current);
+}
+
 static void
 forward (GannLayer *layer)
 {
+    GannInputLayer *self = GANN_INPUT_LAYER (layer);
+
+    /*
+     * Move to the next written slot, without new samples
+     * the current ones are propagated again
+     */
+    if (self->pending > 0) {
+        self->current = (self->current + 1) % self->ring_depth;
+        self->pending--;
+    }
+
     GANN_LAYER_CLASS (gann_input_layer_parent_class)->forward (layer);
 }
 
@@ -143,7 +301,7 @@ gann_input_layer_new (GannNetwork *network,
 
 /**
  * gann_input_layer_set_data:
- * @data: (array length=size): float array
+ * @data: (array length=size): float array of the batch size samples
  */
 void
 gann_input_layer_set_data (GannInputLayer *self,
@@ -154,10 +312,78 @@ gann_input_layer_set_data (GannInputLayer *self,
 	GannBuffer *buff;
 
     layer = GANN_LAYER (self);
-	buff = gann_layer_value_buffer (layer);
-    g_assert (size == gann_layer_get_size (layer));
+	buff = next_buffer (self);
+    g_assert (size == gann_layer_get_size (layer)
+              * gann_layer_get_batch (layer));
+
+    if (self->mapped) {
+        memcpy (gann_buffer_map (buff, 0, size), data,
+                size * sizeof (gfloat));
+        gann_buffer_unmap (buff);
+    } else {
+        gann_buffer_write (buff, 0, data, size);
+    }
+
+    self->pending++;
+}
+
+/**
+ * gann_input_layer_map_data:
+ *
+ * Maps values of a mapped layer for writing the whole batch in
+ * place, they're used by the network after
+ * gann_input_layer_unmap_data
+ *
+ * returns: (transfer none): pointer to the batch size times the
+ * layer size values
+ */
+gfloat *
+gann_input_layer_map_data (GannInputLayer *self)
+{
+    GannLayer *layer;
+
+    layer = GANN_LAYER (self);
+    g_return_val_if_fail (self->mapped, NULL);
 
-	gann_buffer_write (buff, 0, data, size);
+    return gann_buffer_map (next_buffer (self), 0,
+                            gann_layer_get_batch (layer)
+                            * gann_layer_get_size (layer));
+}
+
+/**
+ * gann_input_layer_unmap_data:
+ *
+ * Unmaps values mapped by gann_input_layer_map_data
+ */
+void
+gann_input_layer_unmap_data (GannInputLayer *self)
+{
+    g_return_if_fail (self->mapped);
+
+    gann_buffer_unmap (next_buffer (self));
+    self->pending++;
+}
+
+/**
+ * gann_input_layer_get_ring_depth:
+ *
+ * returns: number of value buffers
+ */
+gint
+gann_input_layer_get_ring_depth (GannInputLayer *self)
+{
+    return self->ring_depth;
+}
+
+/**
+ * gann_input_layer_get_mapped:
+ *
+ * returns: whether values are written in place
+ */
+gboolean
+gann_input_layer_get_mapped (GannInputLayer *self)
+{
+    return self->mapped;
 }
 
 /**
@@ -43,4 +43,12 @@ void gann_input_layer_set_data_bytes (GannInputLayer *self,
                                       const guint8 *data,
                                       gint size);
 
+gfloat *gann_input_layer_map_data (GannInputLayer *self);
+
+void gann_input_layer_unmap_data (GannInputLayer *self);
+
+gboolean gann_input_layer_get_mapped (GannInputLayer *self);
+
+gint gann_input_layer_get_ring_depth (GannInputLayer *self);
+
 G_END_DECLS
@@ -63,6 +63,7 @@ enum
     PROP_HEIGHT,
     PROP_DEPTH,
 	PROP_SIZE,
+    PROP_BATCH,
     PROP_ACTIVATION,
     PROP_PROPAGATED,
     PROP_COMPILED,
@@ -159,6 +160,14 @@ gann_layer_class_init (GannLayerClass *cls)
 						  G_PARAM_READWRITE |
 						  G_PARAM_STATIC_STRINGS);
 
+    props[PROP_BATCH] =
+        g_param_spec_int ("batch",
+                          "Batch",
+                          "Number of samples, taken from the network",
+                          1, G_MAXINT32, 1,
+                          G_PARAM_READABLE |
+                          G_PARAM_STATIC_STRINGS);
+
     props[PROP_ACTIVATION] =
         g_param_spec_string ("activation",
                              "Activation",
@@ -346,6 +355,10 @@ get_property (GObject *gobj,
 		g_value_set_int (value, p->size);
 		break;
 
+    case PROP_BATCH:
+        g_value_set_int (value, gann_layer_get_batch (self));
+        break;
+
     case PROP_ACTIVATION:
         g_value_set_string (value, p->activation);
         break;
@@ -402,7 +415,7 @@ value_buffer (GannLayer *self)
 	if (p->value_buffer == NULL) {
 		p->value_buffer = gann_buffer_new (p->context,
 										   G_TYPE_FLOAT,
-										   p->height,
+										   p->height * gann_layer_get_batch (self),
 										   p->width,
 										   p->depth);
 	}
@@ -418,7 +431,7 @@ gradient_buffer (GannLayer *self G_GNUC_UNUSED)
 	if (p->gradient_buffer == NULL) {
 		p->gradient_buffer = gann_buffer_new (p->context,
 											  G_TYPE_FLOAT,
-											  p->height,
+											  p->height * gann_layer_get_batch (self),
 											  p->width,
 											  p->depth);
 	}
@@ -626,7 +639,7 @@ gann_layer_get_data_bytes (GannLayer *self,
     values = gann_layer_get_data (self, size);
 
     if (p->bytes_buff == NULL) {
-        p->bytes_buff = g_new (guint8, p->size);
+        p->bytes_buff = g_new (guint8, p->size * gann_layer_get_batch (self));
     }
 
     for (i = 0; i < *size; i++) {
@@ -708,6 +721,19 @@ gann_layer_get_size (GannLayer *self)
 	return p->size;
 }
 
+/**
+ * gann_layer_get_batch:
+ *
+ * returns: number of samples propagated at once, samples are
+ * stacked along the height of value and gradient buffers
+ */
+gint
+gann_layer_get_batch (GannLayer *self)
+{
+	GannLayerPrivate *p = gann_layer_get_instance_private (self);
+	return gann_network_get_batch_size (p->network);
+}
+
 /**
  * gann_layer_get_activation:
  *
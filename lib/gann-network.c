@@ -25,6 +25,7 @@
 #include "gann-output-layer.h"
 #include "gann-dense-layer.h"
 #include "gann-conv-layer.h"
+#include "gann-pool-layer.h"
 #include "gann-context.h"
 
 #include "core/core.h"
@@ -35,8 +36,12 @@ typedef struct {
     GPtrArray *layer_arr;
     GSList *output_list;
     GSList *propagation_list;
-    gfloat avg_loss;
+    guint loss_serial;
     gboolean compiled;
+    gboolean compiling;
+
+    /* deferred build session of the compile in progress */
+    struct build *build;
 } GannNetworkPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (GannNetwork, gann_network, G_TYPE_OBJECT);
@@ -48,9 +53,11 @@ enum
     PROP_RATE,
     PROP_MOMENTUM,
     PROP_DECAY,
+    PROP_BATCH_SIZE,
     PROP_LAYER_COUNT,
     PROP_LOSS,
     PROP_AVERAGE_LOSS,
+    PROP_LOSS_INTERVAL,
     PROP_COMPILED,
     N_PROPS,
 };
@@ -112,6 +119,14 @@ gann_network_class_init (GannNetworkClass *cls)
                             G_PARAM_READWRITE |
                             G_PARAM_STATIC_STRINGS);
 
+    props[PROP_BATCH_SIZE] =
+        g_param_spec_int ("batch-size",
+                          "Batch size",
+                          "Number of samples propagated at once",
+                          1, G_MAXINT16, 1,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS);
+
     props[PROP_LAYER_COUNT] =
         g_param_spec_int ("layer-count",
                           "Layer count",
@@ -136,6 +151,15 @@ gann_network_class_init (GannNetworkClass *cls)
                             G_PARAM_READWRITE |
                             G_PARAM_STATIC_STRINGS);
 
+    props[PROP_LOSS_INTERVAL] =
+        g_param_spec_int ("loss-interval",
+                          "Loss interval",
+                          "Backward steps between loss fetches, "
+                          "0 fetches only on demand",
+                          0, G_MAXINT32, 16,
+                          G_PARAM_READWRITE |
+                          G_PARAM_STATIC_STRINGS);
+
     props[PROP_COMPILED] =
         g_param_spec_boolean ("compiled",
                               "Compiled",
@@ -172,7 +196,6 @@ constructed (GObject *gobj)
     p->layer_arr = g_ptr_array_new_with_free_func (g_object_unref);
     p->output_list = NULL;
     p->propagation_list = NULL;
-    p->avg_loss = -1;
 
     G_OBJECT_CLASS (gann_network_parent_class)->constructed (gobj);
 }
@@ -204,6 +227,22 @@ set_property (GObject *gobj,
         gann_network_set_decay (self, g_value_get_float (value));
         break;
 
+    case PROP_BATCH_SIZE:
+        gann_network_set_batch_size (self, g_value_get_int (value));
+        break;
+
+    case PROP_LOSS:
+        gann_network_set_loss (self, g_value_get_float (value));
+        break;
+
+    case PROP_AVERAGE_LOSS:
+        gann_network_set_average_loss (self, g_value_get_float (value));
+        break;
+
+    case PROP_LOSS_INTERVAL:
+        gann_network_set_loss_interval (self, g_value_get_int (value));
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
     }
@@ -236,16 +275,24 @@ get_property (GObject *gobj,
         g_value_set_float (value, p->net->decay);
         break;
 
+    case PROP_BATCH_SIZE:
+        g_value_set_int (value, p->net->batch);
+        break;
+
     case PROP_LAYER_COUNT:
         g_value_set_int (value, p->layer_arr->len);
         break;
 
     case PROP_LOSS:
-        g_value_set_float (value, p->net->loss);
+        g_value_set_float (value, gann_network_get_loss (self));
         break;
 
     case PROP_AVERAGE_LOSS:
-        g_value_set_float (value, p->avg_loss);
+        g_value_set_float (value, gann_network_get_average_loss (self));
+        break;
+
+    case PROP_LOSS_INTERVAL:
+        g_value_set_int (value, p->net->loss_interval);
         break;
 
     case PROP_COMPILED:
@@ -311,15 +358,17 @@ gann_network_create_input (GannNetwork *self,
 
 /**
  * gann_network_create_output:
+ * @loss: loss function
  *
  * returns: (transfer none): New output layer instance
  */
 GannOutputLayer *
-gann_network_create_output (GannNetwork *self)
+gann_network_create_output (GannNetwork *self,
+                            GannLoss loss)
 {
     GannOutputLayer *output;
 
-    output = gann_output_layer_new (self);
+    output = gann_output_layer_new (self, loss);
     connect_two_last (self);
 
     return output;
@@ -365,10 +414,31 @@ gann_network_create_conv (GannNetwork *self,
     return conv;
 }
 
+/**
+ * gann_network_create_pool:
+ *
+ * returns: (transfer none): New pool layer instance
+ */
+GannPoolLayer *
+gann_network_create_pool (GannNetwork *self,
+                          GannPoolMode mode,
+                          gint size,
+                          gint stride)
+{
+    GannPoolLayer *pool;
+
+    pool = gann_pool_layer_new (self, mode, size, stride);
+    connect_two_last (self);
+
+    return pool;
+}
+
 /**
  * gann_network_forward:
  *
- * Propagates network forward
+ * Propagates network forward. Unlike core networks compiled
+ * without backpropagation, steps aren't recorded into execution
+ * plans, all layers are run every step
  */
 void
 gann_network_forward (GannNetwork *self)
@@ -389,32 +459,90 @@ gann_network_forward (GannNetwork *self)
     }
 }
 
+static void
+notify_loss (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    guint serial;
+
+    /*
+     * Loss is read from the device in background, notify
+     * only if new values arrived since the last check
+     */
+    serial = network_loss (p->net, NULL, NULL);
+
+    if (serial != p->loss_serial) {
+        p->loss_serial = serial;
+
+        g_object_notify_by_pspec (G_OBJECT (self),
+                                  props[PROP_LOSS]);
+        g_object_notify_by_pspec (G_OBJECT (self),
+                                  props[PROP_AVERAGE_LOSS]);
+    }
+}
+
 /**
  * gann_network_backward:
  *
- * Backpropagates network
+ * Backpropagates network. Layers made through the #GannNetwork
+ * API don't make core layers yet, so the core network stays
+ * empty and nothing is trained, only the loss is notified
  */
 void
 gann_network_backward (GannNetwork *self)
 {
-	return;
     GannNetworkPrivate *p = gann_network_get_instance_private (self);
 
     gann_network_compile (self);
 
     network_backward (p->net);
 
-    if (p->avg_loss < 0) {
-        p->avg_loss = p->net->loss;
-    } else {
-        p->avg_loss *= 0.99f;
-        p->avg_loss += p->net->loss * 0.01f;
-    }
+    notify_loss (self);
+}
 
-    g_object_notify_by_pspec (G_OBJECT (self),
-                              props[PROP_LOSS]);
-    g_object_notify_by_pspec (G_OBJECT (self),
-                              props[PROP_AVERAGE_LOSS]);
+/**
+ * gann_network_validate:
+ *
+ * Propagates network forward and back both in order and out of
+ * order from the same state, see #GannContext:out-of-order, and
+ * compares the results bit for bit. Blocks until it's done
+ *
+ * returns: whether results of both runs are equal, %FALSE
+ * without running anything if the device can't execute out
+ * of order
+ */
+gboolean
+gann_network_validate (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    gboolean equal;
+
+    gann_network_compile (self);
+
+    equal = network_validate (p->net);
+
+    notify_loss (self);
+
+    return equal;
+}
+
+/**
+ * gann_network_fetch_loss:
+ *
+ * Requests loss of the steps done since the last fetch without
+ * waiting for it, loss properties are updated on one of following
+ * backward or fetch calls once it's read
+ */
+void
+gann_network_fetch_loss (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    g_return_if_fail (p->compiled);
+
+    network_fetch_loss (p->net);
+
+    notify_loss (self);
 }
 
 static GSList *
@@ -452,6 +580,40 @@ build_propagation_list (GSList *roots)
     return list;
 }
 
+static void
+compile_begin (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    /*
+     * Programs are built in background from now on, so
+     * layers may go on creating and uploading buffers
+     */
+    p->build = context_build_begin (p->net->ctx);
+
+    g_ptr_array_foreach (p->layer_arr,
+                         (GFunc) gann_layer_compile,
+                         NULL);
+
+    network_compile (p->net);
+}
+
+static void
+compile_end (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    context_build_end (p->net->ctx, p->build);
+    p->build = NULL;
+
+    p->propagation_list = build_propagation_list (p->output_list);
+    p->compiling = FALSE;
+    p->compiled = TRUE;
+
+    g_object_notify_by_pspec (G_OBJECT (self),
+                              props[PROP_COMPILED]);
+}
+
 /**
  * gann_network_compile:
  *
@@ -466,15 +628,117 @@ gann_network_compile (GannNetwork *self)
         return;
     }
 
-    g_ptr_array_foreach (p->layer_arr,
-                         (GFunc) gann_layer_compile,
-                         NULL);
+    g_return_if_fail (!p->compiling);
 
-    p->propagation_list = build_propagation_list (p->output_list);
-    p->compiled = TRUE;
+    p->compiling = TRUE;
 
-    g_object_notify_by_pspec (G_OBJECT (self),
-                              props[PROP_COMPILED]);
+    compile_begin (self);
+    compile_end (self);
+}
+
+static void
+compile_wait (GTask *task,
+              gpointer source G_GNUC_UNUSED,
+              gpointer task_data,
+              GCancellable *cancellable G_GNUC_UNUSED)
+{
+    struct build *build = task_data;
+
+    context_build_wait (build);
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+compile_done (GObject *source,
+              GAsyncResult *result G_GNUC_UNUSED,
+              gpointer user_data)
+{
+    GTask *task = user_data;
+
+    compile_end (GANN_NETWORK (source));
+
+    /*
+     * Running builds can't be stopped, the network ends up
+     * compiled anyway
+     */
+    if (!g_task_return_error_if_cancelled (task)) {
+        g_task_return_boolean (task, TRUE);
+    }
+
+    g_object_unref (task);
+}
+
+/**
+ * gann_network_compile_async:
+ * @cancellable: (nullable): cancels the operation, the network is
+ * still compiled once the running builds finish, but
+ * gann_network_compile_finish fails with G_IO_ERROR_CANCELLED
+ * @callback: (scope async): callback called once compiled
+ * @user_data: (closure): user data for @callback
+ *
+ * Compiles network without blocking on the program builds, they
+ * run in background threads and @callback is called from the
+ * thread-default main context once all of them are finished.
+ * Other networks of the context may be compiled meanwhile, their
+ * programs are built separately
+ */
+void
+gann_network_compile_async (GannNetwork *self,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer user_data)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    GTask *task, *wait;
+
+    g_return_if_fail (!p->compiling);
+
+    task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, gann_network_compile_async);
+
+    if (p->compiled) {
+        g_task_return_boolean (task, TRUE);
+        g_object_unref (task);
+        return;
+    }
+
+    if (g_task_return_error_if_cancelled (task)) {
+        g_object_unref (task);
+        return;
+    }
+
+    p->compiling = TRUE;
+
+    compile_begin (self);
+
+    /*
+     * Compiles started before the builds are done get their
+     * own sessions
+     */
+    context_build_detach (p->net->ctx, p->build);
+
+    wait = g_task_new (self, NULL, compile_done, task);
+    g_task_set_task_data (wait, p->build, NULL);
+    g_task_run_in_thread (wait, compile_wait);
+    g_object_unref (wait);
+}
+
+/**
+ * gann_network_compile_finish:
+ *
+ * Finishes gann_network_compile_async
+ *
+ * returns: TRUE if the network is compiled
+ */
+gboolean
+gann_network_compile_finish (GannNetwork *self,
+                             GAsyncResult *result,
+                             GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+    return g_task_propagate_boolean (G_TASK (result), error);
 }
 
 static void
@@ -646,6 +910,38 @@ gann_network_get_decay (GannNetwork *self)
     return p->net->decay;
 }
 
+/**
+ * gann_network_set_batch_size:
+ * @batch: number of samples
+ *
+ * Sets number of samples propagated at once, weight updates are
+ * accumulated over all of them. It can't be changed once the
+ * network is compiled
+ */
+void
+gann_network_set_batch_size (GannNetwork *self,
+                             gint batch)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    g_return_if_fail (batch > 0);
+    g_return_if_fail (!p->compiled && !p->compiling);
+
+    if (batch != p->net->batch) {
+        p->net->batch = batch;
+        g_object_notify_by_pspec (G_OBJECT (self),
+                                  props[PROP_BATCH_SIZE]);
+    }
+}
+
+gint
+gann_network_get_batch_size (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    return p->net->batch;
+}
+
 gint
 gann_network_layer_count (GannNetwork *self)
 {
@@ -659,20 +955,34 @@ gann_network_set_loss (GannNetwork *self,
                        gfloat loss)
 {
     GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    gboolean changed;
+
+    g_mutex_lock (&p->net->loss_mutex);
+    changed = loss != p->net->loss;
+    p->net->loss = loss;
+    g_mutex_unlock (&p->net->loss_mutex);
 
-    if (loss != p->net->loss) {
-        p->net->loss = loss;
+    if (changed) {
         g_object_notify_by_pspec (G_OBJECT (self),
                                   props[PROP_LOSS]);
     }
 }
 
+/**
+ * gann_network_get_loss:
+ *
+ * returns: Loss of the lastly fetched step, doesn't wait for
+ * the device
+ */
 gfloat
 gann_network_get_loss (GannNetwork *self)
 {
     GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    float loss;
 
-    return p->net->loss;
+    network_loss (p->net, &loss, NULL);
+
+    return loss;
 }
 
 void
@@ -680,18 +990,62 @@ gann_network_set_average_loss (GannNetwork *self,
                                gfloat loss)
 {
     GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    gboolean changed;
+
+    g_mutex_lock (&p->net->loss_mutex);
+    changed = loss != p->net->average_loss;
+    p->net->average_loss = loss;
+    g_mutex_unlock (&p->net->loss_mutex);
 
-    if (loss != p->net->loss) {
-        p->avg_loss = loss;
+    if (changed) {
         g_object_notify_by_pspec (G_OBJECT (self),
-                                  props[PROP_LOSS]);
+                                  props[PROP_AVERAGE_LOSS]);
     }
 }
 
+/**
+ * gann_network_get_average_loss:
+ *
+ * returns: Running average of the fetched losses, doesn't wait
+ * for the device
+ */
 gfloat
 gann_network_get_average_loss (GannNetwork *self)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+    float average;
+
+    network_loss (p->net, NULL, &average);
+
+    return average;
+}
+
+/**
+ * gann_network_set_loss_interval:
+ * @interval: number of steps
+ *
+ * Sets number of backward steps between non-blocking loss fetches,
+ * with 0 loss is fetched only by gann_network_fetch_loss
+ */
+void
+gann_network_set_loss_interval (GannNetwork *self,
+                                gint interval)
+{
+    GannNetworkPrivate *p = gann_network_get_instance_private (self);
+
+    g_return_if_fail (interval >= 0);
+
+    if (interval != p->net->loss_interval) {
+        p->net->loss_interval = interval;
+        g_object_notify_by_pspec (G_OBJECT (self),
+                                  props[PROP_LOSS_INTERVAL]);
+    }
+}
+
+gint
+gann_network_get_loss_interval (GannNetwork *self)
 {
     GannNetworkPrivate *p = gann_network_get_instance_private (self);
 
-    return p->avg_loss;
+    return p->net->loss_interval;
 }
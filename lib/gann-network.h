@@ -21,7 +21,10 @@
 
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "gann-pool-layer.h"
+#include "gann-output-layer.h"
 
 G_BEGIN_DECLS
 
@@ -29,7 +32,6 @@ struct network;
 typedef struct _GannContext GannContext;
 typedef struct _GannLayer GannLayer;
 typedef struct _GannInputLayer GannInputLayer;
-typedef struct _GannOutputLayer GannOutputLayer;
 typedef struct _GannDenseLayer GannDenseLayer;
 typedef struct _GannConvLayer GannConvLayer;
 
@@ -51,7 +53,8 @@ GannInputLayer *gann_network_create_input (GannNetwork *self,
                                            gint width,
                                            gint height,
                                            gint depth);
-GannOutputLayer *gann_network_create_output (GannNetwork *self);
+GannOutputLayer *gann_network_create_output (GannNetwork *self,
+                                             GannLoss loss);
 GannDenseLayer *gann_network_create_dense (GannNetwork *self,
                                            gint width,
                                            gint height,
@@ -62,9 +65,22 @@ GannConvLayer *gann_network_create_conv (GannNetwork *self,
                                          gint stride,
                                          gint filters,
                                          const gchar *activation);
+GannPoolLayer *gann_network_create_pool (GannNetwork *self,
+                                         GannPoolMode mode,
+                                         gint size,
+                                         gint stride);
 void gann_network_forward (GannNetwork *self);
 void gann_network_backward (GannNetwork *self);
+gboolean gann_network_validate (GannNetwork *self);
+void gann_network_fetch_loss (GannNetwork *self);
 void gann_network_compile (GannNetwork *self);
+void gann_network_compile_async (GannNetwork *self,
+                                 GCancellable *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer user_data);
+gboolean gann_network_compile_finish (GannNetwork *self,
+                                      GAsyncResult *result,
+                                      GError **error);
 void gann_network_clear_propagated (GannNetwork *self);
 void gann_network_attach_layer (GannNetwork *self,
                                 GannLayer *layer);
@@ -82,6 +98,9 @@ gfloat gann_network_get_momentum (GannNetwork *self);
 void gann_network_set_decay (GannNetwork *self,
                              gfloat decay);
 gfloat gann_network_get_decay (GannNetwork *self);
+void gann_network_set_batch_size (GannNetwork *self,
+                                  gint batch);
+gint gann_network_get_batch_size (GannNetwork *self);
 gint gann_network_layer_count (GannNetwork *self);
 void gann_network_set_loss (GannNetwork *self,
                             gfloat loss);
@@ -89,5 +108,8 @@ gfloat gann_network_get_loss (GannNetwork *self);
 void gann_network_set_average_loss (GannNetwork *self,
                                     gfloat loss);
 gfloat gann_network_get_average_loss (GannNetwork *self);
+void gann_network_set_loss_interval (GannNetwork *self,
+                                     gint interval);
+gint gann_network_get_loss_interval (GannNetwork *self);
 
 G_END_DECLS
@@ -27,9 +27,24 @@ struct _GannOutputLayer
 {
     GannLayer parent_instance;
 	GannBuffer *truth_buffer;
+
+    GannLoss loss;
+};
+
+enum
+{
+    PROP_0,
+    PROP_LOSS,
+    N_PROPS,
 };
 
+static GParamSpec *props[N_PROPS];
+
 static void constructed (GObject *gobj);
+static void set_property (GObject *gobj, guint propid,
+                          const GValue *value, GParamSpec *spec);
+static void get_property (GObject *gobj, guint propid,
+                          GValue *value, GParamSpec *spec);
 static void compile (GannLayer *layer);
 static void forward (GannLayer *layer);
 static GannBuffer *value_buffer (GannLayer *self);
@@ -44,6 +59,26 @@ G_DEFINE_TYPE_WITH_CODE (GannOutputLayer, gann_output_layer,
                          G_IMPLEMENT_INTERFACE (GANN_TYPE_CL_BARRIER,
                                                 cl_barrier_init));
 
+GType
+gann_loss_get_type (void)
+{
+    static const GEnumValue values[] = {
+        { GANN_LOSS_SQUARE_ERROR, "GANN_LOSS_SQUARE_ERROR",
+          "square-error" },
+        { GANN_LOSS_SOFTMAX_CROSS_ENTROPY, "GANN_LOSS_SOFTMAX_CROSS_ENTROPY",
+          "softmax-cross-entropy" },
+        { 0, NULL, NULL },
+    };
+    static gsize type;
+
+    if (g_once_init_enter (&type)) {
+        g_once_init_leave (&type,
+                           g_enum_register_static ("GannLoss", values));
+    }
+
+    return type;
+}
+
 static void
 gann_output_layer_init (GannOutputLayer *self)
 {
@@ -56,9 +91,23 @@ gann_output_layer_class_init (GannOutputLayerClass *cls)
 	GannLayerClass *lcls = GANN_LAYER_CLASS (cls);
 
     gcls->constructed = constructed;
+    gcls->set_property = set_property;
+    gcls->get_property = get_property;
 	lcls->compile = compile;
 	lcls->forward = forward;
 	lcls->value_buffer = value_buffer;
+
+    props[PROP_LOSS] =
+        g_param_spec_enum ("loss",
+                           "Loss",
+                           "Loss function",
+                           GANN_TYPE_LOSS,
+                           GANN_LOSS_SQUARE_ERROR,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT_ONLY |
+                           G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties (gcls, N_PROPS, props);
 }
 
 static void
@@ -67,6 +116,42 @@ constructed (GObject *gobj)
     G_OBJECT_CLASS (gann_output_layer_parent_class)->constructed (gobj);
 }
 
+static void
+set_property (GObject *gobj,
+              guint propid,
+              const GValue *value,
+              GParamSpec *spec)
+{
+    GannOutputLayer *self = GANN_OUTPUT_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_LOSS:
+        self->loss = g_value_get_enum (value);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static void
+get_property (GObject *gobj,
+              guint propid,
+              GValue *value,
+              GParamSpec *spec)
+{
+    GannOutputLayer *self = GANN_OUTPUT_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_LOSS:
+        g_value_set_enum (value, self->loss);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
 static void
 compile (GannLayer *layer)
 {
@@ -84,7 +169,8 @@ compile (GannLayer *layer)
 
 	self->truth_buffer = gann_buffer_new (gann_layer_get_context (layer),
 										  G_TYPE_FLOAT,
-										  gann_layer_get_height (layer),
+										  gann_layer_get_height (layer)
+										  * gann_layer_get_batch (layer),
 										  gann_layer_get_width (layer),
 										  gann_layer_get_depth (layer));
 
@@ -133,18 +219,37 @@ backward_barrier (GannClBarrier *barrier,
 }
 
 GannOutputLayer *
-gann_output_layer_new (GannNetwork *network)
+gann_output_layer_new (GannNetwork *network,
+                       GannLoss loss)
 {
     return g_object_new (GANN_TYPE_OUTPUT_LAYER,
                          "network", network,
+                         "loss", loss,
                          NULL);
 }
 
+/**
+ * gann_output_layer_get_loss:
+ *
+ * returns: loss function
+ */
+GannLoss
+gann_output_layer_get_loss (GannOutputLayer *self)
+{
+    return self->loss;
+}
+
 void
 gann_output_layer_set_truth (GannOutputLayer *self,
                              const gfloat *data,
                              gsize datasize)
 {
+    GannLayer *layer = GANN_LAYER (self);
+
+    /* truth of the whole batch, like input values */
+    g_assert (datasize == (gsize) gann_layer_get_size (layer)
+              * gann_layer_get_batch (layer));
+
 	gann_buffer_write (self->truth_buffer,
 					   0, data, datasize);
 }
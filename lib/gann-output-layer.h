@@ -26,16 +26,35 @@
 G_BEGIN_DECLS
 
 #define GANN_TYPE_OUTPUT_LAYER (gann_output_layer_get_type ())
+#define GANN_TYPE_LOSS (gann_loss_get_type ())
+
+/**
+ * GannLoss:
+ * @GANN_LOSS_SQUARE_ERROR: square root of summed square errors
+ * @GANN_LOSS_SOFTMAX_CROSS_ENTROPY: cross entropy of softmax of
+ * the previous layer's values, averaged over the batch
+ */
+typedef enum
+{
+    GANN_LOSS_SQUARE_ERROR,
+    GANN_LOSS_SOFTMAX_CROSS_ENTROPY,
+} GannLoss;
+
+GType gann_loss_get_type (void);
 
 G_DECLARE_FINAL_TYPE (GannOutputLayer, gann_output_layer,
                       GANN, OUTPUT_LAYER, GannLayer);
 
 /**
  * gann_output_layer_new:
+ * @network: network instance to attach to
+ * @loss: loss function
  *
  * returns: (transfer full): New layer instance
  */
-GannOutputLayer *gann_output_layer_new (GannNetwork *network);
+GannOutputLayer *gann_output_layer_new (GannNetwork *network,
+                                        GannLoss loss);
+GannLoss gann_output_layer_get_loss (GannOutputLayer *self);
 
 
 /**
@@ -0,0 +1,253 @@
+/*
+ * gann-pool-layer.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gann-pool-layer.h"
+#include "gann-network.h"
+
+struct _GannPoolLayer
+{
+    GannLayer parent_instance;
+
+    GannPoolMode mode;
+    gint pool_size;
+    gint pool_stride;
+};
+
+G_DEFINE_TYPE (GannPoolLayer, gann_pool_layer, GANN_TYPE_LAYER);
+
+enum
+{
+    PROP_0,
+    PROP_MODE,
+    PROP_POOL_SIZE,
+    PROP_POOL_STRIDE,
+    N_PROPS,
+};
+
+static GParamSpec *props[N_PROPS];
+
+static void set_property (GObject *gobj, guint propid,
+                          const GValue *value, GParamSpec *spec);
+static void get_property (GObject *gobj, guint propid,
+                          GValue *value, GParamSpec *spec);
+static void compile (GannLayer *layer);
+
+GType
+gann_pool_mode_get_type (void)
+{
+    static const GEnumValue values[] = {
+        { GANN_POOL_MAX, "GANN_POOL_MAX", "max" },
+        { GANN_POOL_AVERAGE, "GANN_POOL_AVERAGE", "average" },
+        { 0, NULL, NULL },
+    };
+    static gsize type;
+
+    if (g_once_init_enter (&type)) {
+        g_once_init_leave (&type,
+                           g_enum_register_static ("GannPoolMode", values));
+    }
+
+    return type;
+}
+
+static void
+gann_pool_layer_init (GannPoolLayer *self)
+{
+}
+
+static void
+gann_pool_layer_class_init (GannPoolLayerClass *cls)
+{
+    GannLayerClass *lcls = GANN_LAYER_CLASS (cls);
+    GObjectClass *gcls = G_OBJECT_CLASS (cls);
+
+    gcls->set_property = set_property;
+    gcls->get_property = get_property;
+
+    lcls->compile = compile;
+
+    props[PROP_MODE] =
+        g_param_spec_enum ("mode",
+                           "Mode",
+                           "Pooling mode",
+                           GANN_TYPE_POOL_MODE,
+                           GANN_POOL_MAX,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT_ONLY |
+                           G_PARAM_STATIC_STRINGS);
+
+    props[PROP_POOL_SIZE] =
+        g_param_spec_int ("pool-size",
+                          "Pool size",
+                          "Window size",
+                          1, G_MAXINT32, 2,
+                          G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT_ONLY |
+                          G_PARAM_STATIC_STRINGS);
+
+    props[PROP_POOL_STRIDE] =
+        g_param_spec_int ("pool-stride",
+                          "Pool stride",
+                          "Window stride",
+                          1, G_MAXINT32, 2,
+                          G_PARAM_READWRITE |
+                          G_PARAM_CONSTRUCT_ONLY |
+                          G_PARAM_STATIC_STRINGS);
+
+    g_object_class_install_properties (gcls, N_PROPS, props);
+}
+
+static void
+set_property (GObject *gobj,
+              guint propid,
+              const GValue *value,
+              GParamSpec *spec)
+{
+    GannPoolLayer *self = GANN_POOL_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_MODE:
+        self->mode = g_value_get_enum (value);
+        break;
+
+    case PROP_POOL_SIZE:
+        self->pool_size = g_value_get_int (value);
+        break;
+
+    case PROP_POOL_STRIDE:
+        self->pool_stride = g_value_get_int (value);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static void
+get_property (GObject *gobj,
+              guint propid,
+              GValue *value,
+              GParamSpec *spec)
+{
+    GannPoolLayer *self = GANN_POOL_LAYER (gobj);
+
+    switch (propid) {
+    case PROP_MODE:
+        g_value_set_enum (value, self->mode);
+        break;
+
+    case PROP_POOL_SIZE:
+        g_value_set_int (value, self->pool_size);
+        break;
+
+    case PROP_POOL_STRIDE:
+        g_value_set_int (value, self->pool_stride);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (gobj, propid, spec);
+    }
+}
+
+static void
+compile (GannLayer *layer)
+{
+    GannPoolLayer *self;
+    GannLayer *prev;
+
+    self = GANN_POOL_LAYER (layer);
+    prev = gann_layer_prev_layer (layer);
+    g_assert_nonnull (prev);
+    g_assert (gann_layer_get_width (prev) >= self->pool_size);
+    g_assert (gann_layer_get_height (prev) >= self->pool_size);
+
+    /*
+     * Windows don't pad the input, depth is kept
+     */
+    g_object_set (self,
+                  "width", (gann_layer_get_width (prev) - self->pool_size)
+                           / self->pool_stride + 1,
+                  "height", (gann_layer_get_height (prev) - self->pool_size)
+                            / self->pool_stride + 1,
+                  "depth", gann_layer_get_depth (prev),
+                  NULL);
+
+    GANN_LAYER_CLASS (gann_pool_layer_parent_class)->compile (layer);
+}
+
+/**
+ * gann_pool_layer_new:
+ * @network: network instance to attach to
+ * @mode: max or average pooling
+ * @size: size of window, N for NxN window
+ * @stride: window stride
+ *
+ * returns: (transfer full): New pool layer instance
+ */
+GannPoolLayer *
+gann_pool_layer_new (GannNetwork *network,
+                     GannPoolMode mode,
+                     gint size,
+                     gint stride)
+{
+    return g_object_new (GANN_TYPE_POOL_LAYER,
+                         "network", network,
+                         "mode", mode,
+                         "pool-size", size,
+                         "pool-stride", stride,
+                         "width", -1,
+                         "height", -1,
+                         "depth", -1,
+                         NULL);
+}
+
+/**
+ * gann_pool_layer_get_mode:
+ *
+ * returns: pooling mode
+ */
+GannPoolMode
+gann_pool_layer_get_mode (GannPoolLayer *self)
+{
+    return self->mode;
+}
+
+/**
+ * gann_pool_layer_get_pool_size:
+ *
+ * returns: window size
+ */
+gint
+gann_pool_layer_get_pool_size (GannPoolLayer *self)
+{
+    return self->pool_size;
+}
+
+/**
+ * gann_pool_layer_get_pool_stride:
+ *
+ * returns: window stride
+ */
+gint
+gann_pool_layer_get_pool_stride (GannPoolLayer *self)
+{
+    return self->pool_stride;
+}
@@ -0,0 +1,55 @@
+/*
+ * gann-pool-layer.h
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "gann-layer.h"
+
+G_BEGIN_DECLS
+
+#define GANN_TYPE_POOL_LAYER (gann_pool_layer_get_type ())
+#define GANN_TYPE_POOL_MODE (gann_pool_mode_get_type ())
+
+/**
+ * GannPoolMode:
+ * @GANN_POOL_MAX: takes the max value of the window
+ * @GANN_POOL_AVERAGE: takes the average value of the window
+ */
+typedef enum
+{
+    GANN_POOL_MAX,
+    GANN_POOL_AVERAGE,
+} GannPoolMode;
+
+GType gann_pool_mode_get_type (void);
+
+G_DECLARE_FINAL_TYPE (GannPoolLayer, gann_pool_layer,
+                      GANN, POOL_LAYER, GannLayer);
+
+GannPoolLayer *gann_pool_layer_new (GannNetwork *network,
+                                    GannPoolMode mode,
+                                    gint size,
+                                    gint stride);
+GannPoolMode gann_pool_layer_get_mode (GannPoolLayer *self);
+gint gann_pool_layer_get_pool_size (GannPoolLayer *self);
+gint gann_pool_layer_get_pool_stride (GannPoolLayer *self);
+
+G_END_DECLS
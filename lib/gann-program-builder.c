@@ -216,41 +216,17 @@ gann_program_builder_kernel (GannProgramBuilder *self,
 void
 gann_program_builder_build (GannProgramBuilder *self)
 {
-    cl_context clctx;
-    cl_device_id cldev;
     cl_int err;
     cl_program prog;
-    size_t logsize;
-    gchar *logstr;
     GSList *progit;
     GHashTableIter kernit;
     gpointer kernptr, nameptr;
 
-    clctx = gann_context_cl_context (self->context);
-    cldev = gann_context_cl_device (self->context);
-
-    prog = clCreateProgramWithSource (clctx,
-                                      self->src_arr->len,
-                                      (const gchar **)
-                                      self->src_arr->pdata,
-                                      NULL, &err);
-    g_assert (err == CL_SUCCESS);
-
-    err = clBuildProgram (prog, 0, NULL,
-                          self->options->str,
-                          NULL, NULL);
-
-    if (err != CL_SUCCESS) {
-        clGetProgramBuildInfo (prog, cldev,
-                               CL_PROGRAM_BUILD_LOG,
-                               0, NULL, &logsize);
-        logstr = g_new (gchar, logsize);
-        clGetProgramBuildInfo (prog, cldev,
-                               CL_PROGRAM_BUILD_LOG,
-                               logsize, logstr, NULL);
-        g_error (logstr);
-        g_free (logstr);
-    }
+    prog = gann_context_build_program (self->context,
+                                       self->src_arr->len,
+                                       (const gchar **)
+                                       self->src_arr->pdata,
+                                       self->options->str);
 
     progit = self->prog_list;
 
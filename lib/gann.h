@@ -26,4 +26,5 @@
 #include "gann-output-layer.h"
 #include "gann-dense-layer.h"
 #include "gann-conv-layer.h"
+#include "gann-pool-layer.h"
 #include "gann-context.h"
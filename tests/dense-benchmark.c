@@ -0,0 +1,277 @@
+/*
+ * dense-benchmark.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+#include "util.h"
+
+/*
+ * Single sample backward kernel as it was before it was split into
+ * propagate and backward ones, each work-item owns an input and
+ * loops over all outputs, accessing weights with INPUTS stride
+ */
+static const char *fused_code =
+"__kernel void backward (__global const float *input_value_v,\n"
+"                        __global const float *gradient_v,\n"
+"                        __global float *input_gradient_v,\n"
+"                        __global float *weight_v,\n"
+"                        __global float *delta_v,\n"
+"                        const float rate,\n"
+"                        const float momentum,\n"
+"                        const float decay)\n"
+"{\n"
+"    __private int inid, w_index, outid;\n"
+"    __private float in, g, d, w, sum;\n"
+"\n"
+"    inid = get_global_id (0);\n"
+"\n"
+"    if (inid < INPUTS) {\n"
+"        in = input_value_v[inid];\n"
+"        sum = 0;\n"
+"\n"
+"        for (outid = 0; outid < OUTPUTS; outid++) {\n"
+"            w_index = outid * INPUTS + inid;\n"
+"            g = gradient_v[outid];\n"
+"            d = delta_v[w_index];\n"
+"            w = weight_v[w_index];\n"
+"\n"
+"            d = d * momentum + g * rate * in;\n"
+"            w = w * decay + d;\n"
+"            sum += g * w;\n"
+"\n"
+"            weight_v[w_index] = w;\n"
+"            delta_v[w_index] = d;\n"
+"        }\n"
+"\n"
+"        input_gradient_v[inid] += sum;\n"
+"    }\n"
+"}\n";
+
+/*
+ * Buffers of a single sample dense layer and its input
+ */
+struct buffers
+{
+    cl_mem input;
+    cl_mem gradient;
+    cl_mem derivative;
+    cl_mem input_gradient;
+    cl_mem weight;
+    cl_mem delta;
+};
+
+static cl_mem
+make_buffer (struct context *ctx,
+             int size)
+{
+    cl_int err;
+    cl_mem mem;
+
+    mem = clCreateBuffer (ctx->context, CL_MEM_READ_WRITE,
+                          size * sizeof (cl_float), NULL, &err);
+    g_assert (err == CL_SUCCESS);
+
+    context_clear_buffer (ctx, mem, size, NULL);
+
+    return mem;
+}
+
+static void
+set_options (struct context *ctx,
+             int size)
+{
+    context_program_option (ctx, "-DINPUTS=%d", size);
+    context_program_option (ctx, "-DOUTPUTS=%d", size);
+    context_program_option (ctx, "-DBATCH=1");
+    context_program_option (ctx, "-DGROUP_SIZE=%d", ctx->group_size);
+    context_program_option (ctx, "-DWITH_DERIVATIVE");
+    context_program_option (ctx, "-DFUSED_DERIVATIVE");
+    context_program_option (ctx, "-DCALC_GRADIENT");
+}
+
+static void
+set_update_args (cl_kernel kern,
+                 struct buffers *buf)
+{
+    cl_float rate, momentum, decay;
+
+    rate = 0.05f;
+    momentum = 0.9f;
+    decay = 1.0f;
+
+    clSetKernelArg (kern, 3, sizeof (cl_mem), &buf->weight);
+    clSetKernelArg (kern, 4, sizeof (cl_mem), &buf->delta);
+    clSetKernelArg (kern, 5, sizeof (cl_float), &rate);
+    clSetKernelArg (kern, 6, sizeof (cl_float), &momentum);
+    clSetKernelArg (kern, 7, sizeof (cl_float), &decay);
+}
+
+/*
+ * Gives average time of the fused backward step in milliseconds
+ */
+static double
+time_fused (struct context *ctx,
+            struct buffers *buf,
+            int size,
+            int steps)
+{
+    cl_program program;
+    cl_kernel kern;
+    gint64 start;
+    int step;
+
+    context_program_clear (ctx);
+    context_program_code (ctx, fused_code);
+    context_program_option (ctx, "-DINPUTS=%d", size);
+    context_program_option (ctx, "-DOUTPUTS=%d", size);
+    context_program_build (ctx, &program);
+    context_program_kernel (ctx, "backward", &kern);
+
+    clSetKernelArg (kern, 0, sizeof (cl_mem), &buf->input);
+    clSetKernelArg (kern, 1, sizeof (cl_mem), &buf->gradient);
+    clSetKernelArg (kern, 2, sizeof (cl_mem), &buf->input_gradient);
+    set_update_args (kern, buf);
+
+    /*
+     * First step is a warm-up
+     */
+    context_run_sparse (ctx, kern, size, 0, NULL, NULL);
+    clFinish (ctx->queue);
+
+    start = g_get_monotonic_time ();
+
+    for (step = 0; step < steps; step++) {
+        context_run_sparse (ctx, kern, size, 0, NULL, NULL);
+    }
+
+    clFinish (ctx->queue);
+
+    clReleaseKernel (kern);
+    context_program_release (ctx, program);
+
+    return (g_get_monotonic_time () - start) / 1000.0 / steps;
+}
+
+/*
+ * Gives average time of the split backward step in milliseconds,
+ * it's run the same way as by dense layers
+ */
+static double
+time_split (struct context *ctx,
+            struct buffers *buf,
+            int size,
+            int steps)
+{
+    cl_program program;
+    cl_kernel propagate, update;
+    size_t globsiz, locsiz;
+    gint64 start;
+    int step;
+
+    context_program_clear (ctx);
+    set_options (ctx, size);
+    context_program_file (ctx, "dense-layer.cl");
+    context_program_build (ctx, &program);
+    context_program_kernel (ctx, "propagate", &propagate);
+    context_program_kernel (ctx, "backward", &update);
+
+    clSetKernelArg (propagate, 0, sizeof (cl_mem), &buf->gradient);
+    clSetKernelArg (propagate, 1, sizeof (cl_mem), &buf->derivative);
+    clSetKernelArg (propagate, 2, sizeof (cl_mem), &buf->weight);
+    clSetKernelArg (propagate, 3, sizeof (cl_mem), &buf->input_gradient);
+
+    clSetKernelArg (update, 0, sizeof (cl_mem), &buf->input);
+    clSetKernelArg (update, 1, sizeof (cl_mem), &buf->gradient);
+    clSetKernelArg (update, 2, sizeof (cl_mem), &buf->derivative);
+    set_update_args (update, buf);
+
+    locsiz = ctx->group_size;
+    globsiz = util_upper_multiply (size, locsiz);
+    start = 0;
+
+    for (step = -1; step < steps; step++) {
+        /*
+         * First step is a warm-up
+         */
+        if (step == 0) {
+            clFinish (ctx->queue);
+            start = g_get_monotonic_time ();
+        }
+
+        context_run_kernel (ctx, propagate, 1, &globsiz, &locsiz,
+                            0, NULL, NULL);
+        context_run_sparse (ctx, update, size * size, 0, NULL, NULL);
+    }
+
+    clFinish (ctx->queue);
+
+    clReleaseKernel (propagate);
+    clReleaseKernel (update);
+    context_program_release (ctx, program);
+
+    return (g_get_monotonic_time () - start) / 1000.0 / steps;
+}
+
+static void
+run (struct context *ctx,
+     int size,
+     int steps)
+{
+    struct buffers buf;
+    double fused, split;
+
+    buf.input = make_buffer (ctx, size);
+    buf.gradient = make_buffer (ctx, size);
+    buf.derivative = make_buffer (ctx, size);
+    buf.input_gradient = make_buffer (ctx, size);
+    buf.weight = make_buffer (ctx, size * size);
+    buf.delta = make_buffer (ctx, size * size);
+
+    fused = time_fused (ctx, &buf, size, steps);
+    split = time_split (ctx, &buf, size, steps);
+
+    g_print ("dense backward %dx%d: fused %.3f ms, split %.3f ms, "
+             "speedup %.2fx\n", size, size, fused, split, fused / split);
+
+    clReleaseMemObject (buf.input);
+    clReleaseMemObject (buf.gradient);
+    clReleaseMemObject (buf.derivative);
+    clReleaseMemObject (buf.input_gradient);
+    clReleaseMemObject (buf.weight);
+    clReleaseMemObject (buf.delta);
+}
+
+int
+main (int argc G_GNUC_UNUSED,
+      char *argv[] G_GNUC_UNUSED)
+{
+    struct context *ctx;
+
+    ctx = context_create ();
+
+    g_print ("device: %s\n", ctx->device_name);
+
+    run (ctx, 1024, 50);
+    run (ctx, 4096, 10);
+
+    context_free (ctx);
+
+    return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * gemm-test.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+
+#include <math.h>
+
+#define BATCH 2
+#define WIDTH 9
+#define HEIGHT 7
+#define DEPTH 16
+#define FILTERS 16
+#define TOLERANCE 1e-4f
+
+struct kernel_case
+{
+    int size;
+    int stride;
+};
+
+static const struct kernel_case cases[] = {
+    { 3, 1 },
+    { 3, 2 },
+    { 5, 1 },
+};
+
+/*
+ * Convolution trained against square error, identity pooling in
+ * front of it receives the propagated gradients
+ */
+struct conv_net
+{
+    struct network *net;
+    struct layer *input;
+    struct layer *pool;
+    struct layer *conv;
+    struct layer *out;
+};
+
+static void
+make_conv (struct context *ctx,
+           const struct kernel_case *kernel,
+           enum conv_backend backend,
+           struct conv_net *cn)
+{
+    cn->net = network_create (ctx);
+    cn->net->batch = BATCH;
+    cn->net->loss_interval = 0;
+
+    cn->input = layer_make_input (cn->net, WIDTH, HEIGHT, DEPTH);
+    cn->pool = layer_make_pool (cn->net, POOL_AVERAGE, 1, 1);
+    cn->conv = layer_make_conv (cn->net, kernel->size, kernel->stride,
+                                FILTERS, "linear");
+    cn->out = layer_make_output (cn->net, LOSS_SQUARE_ERROR);
+    layer_conv_set_backend (cn->conv, backend);
+
+    network_push_layer (cn->net, cn->input);
+    network_push_layer (cn->net, cn->pool);
+    network_push_layer (cn->net, cn->conv);
+    network_push_layer (cn->net, cn->out);
+    network_compile (cn->net);
+}
+
+static float *
+read_buffer (struct context *ctx,
+             cl_mem mem,
+             int size)
+{
+    float *values;
+    cl_int err;
+
+    values = g_new (float, size);
+
+    err = clEnqueueReadBuffer (ctx->queue, mem, CL_TRUE,
+                               0, size * sizeof (cl_float),
+                               values, 0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    return values;
+}
+
+static void
+copy_buffer (struct context *ctx,
+             cl_mem src,
+             cl_mem dst,
+             int size)
+{
+    cl_int err;
+
+    err = clEnqueueCopyBuffer (ctx->queue, src, dst,
+                               0, 0, size * sizeof (cl_float),
+                               0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+}
+
+static void
+step (struct conv_net *cn,
+      const float *input,
+      const float *truth)
+{
+    layer_input_set_data (cn->input, input,
+                          BATCH * WIDTH * HEIGHT * DEPTH);
+    layer_output_set_truth (cn->out, truth,
+                            cn->out->batch * cn->out->size);
+
+    network_forward (cn->net);
+    network_backward (cn->net);
+    clFinish (cn->net->ctx->queue);
+}
+
+static void
+compare (struct context *ctx,
+         const char *what,
+         cl_mem expected_mem,
+         cl_mem mem,
+         int size)
+{
+    g_autofree float *expected = NULL;
+    g_autofree float *values = NULL;
+    float scale;
+    int i;
+
+    expected = read_buffer (ctx, expected_mem, size);
+    values = read_buffer (ctx, mem, size);
+
+    for (i = 0; i < size; i++) {
+        scale = MAX (1.0f, fabsf (expected[i]));
+
+        if (fabsf (values[i] - expected[i]) > TOLERANCE * scale) {
+            g_error ("%s %d is %f, direct convolution gives %f",
+                     what, i, values[i], expected[i]);
+        }
+    }
+}
+
+static void
+test_kernel (gconstpointer data)
+{
+    const struct kernel_case *kernel = data;
+    struct conv_net direct, gemm;
+    struct context *ctx;
+    float input[BATCH * WIDTH * HEIGHT * DEPTH];
+    g_autofree float *truth = NULL;
+    int i, outputs;
+
+    ctx = context_create ();
+    make_conv (ctx, kernel, CONV_BACKEND_DIRECT, &direct);
+    make_conv (ctx, kernel, CONV_BACKEND_GEMM, &gemm);
+
+    g_assert_cmpint (direct.conv->size, ==, gemm.conv->size);
+
+    /*
+     * Both layers start from the same filters
+     */
+    copy_buffer (ctx, direct.conv->weight_mem, gemm.conv->weight_mem,
+                 direct.conv->weights);
+    copy_buffer (ctx, direct.conv->bias_mem, gemm.conv->bias_mem,
+                 direct.conv->depth);
+
+    outputs = direct.conv->batch * direct.conv->size;
+    truth = g_new (float, outputs);
+
+    for (i = 0; i < BATCH * WIDTH * HEIGHT * DEPTH; i++) {
+        input[i] = sinf (i * 0.37f);
+    }
+
+    for (i = 0; i < outputs; i++) {
+        truth[i] = cosf (i * 0.11f);
+    }
+
+    step (&direct, input, truth);
+    step (&gemm, input, truth);
+
+    compare (ctx, "value", direct.conv->value_mem, gemm.conv->value_mem,
+             outputs);
+    compare (ctx, "gradient", direct.pool->gradient_mem,
+             gemm.pool->gradient_mem,
+             direct.pool->batch * direct.pool->size);
+    compare (ctx, "weight", direct.conv->weight_mem, gemm.conv->weight_mem,
+             direct.conv->weights);
+
+    network_free (direct.net);
+    network_free (gemm.net);
+    context_free (ctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_data_func ("/conv/gemm/3x3",
+                          &cases[0], test_kernel);
+    g_test_add_data_func ("/conv/gemm/3x3-stride-2",
+                          &cases[1], test_kernel);
+    g_test_add_data_func ("/conv/gemm/5x5",
+                          &cases[2], test_kernel);
+
+    return g_test_run ();
+}
@@ -0,0 +1,220 @@
+/*
+ * output-test.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+
+#include <math.h>
+
+#define TOLERANCE 1e-3
+
+struct output_case
+{
+    enum loss_function loss;
+    int batch;
+    int size;
+};
+
+static const struct output_case cases[] = {
+    { LOSS_SQUARE_ERROR, 1, 1 },
+    { LOSS_SQUARE_ERROR, 1, 255 },
+    { LOSS_SQUARE_ERROR, 1, 256 },
+    { LOSS_SQUARE_ERROR, 1, 10000 },
+    { LOSS_SQUARE_ERROR, 1, 1000000 },
+    { LOSS_SOFTMAX_CROSS_ENTROPY, 1, 255 },
+    { LOSS_SOFTMAX_CROSS_ENTROPY, 2, 256 },
+    { LOSS_SOFTMAX_CROSS_ENTROPY, 3, 10000 },
+};
+
+/*
+ * Gives the loss of the values and writes the gradients the output
+ * layer adds to its previous layer's ones, computed on the host
+ */
+static double
+reference (const struct output_case *test,
+           const float *value,
+           const float *truth,
+           double *gradient)
+{
+    double sum, max, lse, loss;
+    int sample, i, base;
+
+    loss = 0;
+
+    if (test->loss == LOSS_SQUARE_ERROR) {
+        for (i = 0; i < test->batch * test->size; i++) {
+            loss += ((double) truth[i] - value[i])
+                * ((double) truth[i] - value[i]);
+        }
+
+        loss = sqrt (loss);
+
+        for (i = 0; i < test->batch * test->size; i++) {
+            gradient[i] = ((double) truth[i] - value[i]) * loss;
+        }
+
+        return loss;
+    }
+
+    for (sample = 0; sample < test->batch; sample++) {
+        base = sample * test->size;
+        max = value[base];
+        sum = 0;
+
+        for (i = 0; i < test->size; i++) {
+            max = MAX (max, value[base + i]);
+        }
+
+        for (i = 0; i < test->size; i++) {
+            sum += exp (value[base + i] - max);
+        }
+
+        lse = max + log (sum);
+
+        for (i = 0; i < test->size; i++) {
+            loss += truth[base + i] * (lse - value[base + i]);
+            gradient[base + i] = truth[base + i]
+                - exp (value[base + i] - lse);
+        }
+    }
+
+    return loss / test->batch;
+}
+
+static void
+check (const char *what,
+       int index,
+       double result,
+       double expected)
+{
+    if (fabs (result - expected) > TOLERANCE * MAX (1.0, fabs (expected))) {
+        g_error ("%s %d is %f, expected %f", what, index, result, expected);
+    }
+}
+
+static void
+test_output (gconstpointer data)
+{
+    const struct output_case *test = data;
+    struct context *ctx;
+    struct network *net;
+    struct layer *input, *pool, *out;
+    float *value, *truth, *gradient, loss;
+    double *expected;
+    guint serial;
+    cl_int err;
+    int units, i;
+
+    units = test->batch * test->size;
+
+    ctx = context_create ();
+    net = network_create (ctx);
+    net->batch = test->batch;
+    net->loss_interval = 0;
+
+    /*
+     * Identity pooling gives the output layer a previous
+     * layer with gradients
+     */
+    input = layer_make_input (net, 1, 1, test->size);
+    pool = layer_make_pool (net, POOL_AVERAGE, 1, 1);
+    out = layer_make_output (net, test->loss);
+
+    network_push_layer (net, input);
+    network_push_layer (net, pool);
+    network_push_layer (net, out);
+    network_compile (net);
+
+    value = g_new (float, units);
+    truth = g_new0 (float, units);
+    gradient = g_new (float, units);
+    expected = g_new (double, units);
+
+    for (i = 0; i < units; i++) {
+        value[i] = sinf (i * 0.1f) * 0.5f;
+
+        if (test->loss == LOSS_SQUARE_ERROR) {
+            truth[i] = cosf (i * 0.07f) * 0.5f;
+        }
+    }
+
+    /*
+     * One-hot truth of softmax samples
+     */
+    for (i = 0; i < test->batch && test->loss != LOSS_SQUARE_ERROR; i++) {
+        truth[i * test->size + (i * 7919) % test->size] = 1;
+    }
+
+    layer_input_set_data (input, value, units);
+    layer_output_set_truth (out, truth, units);
+
+    serial = network_loss (net, NULL, NULL);
+
+    network_forward (net);
+    network_backward (net);
+    network_fetch_loss (net);
+    clFinish (ctx->queue);
+
+    /*
+     * Loss arrives through the read callback
+     */
+    while (network_loss (net, &loss, NULL) == serial) {
+        g_usleep (1000);
+    }
+
+    err = clEnqueueReadBuffer (ctx->queue, pool->gradient_mem, CL_TRUE,
+                               0, units * sizeof (cl_float), gradient,
+                               0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    check ("loss", 0, loss, reference (test, value, truth, expected));
+
+    for (i = 0; i < units; i++) {
+        check ("gradient", i, gradient[i], expected[i]);
+    }
+
+    g_free (value);
+    g_free (truth);
+    g_free (gradient);
+    g_free (expected);
+    network_free (net);
+    context_free (ctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_autofree char *path = NULL;
+    guint i;
+
+    g_test_init (&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+        g_clear_pointer (&path, g_free);
+        path = g_strdup_printf ("/output/%s/%dx%d",
+                                cases[i].loss == LOSS_SQUARE_ERROR
+                                ? "square-error" : "softmax",
+                                cases[i].batch, cases[i].size);
+
+        g_test_add_data_func (path, &cases[i], test_output);
+    }
+
+    return g_test_run ();
+}
@@ -0,0 +1,150 @@
+/*
+ * validate-test.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+
+#include <string.h>
+
+#define BATCH 4
+#define INPUTS 6
+#define HIDDEN 8
+#define OUTPUTS 3
+
+/*
+ * Network with a hidden layer fanning out to two branches, each
+ * ending with its own output layer
+ */
+static struct network *
+make_fan_out (struct context *ctx,
+              struct layer **hidden)
+{
+    struct network *net;
+    struct layer *input, *left, *right, *out;
+    float data[BATCH * INPUTS], truth[BATCH * OUTPUTS];
+    int i;
+
+    net = network_create (ctx);
+    net->batch = BATCH;
+
+    input = layer_make_input (net, INPUTS, 1, 1);
+    *hidden = layer_make_dense (net, HIDDEN, 1, 1, "sigmoid");
+    left = layer_make_dense (net, OUTPUTS, 1, 1, "sigmoid");
+    right = layer_make_dense (net, OUTPUTS, 1, 1, "relu");
+
+    network_add_layer (net, input);
+    network_add_layer (net, *hidden);
+    network_add_layer (net, left);
+    network_add_layer (net, right);
+    layer_append (input, *hidden);
+    layer_append (*hidden, left);
+    layer_append (*hidden, right);
+
+    out = layer_make_output (net, LOSS_SQUARE_ERROR);
+    network_add_layer (net, out);
+    layer_append (left, out);
+
+    out = layer_make_output (net, LOSS_SOFTMAX_CROSS_ENTROPY);
+    network_add_layer (net, out);
+    layer_append (right, out);
+
+    network_compile (net);
+
+    for (i = 0; i < BATCH * INPUTS; i++) {
+        data[i] = (i % 7) / 7.0f;
+    }
+
+    for (i = 0; i < BATCH * OUTPUTS; i++) {
+        truth[i] = i % OUTPUTS == i / OUTPUTS % OUTPUTS;
+    }
+
+    layer_input_set_data (input, data, BATCH * INPUTS);
+    layer_output_set_truth (network_layer (net, -2),
+                            truth, BATCH * OUTPUTS);
+    layer_output_set_truth (network_layer (net, -1),
+                            truth, BATCH * OUTPUTS);
+
+    return net;
+}
+
+static void
+read_weights (struct layer *lay,
+              float *weights)
+{
+    cl_int err;
+
+    err = clEnqueueReadBuffer (lay->net->ctx->queue, lay->weight_mem,
+                               CL_TRUE, 0,
+                               lay->weights * sizeof (cl_float),
+                               weights, 0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+}
+
+static void
+test_fan_out (void)
+{
+    struct context *ctx;
+    struct network *net;
+    struct layer *hidden;
+    float *before, *after;
+
+    ctx = context_create ();
+    net = make_fan_out (ctx, &hidden);
+
+    before = g_new (float, hidden->weights);
+    after = g_new (float, hidden->weights);
+    read_weights (hidden, before);
+
+    if (!context_set_out_of_order (ctx, TRUE)) {
+        /*
+         * Nothing is compared nor trained then
+         */
+        g_assert_false (network_validate (net));
+
+        read_weights (hidden, after);
+        g_assert (memcmp (before, after,
+                          hidden->weights * sizeof (float)) == 0);
+
+        g_test_skip ("device can't execute out of order");
+    } else {
+        context_set_out_of_order (ctx, FALSE);
+        g_assert_true (network_validate (net));
+        g_assert_false (context_out_of_order (ctx));
+
+        read_weights (hidden, after);
+        g_assert (memcmp (before, after,
+                          hidden->weights * sizeof (float)) != 0);
+    }
+
+    g_free (before);
+    g_free (after);
+    network_free (net);
+    context_free (ctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/network/validate/fan-out", test_fan_out);
+
+    return g_test_run ();
+}
@@ -0,0 +1,161 @@
+/*
+ * winograd-test.c
+ *
+ * Copyright 2020 Mieszko Mazurek <mimaz@gmx.com>
+ *
+ * This file is part of Gann.
+ *
+ * Gann is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Gann is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Gann.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+
+#include <math.h>
+
+#define BATCH 2
+#define WIDTH 9
+#define HEIGHT 7
+#define DEPTH 3
+#define FILTERS 4
+#define TOLERANCE 1e-4f
+
+struct padding_case
+{
+    enum conv_padding padding;
+    int xpad;
+    int ypad;
+};
+
+static const struct padding_case cases[] = {
+    { CONV_PADDING_SAME, 0, 0 },
+    { CONV_PADDING_VALID, 0, 0 },
+    { CONV_PADDING_EXPLICIT, 1, 2 },
+};
+
+/*
+ * Inference network of a single 3x3 stride 1 convolution
+ */
+static struct network *
+make_conv (struct context *ctx,
+           const struct padding_case *pad,
+           enum conv_backend backend,
+           struct layer **conv)
+{
+    struct network *net;
+    struct layer *input;
+
+    net = network_create (ctx);
+    net->batch = BATCH;
+    net->flags = 0;
+
+    input = layer_make_input (net, WIDTH, HEIGHT, DEPTH);
+    *conv = layer_make_conv (net, 3, 1, FILTERS, "linear");
+    layer_conv_set_padding (*conv, pad->padding, pad->xpad, pad->ypad);
+    layer_conv_set_backend (*conv, backend);
+
+    network_push_layer (net, input);
+    network_push_layer (net, *conv);
+    network_compile (net);
+
+    return net;
+}
+
+static float *
+run (struct network *net,
+     struct layer *conv,
+     const float *data)
+{
+    float *values;
+    cl_int err;
+
+    layer_input_set_data (network_layer (net, 0), data,
+                          BATCH * WIDTH * HEIGHT * DEPTH);
+    network_forward (net);
+
+    values = g_new (float, conv->batch * conv->size);
+
+    err = clEnqueueReadBuffer (net->ctx->queue, conv->value_mem, CL_TRUE,
+                               0, conv->batch * conv->size
+                               * sizeof (cl_float),
+                               values, 0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    return values;
+}
+
+static void
+test_padding (gconstpointer data)
+{
+    const struct padding_case *pad = data;
+    struct network *direct_net, *winograd_net;
+    struct layer *direct, *winograd;
+    struct context *ctx;
+    float input[BATCH * WIDTH * HEIGHT * DEPTH];
+    float *expected, *values, scale;
+    cl_int err;
+    int i;
+
+    ctx = context_create ();
+    direct_net = make_conv (ctx, pad, CONV_BACKEND_DIRECT, &direct);
+    winograd_net = make_conv (ctx, pad, CONV_BACKEND_WINOGRAD, &winograd);
+
+    g_assert_cmpint (direct->size, ==, winograd->size);
+
+    /*
+     * Both layers use the same filters, Winograd ones are
+     * transformed by the first forward step
+     */
+    err = clEnqueueCopyBuffer (ctx->queue,
+                               direct->weight_mem, winograd->weight_mem,
+                               0, 0, direct->weights * sizeof (cl_float),
+                               0, NULL, NULL);
+    g_assert (err == CL_SUCCESS);
+
+    for (i = 0; i < BATCH * WIDTH * HEIGHT * DEPTH; i++) {
+        input[i] = sinf (i * 0.37f);
+    }
+
+    expected = run (direct_net, direct, input);
+    values = run (winograd_net, winograd, input);
+
+    for (i = 0; i < direct->batch * direct->size; i++) {
+        scale = MAX (1.0f, fabsf (expected[i]));
+
+        if (fabsf (values[i] - expected[i]) > TOLERANCE * scale) {
+            g_error ("value %d is %f, direct convolution gives %f",
+                     i, values[i], expected[i]);
+        }
+    }
+
+    g_free (expected);
+    g_free (values);
+    network_free (direct_net);
+    network_free (winograd_net);
+    context_free (ctx);
+}
+
+int
+main (int argc, char *argv[])
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_data_func ("/conv/winograd/same",
+                          &cases[0], test_padding);
+    g_test_add_data_func ("/conv/winograd/valid",
+                          &cases[1], test_padding);
+    g_test_add_data_func ("/conv/winograd/explicit",
+                          &cases[2], test_padding);
+
+    return g_test_run ();
+}